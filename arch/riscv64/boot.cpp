@@ -36,8 +36,12 @@ SOFTWARE.
 #define ARGPAGES 2
 #endif
 
+extern "C" byte _secondary_start;
+
 using namespace hls;
 
+static_assert(sizeof(bootinfo) <= 240, "asm.S reserves 256 bytes for argc, argv and bootinfo.");
+
 LKERNELBSS alignas(PAGE_FRAME_SIZE) byte INITIAL_FRAMES[FrameKB::s_size * BOOTPAGES];
 LKERNELBSS alignas(PAGE_FRAME_SIZE) byte ARGCV[FrameKB::s_size * ARGPAGES];
 LKERNELDATA static size_t s_used = 0;
@@ -45,6 +49,7 @@ LKERNELRODATA const char NEEDPAGES[] = "Not enough pages. Please, compile kernel
 LKERNELRODATA const char NEEDARGCV[] =
     "Not enough pages for arguments. Please, compile kernel with higher ARGPAGES option.";
 LKERNELDATA byte *kvaddress = reinterpret_cast<byte *>(uintptr_t(0) - uintptr_t(0x40000000));
+LKERNELDATA FrameOrder s_root_order = FrameOrder::HIGHEST_ORDER;
 
 LKERNELFUN void _sbi_call(uint64_t extension, uint64_t function_id, uint64_t arg0, uint64_t arg1, uint64_t arg2,
                           uint64_t arg3, uint64_t arg4, uint64_t arg5)
@@ -176,7 +181,7 @@ LKERNELFUN PageTable *bkmmap(const void *paddress, const void *vaddress, PageTab
     if (table == nullptr)
         return nullptr;
 
-    FrameOrder c_lvl = FrameOrder::HIGHEST_ORDER;
+    FrameOrder c_lvl = s_root_order;
     FrameOrder expected = nvpn(c_lvl);
     PageTable *t = table;
 
@@ -289,6 +294,44 @@ LKERNELFUN const char **map_args(PageTable *kernel_table, int argc, const char *
     return reinterpret_cast<const char **>(old_kv + consumed_bytes);
 }
 
+// Finds the deepest paging mode supported by the hart. Writing an unsupported mode to satp has no effect, so each
+// candidate is written and read back. In the meantime, a single leaf of the (still empty) kernel table identity maps
+// the code running the probe.
+LKERNELFUN FrameOrder probe_root_order(PageTable *kernel_table)
+{
+#ifdef SVAUTO
+    auto entries = reinterpret_cast<TableEntry *>(kernel_table);
+    uintptr_t pc = buintptr_t(reinterpret_cast<const void *>(&probe_root_order));
+    constexpr size_t deepest = static_cast<size_t>(FrameOrder::FIFTH_ORDER);
+    constexpr size_t shallowest = static_cast<size_t>(FrameOrder::THIRD_ORDER);
+    for (size_t order = deepest; order > shallowest; --order)
+    {
+        size_t shift = order * 9 + 12;
+        size_t idx = pe_idx(bptr(pc), static_cast<FrameOrder>(order));
+        entries[idx].data = (((pc >> shift) << shift) >> 12) << 10;
+        entries[idx].data = entries[idx].data | VALID | READ | WRITE | EXECUTE | ACCESS | DIRTY;
+
+        uint64_t satp = ((uint64_t(order) + 6) << SATP_MODE_SHIFT) | (buintptr_t(kernel_table) >> 12);
+        uint64_t readback = 0;
+        asm volatile("sfence.vma x0, x0\n"
+                     "csrw satp, %1\n"
+                     "csrr %0, satp\n"
+                     "csrw satp, x0\n"
+                     "sfence.vma x0, x0"
+                     : "=&r"(readback)
+                     : "r"(satp)
+                     : "memory");
+        entries[idx].data = 0;
+        if (readback == satp)
+            return static_cast<FrameOrder>(order);
+    }
+    return FrameOrder::THIRD_ORDER;
+#else
+    (void)(kernel_table);
+    return FrameOrder::HIGHEST_ORDER;
+#endif
+}
+
 LKERNELFUN PageTable *force_scratch_page(PageTable *kernel_table)
 {
     byte *p = nullptr;
@@ -304,6 +347,7 @@ extern "C" LKERNELFUN void bootmain(int argc, const char **argv, bootinfo *info)
 {
     init_f_alloc();
     PageTable *kernel_table = reinterpret_cast<PageTable *>(f_alloc());
+    s_root_order = probe_root_order(kernel_table);
     auto *k_ph_end = map_high_kernel(kernel_table);
     auto scratch = force_scratch_page(kernel_table);
     identity_map(kernel_table);
@@ -320,4 +364,6 @@ extern "C" LKERNELFUN void bootmain(int argc, const char **argv, bootinfo *info)
     info->p_kernel_physical_end = reinterpret_cast<byte *>(k_ph_end);
     info->v_device_drivers_begin = &_driverinfo_begin;
     info->v_device_drivers_end = &_driverinfo_end;
+    info->satp_mode = (uint64_t(static_cast<size_t>(s_root_order)) + 6) << SATP_MODE_SHIFT;
+    info->p_secondary_start = &_secondary_start;
 }
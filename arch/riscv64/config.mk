@@ -1,8 +1,6 @@
 # Configuration for riscv64
 MACROS := $(MACROS) -DARCH=riscv64
 CXXFLAGS := $(CXXFLAGS) -march=rv64gc -mabi=lp64d -mcmodel=medany -fno-pic
-SV39_MASK := 0x8000000000000000
-SV48_MASK := 0x9000000000000000
 SV39_KBASE_ADDRESS := 0xFFFFFFFFC0000000
 SV48_KBASE_ADDRESS := 0xFFFFFFFFC0000000
 
@@ -10,12 +8,18 @@ ifndef SYSTEM
     $(error SYSTEM is not set. Required for arch $(ARCH).)
 endif
 
+# SVAUTO images pick the deepest paging mode supported by the hart at boot. The other modes are fixed at build time,
+# which lets the compiler specialise page table walks.
 ifeq ($(SYSTEM), visionfive_2)
-    MACROS += -DRISCV_MEM_MODE_MASK=$(SV39_MASK) -DRISCV_MEM_ORIGIN=0x40200000 -DSV39
+    MACROS += -DRISCV_MEM_ORIGIN=0x40200000 -DSV39
+else ifeq ($(SYSTEM), qemu)
+    MACROS += -DRISCV_MEM_ORIGIN=0x84000000 -DSVAUTO
 else ifeq ($(SYSTEM), qemu_sv39)
-    MACROS += -DRISCV_MEM_MODE_MASK=$(SV39_MASK) -DRISCV_MEM_ORIGIN=0x84000000 -DSV39
+    MACROS += -DRISCV_MEM_ORIGIN=0x84000000 -DSV39
 else ifeq ($(SYSTEM), qemu_sv48)
-    MACROS += -DRISCV_MEM_MODE_MASK=$(SV48_MASK) -DRISCV_MEM_ORIGIN=0x84000000 -DSV48
+    MACROS += -DRISCV_MEM_ORIGIN=0x84000000 -DSV48
+else ifeq ($(SYSTEM), qemu_sv57)
+    MACROS += -DRISCV_MEM_ORIGIN=0x84000000 -DSV57
 else
     $(error SYSTEM $(SYSTEM) not supported.)
 endif
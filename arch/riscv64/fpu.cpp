@@ -0,0 +1,278 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/fpu.hpp"
+#include "mem/bumpallocator.hpp"
+#include "sys/mem.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/spinlock.hpp"
+#include "sys/thread.hpp"
+
+namespace hls
+{
+    constexpr uint32_t OPCODE_MASK = 0x7F;
+    constexpr uint32_t OPCODE_LOAD_FP = 0x07;
+    constexpr uint32_t OPCODE_STORE_FP = 0x27;
+    constexpr uint32_t OPCODE_MADD = 0x43;
+    constexpr uint32_t OPCODE_MSUB = 0x47;
+    constexpr uint32_t OPCODE_NMSUB = 0x4B;
+    constexpr uint32_t OPCODE_NMADD = 0x4F;
+    constexpr uint32_t OPCODE_OP_FP = 0x53;
+    constexpr uint32_t OPCODE_OP_V = 0x57;
+    constexpr uint32_t OPCODE_SYSTEM = 0x73;
+    constexpr uint32_t CSR_FFLAGS = 0x001;
+    constexpr uint32_t CSR_FCSR = 0x003;
+    constexpr uint32_t CSR_VSTART = 0x008;
+    constexpr uint32_t CSR_VCSR = 0x00F;
+    constexpr uint32_t CSR_VL = 0xC20;
+    constexpr uint32_t CSR_VLENB = 0xC22;
+
+    enum class ExtensionInstruction
+    {
+        NONE,
+        FP,
+        VECTOR
+    };
+
+    struct FpuHartData
+    {
+        // Whose state the registers of this hart hold, valid only if that context also names this hart.
+        ExtensionContext *fp_owner = nullptr;
+        ExtensionContext *vector_owner = nullptr;
+        FpuStatistics statistics;
+    };
+
+    PER_HART static PerHart<FpuHartData> s_fpu;
+    // Bytes of VectorState plus registers, or 0 when vector instructions aren't handled.
+    static size_t s_vector_state_size = 0;
+    static TicketLock s_vector_allocator_lock;
+
+    void FpuStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: FP {} saves, {} skipped, {} restores, {} skipped. Vector {} saves, {} skipped, {} "
+                 "restores, {} skipped.",
+                 cpu_id, saves, skipped_saves, restores, skipped_restores, vector_saves, vector_skipped_saves,
+                 vector_restores, vector_skipped_restores);
+    }
+
+    static BumpAllocator &get_vector_allocator()
+    {
+        static BumpAllocator allocator(s_vector_state_size);
+        return allocator;
+    }
+
+    // The instruction is read back from sepc rather than stval, which harts may leave at zero.
+    static ExtensionInstruction classify_instruction(uintptr_t address)
+    {
+        const uint16_t *parcels = reinterpret_cast<const uint16_t *>(address);
+        uint32_t instruction = parcels[0];
+        if ((instruction & 0x3) != 0x3)
+        {
+            // c.fld and c.fsd in quadrant 0, c.fldsp and c.fsdsp in quadrant 2.
+            uint32_t quadrant = instruction & 0x3;
+            uint32_t funct3 = instruction >> 13;
+            if ((quadrant == 0 || quadrant == 2) && (funct3 == 1 || funct3 == 5))
+                return ExtensionInstruction::FP;
+            return ExtensionInstruction::NONE;
+        }
+
+        instruction |= uint32_t(parcels[1]) << 16;
+        uint32_t funct3 = (instruction >> 12) & 0x7;
+        switch (instruction & OPCODE_MASK)
+        {
+        case OPCODE_LOAD_FP:
+        case OPCODE_STORE_FP:
+            // Widths 1 to 4 are the scalar loads and stores, the others encode vector element widths.
+            return funct3 >= 1 && funct3 <= 4 ? ExtensionInstruction::FP : ExtensionInstruction::VECTOR;
+        case OPCODE_MADD:
+        case OPCODE_MSUB:
+        case OPCODE_NMSUB:
+        case OPCODE_NMADD:
+        case OPCODE_OP_FP:
+            return ExtensionInstruction::FP;
+        case OPCODE_OP_V:
+            return ExtensionInstruction::VECTOR;
+        case OPCODE_SYSTEM: {
+            // funct3 0 holds ecall, sret and the like, and 4 is unused. The others access a CSR.
+            if (funct3 == 0 || funct3 == 4)
+                return ExtensionInstruction::NONE;
+            uint32_t csr = instruction >> 20;
+            if (csr >= CSR_FFLAGS && csr <= CSR_FCSR)
+                return ExtensionInstruction::FP;
+            if ((csr >= CSR_VSTART && csr <= CSR_VCSR) || (csr >= CSR_VL && csr <= CSR_VLENB))
+                return ExtensionInstruction::VECTOR;
+            return ExtensionInstruction::NONE;
+        }
+        default:
+            return ExtensionInstruction::NONE;
+        }
+    }
+
+    void initialize_fpu()
+    {
+        disable_fpu();
+        if (!has_isa_extension(IsaExtension::V))
+            return;
+
+        size_t size = sizeof(VectorState) + 32 * _get_vector_register_size();
+        if (size > FrameKB::s_size)
+        {
+            kprintln("Vector registers too large to be switched. Vector instructions disabled.");
+            return;
+        }
+        s_vector_state_size = size;
+    }
+
+    void disable_fpu()
+    {
+        _set_fp_status(ExtensionStatus::OFF);
+        _set_vector_status(ExtensionStatus::OFF);
+    }
+
+    void fpu_switch_out(ExtensionContext &context)
+    {
+        FpuHartData &data = s_fpu.get();
+        if (_get_fp_status() == ExtensionStatus::DIRTY)
+        {
+            _save_fp_state(&context.fp);
+            ++data.statistics.saves;
+        }
+        else
+            ++data.statistics.skipped_saves;
+        _set_fp_status(ExtensionStatus::OFF);
+
+        if (s_vector_state_size == 0)
+            return;
+        if (_get_vector_status() == ExtensionStatus::DIRTY)
+        {
+            _save_vector_state(context.vector);
+            ++data.statistics.vector_saves;
+        }
+        else
+            ++data.statistics.vector_skipped_saves;
+        _set_vector_status(ExtensionStatus::OFF);
+    }
+
+    void fpu_discard(ExtensionContext &context)
+    {
+        FpuHartData &data = s_fpu.get();
+        if (data.fp_owner == &context)
+            data.fp_owner = nullptr;
+        if (data.vector_owner == &context)
+            data.vector_owner = nullptr;
+        disable_fpu();
+    }
+
+    void fpu_release(ExtensionContext &context)
+    {
+        if (context.vector == nullptr)
+            return;
+
+        s_vector_allocator_lock.lock();
+        get_vector_allocator().release_mem(context.vector);
+        s_vector_allocator_lock.unlock();
+        context.vector = nullptr;
+    }
+
+    static bool load_fp_state(FpuHartData &data, ExtensionContext &context, size_t cpu_id)
+    {
+        // Still on because of a real illegal instruction.
+        if (_get_fp_status() != ExtensionStatus::OFF)
+            return false;
+
+        if (data.fp_owner == &context && context.fp_cpu == cpu_id)
+            ++data.statistics.skipped_restores;
+        else
+        {
+            _set_fp_status(ExtensionStatus::INITIAL);
+            _restore_fp_state(&context.fp);
+            data.fp_owner = &context;
+            context.fp_cpu = cpu_id;
+            ++data.statistics.restores;
+        }
+        // The registers match the saved state, so the next switch only saves if the thread writes them.
+        _set_fp_status(ExtensionStatus::CLEAN);
+        return true;
+    }
+
+    static bool load_vector_state(FpuHartData &data, ExtensionContext &context, size_t cpu_id)
+    {
+        if (s_vector_state_size == 0 || _get_vector_status() != ExtensionStatus::OFF)
+            return false;
+
+        if (context.vector == nullptr)
+        {
+            s_vector_allocator_lock.lock();
+            context.vector = reinterpret_cast<VectorState *>(get_vector_allocator().get_mem());
+            s_vector_allocator_lock.unlock();
+            memset(context.vector, 0, s_vector_state_size);
+        }
+
+        if (data.vector_owner == &context && context.vector_cpu == cpu_id)
+            ++data.statistics.vector_skipped_restores;
+        else
+        {
+            _set_vector_status(ExtensionStatus::INITIAL);
+            _restore_vector_state(context.vector);
+            data.vector_owner = &context;
+            context.vector_cpu = cpu_id;
+            ++data.statistics.vector_restores;
+        }
+        _set_vector_status(ExtensionStatus::CLEAN);
+        return true;
+    }
+
+    bool handle_fpu_trap(TrapFrame *frame)
+    {
+        ExtensionInstruction kind = classify_instruction(frame->sepc);
+        if (kind == ExtensionInstruction::NONE)
+            return false;
+
+        FpuHartData &data = s_fpu.get();
+        ExtensionContext &context = get_current_thread()->extensions;
+        size_t cpu_id = get_cpu_id();
+        // The trap return keeps FS and VS as they are now, so the frame needs no update.
+        if (kind == ExtensionInstruction::FP)
+            return load_fp_state(data, context, cpu_id);
+        return load_vector_state(data, context, cpu_id);
+    }
+
+    FpuStatistics &get_fpu_statistics(size_t cpu_id)
+    {
+        return s_fpu.get(cpu_id).statistics;
+    }
+
+    void print_fpu_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_fpu_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
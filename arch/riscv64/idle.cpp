@@ -0,0 +1,285 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/idle.hpp"
+#include "libfdt.h"
+#include "plat_def.hpp"
+#include "sys/mem.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/string.hpp"
+#include "sys/timer.hpp"
+
+namespace hls
+{
+    constexpr size_t IDLE_STATE_NAME_LENGTH = 16;
+    // Non-retentive suspends lose the registers and resume elsewhere, which we don't support.
+    constexpr uint32_t SBI_SUSPEND_NON_RETENTIVE = uint32_t(1) << 31;
+    constexpr uint64_t NO_PREDICTION = ~uint64_t(0);
+    // The predicted idle length moves by an eighth of the difference with each measured one.
+    constexpr uint64_t IDLE_PREDICTION_SHIFT = 3;
+
+    enum class IdleMethod
+    {
+        POLL,
+        WFI,
+        SBI_SUSPEND
+    };
+
+    struct IdleState
+    {
+        char name[IDLE_STATE_NAME_LENGTH];
+        IdleMethod method;
+        uint32_t suspend_type;
+        // Entry plus exit latency, and the shortest stay that makes up for it, both in time CSR ticks.
+        uint64_t latency;
+        uint64_t target_residency;
+    };
+
+    struct IdleHartData
+    {
+        // Moving average of the recent idle periods, in time CSR ticks.
+        uint64_t predicted = NO_PREDICTION;
+        IdleStatistics statistics;
+    };
+
+    PER_HART static PerHart<IdleHartData> s_idle;
+    // Sorted by target residency. Written once before other harts start, and only read afterwards.
+    static IdleState s_idle_states[MAX_IDLE_STATES];
+    static size_t s_idle_state_count = 0;
+    static uint64_t s_poll_limit = 0;
+    static uint64_t s_latency_limit = 0;
+
+    void IdleStatistics::print(size_t cpu_id) const
+    {
+        uint64_t now = _read_time();
+        uint64_t elapsed = since != 0 && now > since ? now - since : 0;
+        for (size_t i = 0; i < s_idle_state_count; ++i)
+        {
+            const IdleStateStatistics &state = states[i];
+            const char *name = s_idle_states[i].name;
+            uint64_t percent = elapsed != 0 ? state.residency * 100 / elapsed : 0;
+            kprintln("cpu {}: idle state {} entered {} times, {} us ({}%), {} early wakeups.", cpu_id, name,
+                     state.entries, time_to_microseconds(state.residency), percent, state.early_wakeups);
+        }
+    }
+
+    static void add_idle_state(const char *name, IdleMethod method, uint32_t suspend_type, uint64_t latency,
+                               uint64_t target_residency)
+    {
+        if (s_idle_state_count == MAX_IDLE_STATES)
+            return;
+
+        // Insertion keeps the table sorted, and states with the same residency in device tree order.
+        size_t index = s_idle_state_count++;
+        while (index > 0 && s_idle_states[index - 1].target_residency > target_residency)
+        {
+            s_idle_states[index] = s_idle_states[index - 1];
+            --index;
+        }
+
+        IdleState &state = s_idle_states[index];
+        size_t length = strnlen(name, IDLE_STATE_NAME_LENGTH - 1);
+        memcpy(state.name, name, length);
+        state.name[length] = '\0';
+        state.method = method;
+        state.suspend_type = suspend_type;
+        state.latency = latency;
+        state.target_residency = target_residency;
+    }
+
+    static uint32_t read_u32(const void *fdt, int node, const char *name, uint32_t default_value)
+    {
+        int length = 0;
+        auto property = reinterpret_cast<const fdt32_t *>(fdt_getprop(fdt, node, name, &length));
+        if (property == nullptr || length != sizeof(fdt32_t))
+            return default_value;
+        return fdt32_to_cpu(*property);
+    }
+
+    // Idle states of the RISC-V SBI binding. Every hart is assumed to support all of them, rather than the ones its
+    // cpu-idle-states property lists.
+    static void read_sbi_idle_states(const void *fdt)
+    {
+        int idle_states = fdt_path_offset(fdt, "/cpus/idle-states");
+        if (idle_states < 0)
+            return;
+
+        int node;
+        fdt_for_each_subnode(node, fdt, idle_states)
+        {
+            if (fdt_node_check_compatible(fdt, node, "riscv,idle-state") != 0)
+                continue;
+            int length = 0;
+            if (fdt_getprop(fdt, node, "riscv,sbi-suspend-param", &length) == nullptr || length != sizeof(fdt32_t))
+                continue;
+
+            uint32_t suspend_type = read_u32(fdt, node, "riscv,sbi-suspend-param", 0);
+            // Our timer interrupt is the only thing that bounds how long we sleep, so it must keep running.
+            if ((suspend_type & SBI_SUSPEND_NON_RETENTIVE) != 0 ||
+                fdt_getprop(fdt, node, "local-timer-stop", nullptr) != nullptr)
+                continue;
+
+            uint64_t latency = read_u32(fdt, node, "entry-latency-us", 0) + read_u32(fdt, node, "exit-latency-us", 0);
+            uint64_t residency = read_u32(fdt, node, "min-residency-us", 0);
+            if (residency < latency)
+                residency = latency;
+
+            auto name = reinterpret_cast<const char *>(fdt_getprop(fdt, node, "idle-state-name", nullptr));
+            if (name == nullptr)
+                name = fdt_get_name(fdt, node, nullptr);
+            add_idle_state(name != nullptr ? name : "sbi", IdleMethod::SBI_SUSPEND, suspend_type,
+                           time_from_microseconds(latency), time_from_microseconds(residency));
+        }
+    }
+
+    void detect_idle_states(const void *fdt)
+    {
+        s_poll_limit = time_from_microseconds(IDLE_POLL_US);
+        s_latency_limit = time_from_microseconds(IDLE_EXIT_LATENCY_LIMIT_US);
+        add_idle_state("poll", IdleMethod::POLL, 0, 0, 0);
+        add_idle_state("wfi", IdleMethod::WFI, 0, 0, s_poll_limit);
+        if (_sbi_has_hart_suspend())
+            read_sbi_idle_states(fdt);
+
+#ifdef DEBUG
+        for (size_t i = 0; i < s_idle_state_count; ++i)
+        {
+            const IdleState &state = s_idle_states[i];
+            const char *name = state.name;
+            kdebug("Idle state {}: latency {} us, target residency {} us.", name, time_to_microseconds(state.latency),
+                   time_to_microseconds(state.target_residency));
+        }
+#endif
+    }
+
+    // Deepest state that is expected to pay for itself.
+    static size_t select_idle_state(uint64_t predicted)
+    {
+        size_t selected = 0;
+        for (size_t i = 1; i < s_idle_state_count; ++i)
+        {
+            const IdleState &state = s_idle_states[i];
+            if (state.target_residency > predicted)
+                break;
+            if (state.latency <= s_latency_limit)
+                selected = i;
+        }
+
+        return selected;
+    }
+
+    // Spins until an interrupt is pending, or until **deadline** passes.
+    static bool poll_idle(uint64_t deadline)
+    {
+        while (!_has_pending_interrupt())
+        {
+            if (_read_time() >= deadline)
+                return false;
+            _cpu_relax();
+        }
+
+        return true;
+    }
+
+    static void account_idle_state(IdleStatistics &statistics, size_t index, uint64_t residency)
+    {
+        IdleStateStatistics &state = statistics.states[index];
+        ++state.entries;
+        state.residency += residency;
+        if (residency < s_idle_states[index].target_residency)
+            ++state.early_wakeups;
+    }
+
+    void enter_idle_state()
+    {
+        if (s_idle_state_count == 0)
+        {
+            _wait_for_interrupt();
+            return;
+        }
+
+        IdleHartData &data = s_idle.get();
+        uint64_t start = _read_time();
+        if (data.statistics.since == 0)
+            data.statistics.since = start;
+
+        uint64_t next_timer = get_next_timer_expiration();
+        uint64_t predicted = next_timer > start ? next_timer - start : 0;
+        if (data.predicted < predicted)
+            predicted = data.predicted;
+
+        size_t index = select_idle_state(predicted);
+        const IdleState &state = s_idle_states[index];
+        uint64_t state_start = start;
+        switch (state.method)
+        {
+        case IdleMethod::POLL:
+            // A wrong guess costs at most s_poll_limit of spinning before the hart goes to sleep anyway. The sleep
+            // is then accounted to wfi.
+            if (!poll_idle(start + s_poll_limit))
+            {
+                state_start = _read_time();
+                account_idle_state(data.statistics, index, state_start - start);
+                index = 1;
+                _wait_for_interrupt();
+            }
+            break;
+        case IdleMethod::WFI:
+            _wait_for_interrupt();
+            break;
+        case IdleMethod::SBI_SUSPEND:
+            if (!_sbi_hart_suspend(state.suspend_type))
+                _wait_for_interrupt();
+            break;
+        }
+
+        uint64_t end = _read_time();
+        account_idle_state(data.statistics, index, end - state_start);
+
+        uint64_t measured = end - start;
+        if (data.predicted == NO_PREDICTION)
+            data.predicted = measured;
+        else
+            data.predicted =
+                data.predicted - (data.predicted >> IDLE_PREDICTION_SHIFT) + (measured >> IDLE_PREDICTION_SHIFT);
+    }
+
+    IdleStatistics &get_idle_statistics(size_t cpu_id)
+    {
+        return s_idle.get(cpu_id).statistics;
+    }
+
+    void print_idle_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_idle_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
@@ -0,0 +1,136 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "libfdt.h"
+#include "mem/mmap.hpp"
+#include "plat_def.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+
+namespace hls
+{
+    // ACLINT SSWI devices have one 32 bit SETSSIP register per hart, in the order harts appear in
+    // interrupts-extended. Writing 1 raises a supervisor software interrupt without a trip through the SBI.
+    constexpr size_t SSWI_REGISTER_SIZE = 4;
+    // Harts beyond this many entries of a device are signalled through the SBI.
+    constexpr size_t SSWI_MAX_HARTS = 64;
+
+    static volatile uint32_t *s_sswi_registers = nullptr;
+    static size_t s_sswi_hart_ids[SSWI_MAX_HARTS];
+    static size_t s_sswi_hart_count = 0;
+
+    static Result<size_t> read_intc_hart_id(const void *fdt, uint32_t phandle)
+    {
+        int intc = fdt_node_offset_by_phandle(fdt, phandle);
+        int cpu = intc >= 0 ? fdt_parent_offset(fdt, intc) : intc;
+        int cpus = cpu >= 0 ? fdt_parent_offset(fdt, cpu) : cpu;
+        if (cpus < 0)
+            return error<size_t>(Error::NOT_FOUND);
+        return read_hart_id(fdt, cpu, fdt_address_cells(fdt, cpus));
+    }
+
+    static Result<void *> read_device_address(const void *fdt, int node)
+    {
+        int parent = fdt_parent_offset(fdt, node);
+        int address_cells = parent >= 0 ? fdt_address_cells(fdt, parent) : 2;
+        int length = 0;
+        auto reg = reinterpret_cast<const fdt32_t *>(fdt_getprop(fdt, node, "reg", &length));
+        if (reg == nullptr || length < address_cells * 4)
+            return error<void *>(Error::NOT_FOUND);
+
+        uint64_t address = 0;
+        for (int cell = 0; cell < address_cells; ++cell)
+            address = (address << 32) | fdt32_ld(reg + cell);
+        return value(to_ptr(address));
+    }
+
+    void detect_ipi_controller(const void *fdt)
+    {
+        int node = fdt_node_offset_by_compatible(fdt, -1, "riscv,aclint-sswi");
+        if (node < 0)
+            return;
+
+        int length = 0;
+        auto interrupts = reinterpret_cast<const fdt32_t *>(fdt_getprop(fdt, node, "interrupts-extended", &length));
+        auto address = read_device_address(fdt, node);
+        if (interrupts == nullptr || address.is_error())
+            return;
+
+        // Each entry is the phandle of a hart's interrupt controller, followed by the interrupt number.
+        size_t entries = static_cast<size_t>(length) / (2 * sizeof(fdt32_t));
+        if (entries > SSWI_MAX_HARTS)
+            entries = SSWI_MAX_HARTS;
+        for (size_t i = 0; i < entries; ++i)
+        {
+            auto hart_id = read_intc_hart_id(fdt, fdt32_ld(interrupts + 2 * i));
+            // Unknown entries get an id no hart has, so they never match.
+            s_sswi_hart_ids[i] = hart_id.is_error() ? ~size_t(0) : hart_id.get_value();
+        }
+
+        auto registers = VMMap::get_global_instance().map_device(address.get_value(), entries * SSWI_REGISTER_SIZE);
+        if (registers.is_error())
+            return;
+
+        s_sswi_registers = reinterpret_cast<volatile uint32_t *>(registers.get_value());
+        s_sswi_hart_count = entries;
+        kdebug("IPIs go through the ACLINT SSWI at {}.", address.get_value());
+    }
+
+    static bool sswi_send_ipi(size_t hart_id)
+    {
+        for (size_t i = 0; i < s_sswi_hart_count; ++i)
+        {
+            if (s_sswi_hart_ids[i] == hart_id)
+            {
+                s_sswi_registers[i] = 1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void _send_ipi(uint64_t hart_mask, uint64_t hart_mask_base)
+    {
+        if (s_sswi_registers == nullptr)
+        {
+            _sbi_send_ipi(hart_mask, hart_mask_base);
+            return;
+        }
+
+        // Mailbox writes must be visible before the device register write that interrupts the target.
+        asm volatile("fence iorw, iorw" : : : "memory");
+        uint64_t fallback = 0;
+        for (size_t bit = 0; bit < 64; ++bit)
+        {
+            if ((hart_mask & (uint64_t(1) << bit)) && !sswi_send_ipi(hart_mask_base + bit))
+                fallback |= uint64_t(1) << bit;
+        }
+
+        if (fallback != 0)
+            _sbi_send_ipi(fallback, hart_mask_base);
+    }
+
+} // namespace hls
@@ -0,0 +1,126 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "libfdt.h"
+#include "plat_def.hpp"
+#include "sys/print.hpp"
+#include "sys/string.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    struct IsaExtensionName
+    {
+        IsaExtension extension;
+        const char *name;
+    };
+
+    static const IsaExtensionName s_extension_names[] = {
+        {IsaExtension::SVNAPOT, "svnapot"},
+        {IsaExtension::SVADU, "svadu"},
+        {IsaExtension::ZACAS, "zacas"},
+        {IsaExtension::V, "v"},
+        {IsaExtension::SSTC, "sstc"}};
+
+    static uint64_t s_isa_extensions = 0;
+
+    // Older device trees only describe the ISA as a string such as "rv64imafdcv_zicsr_svnapot", where single letter
+    // extensions follow the base ISA and multi-letter ones follow an underscore.
+    static bool isa_string_has(const char *isa, const char *name)
+    {
+        size_t length = strlen(name);
+        if (length == 1)
+        {
+            if (strncmp(isa, "rv64", 4) != 0)
+                return false;
+            for (const char *c = isa + 4; *c != '\0' && *c != '_'; ++c)
+            {
+                if (*c == *name)
+                    return true;
+            }
+            return false;
+        }
+
+        for (const char *c = isa; *c != '\0'; ++c)
+        {
+            if (*c != '_')
+                continue;
+            if (strncmp(c + 1, name, length) == 0 && (c[length + 1] == '_' || c[length + 1] == '\0'))
+                return true;
+        }
+
+        return false;
+    }
+
+    static uint64_t read_hart_extensions(const void *fdt, int node)
+    {
+        uint64_t extensions = 0;
+        const char *isa = reinterpret_cast<const char *>(fdt_getprop(fdt, node, "riscv,isa", nullptr));
+        for (auto &extension : s_extension_names)
+        {
+            if (fdt_stringlist_search(fdt, node, "riscv,isa-extensions", extension.name) >= 0 ||
+                (isa != nullptr && isa_string_has(isa, extension.name)))
+                extensions |= static_cast<uint64_t>(extension.extension);
+        }
+
+        return extensions;
+    }
+
+    void detect_isa_extensions(const void *fdt)
+    {
+        int cpus = fdt_path_offset(fdt, "/cpus");
+        if (cpus < 0)
+            return;
+
+        // Only extensions present on every hart can be used, as any hart may run any code.
+        uint64_t extensions = ~uint64_t(0);
+        bool found_hart = false;
+        for (auto node = fdt_first_subnode(fdt, cpus); node >= 0; node = fdt_next_subnode(fdt, node))
+        {
+            const char *type = reinterpret_cast<const char *>(fdt_getprop(fdt, node, "device_type", nullptr));
+            if (type == nullptr || strncmp(type, "cpu", 4) != 0)
+                continue;
+            extensions &= read_hart_extensions(fdt, node);
+            found_hart = true;
+        }
+
+        s_isa_extensions = found_hart ? extensions : 0;
+        for (auto &extension : s_extension_names)
+        {
+            if (has_isa_extension(extension.extension))
+            {
+                kdebug("ISA extension {} is available.", extension.name);
+            }
+        }
+
+        // Compare and swap sites switch to amocas once every hart is known to implement it.
+        detail::use_zacas = has_isa_extension(IsaExtension::ZACAS);
+    }
+
+    bool has_isa_extension(IsaExtension extension)
+    {
+        return (s_isa_extensions & static_cast<uint64_t>(extension)) != 0;
+    }
+} // namespace hls
@@ -24,8 +24,10 @@ SOFTWARE.
 ---------------------------------------------------------------------------------*/
 
 #include "plat_def.hpp"
+#include "libfdt.h"
 #include "mem/mmap.hpp"
 #include "sys/mem.hpp"
+#include "sys/panic.hpp"
 #include "sys/print.hpp"
 
 namespace hls
@@ -53,14 +55,292 @@ namespace hls
         return {.error = a0, .value = a1};
     }
 
+    // SBI Firmware Features extension
+    constexpr uint64_t SBI_EXT_FWFT = 0x46574654;
+    constexpr uint64_t SBI_FWFT_SET = 0;
+    constexpr uint64_t SBI_FWFT_PTE_AD_HW_UPDATING = 4;
+
     void kinit_putchar(char c)
     {
         sbi_call(0x1u, 0x0, c, 0, 0, 0, 0, 0);
     }
 
-    void kinit_settimer(uint64_t ticks)
+    bool enable_hardware_ad_updates()
+    {
+        if (!has_isa_extension(IsaExtension::SVADU))
+            return false;
+        return sbi_call(SBI_EXT_FWFT, SBI_FWFT_SET, SBI_FWFT_PTE_AD_HW_UPDATING, 1, 0, 0, 0, 0).error == 0;
+    }
+
+    // SBI Hart State Management extension
+    constexpr uint64_t SBI_EXT_HSM = 0x48534D;
+    constexpr uint64_t SBI_HSM_HART_START = 0;
+    constexpr uint64_t SBI_HSM_HART_GET_STATUS = 2;
+    constexpr uint64_t SBI_HSM_HART_SUSPEND = 3;
+
+    // SBI Base extension
+    constexpr uint64_t SBI_EXT_BASE = 0x10;
+    constexpr uint64_t SBI_BASE_GET_SPEC_VERSION = 0;
+    constexpr uint64_t SBI_BASE_PROBE_EXTENSION = 3;
+    // HART_SUSPEND came with version 0.3.
+    constexpr uint64_t SBI_HSM_SUSPEND_MIN_VERSION = (uint64_t(0) << 24) | 3;
+
+    bool _start_hart(size_t hart_id, const void *p_entry, uintptr_t opaque)
+    {
+        // Whatever the hart reads through opaque must be visible before it starts.
+        asm volatile("fence rw, rw" : : : "memory");
+        return sbi_call(SBI_EXT_HSM, SBI_HSM_HART_START, hart_id, to_uintptr_t(p_entry), opaque, 0, 0, 0).error == 0;
+    }
+
+    HartStatus _get_hart_status(size_t hart_id)
+    {
+        auto result = sbi_call(SBI_EXT_HSM, SBI_HSM_HART_GET_STATUS, hart_id, 0, 0, 0, 0, 0);
+        if (result.error != 0)
+            return HartStatus::UNKNOWN;
+        return static_cast<HartStatus>(result.value);
+    }
+
+    bool _sbi_has_hart_suspend()
+    {
+        auto version = sbi_call(SBI_EXT_BASE, SBI_BASE_GET_SPEC_VERSION, 0, 0, 0, 0, 0, 0);
+        if (version.error != 0 || version.value < SBI_HSM_SUSPEND_MIN_VERSION)
+            return false;
+        auto probe = sbi_call(SBI_EXT_BASE, SBI_BASE_PROBE_EXTENSION, SBI_EXT_HSM, 0, 0, 0, 0, 0);
+        return probe.error == 0 && probe.value != 0;
+    }
+
+    bool _sbi_hart_suspend(uint32_t suspend_type)
+    {
+        // Retentive suspends return here like wfi does, so there is no resume address to give.
+        return sbi_call(SBI_EXT_HSM, SBI_HSM_HART_SUSPEND, suspend_type, 0, 0, 0, 0, 0).error == 0;
+    }
+
+    uint64_t _get_satp()
+    {
+        uint64_t satp;
+        asm volatile("csrr %0, satp" : "=r"(satp));
+        return satp;
+    }
+
+    uintptr_t _get_thread_pointer()
+    {
+        uintptr_t value;
+        asm volatile("mv %0, tp" : "=r"(value));
+        return value;
+    }
+
+    void _set_thread_pointer(uintptr_t value)
+    {
+        asm volatile("mv tp, %0" : : "r"(value) : "memory");
+    }
+
+    void _wait_for_interrupt()
+    {
+        asm volatile("wfi" : : : "memory");
+    }
+
+    bool _has_pending_interrupt()
+    {
+        uint64_t sip;
+        uint64_t sie;
+        asm volatile("csrr %0, sip" : "=r"(sip) : : "memory");
+        asm volatile("csrr %0, sie" : "=r"(sie));
+        return (sip & sie) != 0;
+    }
+
+    uint64_t _disable_interrupts()
+    {
+        uint64_t sstatus;
+        asm volatile("csrrci %0, sstatus, %1" : "=r"(sstatus) : "i"(SSTATUS_SIE) : "memory");
+        return sstatus & SSTATUS_SIE;
+    }
+
+    void _restore_interrupts(uint64_t state)
+    {
+        if (state & SSTATUS_SIE)
+            asm volatile("csrsi sstatus, %0" : : "i"(SSTATUS_SIE) : "memory");
+    }
+
+    uint64_t _read_cycle_counter()
+    {
+        uint64_t cycles;
+        asm volatile("rdcycle %0" : "=r"(cycles));
+        return cycles;
+    }
+
+    uint64_t _read_time()
+    {
+        uint64_t time;
+        asm volatile("rdtime %0" : "=r"(time));
+        return time;
+    }
+
+    // The frequency of QEMU's virt machine.
+    constexpr uint64_t DEFAULT_TIMEBASE_FREQUENCY = 10000000;
+
+    static uint64_t s_timebase_frequency = 0;
+
+    static uint64_t read_timebase_frequency(const void *fdt)
+    {
+        int cpus = fdt_path_offset(fdt, "/cpus");
+        if (cpus < 0)
+            return 0;
+
+        int length = 0;
+        auto property = reinterpret_cast<const fdt32_t *>(fdt_getprop(fdt, cpus, "timebase-frequency", &length));
+        if (property == nullptr)
+            return 0;
+
+        // Usually one cell, but the binding allows two.
+        if (length == sizeof(fdt64_t))
+            return fdt64_to_cpu(*reinterpret_cast<const fdt64_t *>(property));
+        if (length == sizeof(fdt32_t))
+            return fdt32_to_cpu(*property);
+        return 0;
+    }
+
+    void detect_timebase_frequency(const void *fdt)
+    {
+        s_timebase_frequency = read_timebase_frequency(fdt);
+        if (s_timebase_frequency == 0)
+        {
+            kprintln("Timebase frequency unknown, assuming {} Hz.", DEFAULT_TIMEBASE_FREQUENCY);
+            s_timebase_frequency = DEFAULT_TIMEBASE_FREQUENCY;
+        }
+        kdebug("Timebase frequency is {} Hz.", s_timebase_frequency);
+    }
+
+    uint64_t get_timebase_frequency()
+    {
+        return s_timebase_frequency;
+    }
+
+    extern "C" void _thread_start();
+
+    void _initialize_context(ThreadContext *context, void *stack_top, void (*entry)(void *), void *argument)
+    {
+        *context = {};
+        context->ra = reinterpret_cast<uint64_t>(&_thread_start);
+        context->sp = reinterpret_cast<uint64_t>(stack_top);
+        // s0 is the frame pointer. Zero ends stack traces at the entry point.
+        context->s[0] = 0;
+        context->s[1] = reinterpret_cast<uint64_t>(entry);
+        context->s[2] = reinterpret_cast<uint64_t>(argument);
+    }
+
+    // SBI IPI extension
+    constexpr uint64_t SBI_EXT_IPI = 0x735049;
+    constexpr uint64_t SBI_IPI_SEND_IPI = 0;
+
+    bool _sbi_send_ipi(uint64_t hart_mask, uint64_t hart_mask_base)
+    {
+        // Mailbox writes must be visible before the target takes the interrupt.
+        asm volatile("fence rw, rw" : : : "memory");
+        return sbi_call(SBI_EXT_IPI, SBI_IPI_SEND_IPI, hart_mask, hart_mask_base, 0, 0, 0, 0).error == 0;
+    }
+
+    // SBI RFENCE extension
+    constexpr uint64_t SBI_EXT_RFENCE = 0x52464E43;
+    constexpr uint64_t SBI_RFENCE_REMOTE_SFENCE_VMA = 1;
+
+    bool _sbi_remote_sfence_vma(uint64_t hart_mask, uint64_t hart_mask_base, const void *vaddress, size_t size)
+    {
+        // Page table writes must be visible before the remote harts refill their TLBs.
+        asm volatile("fence rw, rw" : : : "memory");
+        return sbi_call(SBI_EXT_RFENCE, SBI_RFENCE_REMOTE_SFENCE_VMA, hart_mask, hart_mask_base,
+                        to_uintptr_t(vaddress), size, 0, 0)
+                   .error == 0;
+    }
+
+    constexpr uint64_t SIP_SSIP = uint64_t(1u) << 1;
+    constexpr uint64_t SIE_SSIE = uint64_t(1u) << 1;
+
+    void _clear_ipi()
+    {
+        asm volatile("csrc sip, %0" : : "r"(SIP_SSIP) : "memory");
+    }
+
+    void _enable_software_interrupts()
+    {
+        asm volatile("csrs sie, %0" : : "r"(SIE_SSIE) : "memory");
+    }
+
+    // SBI TIME extension
+    constexpr uint64_t SBI_EXT_TIME = 0x54494D45;
+    constexpr uint64_t SBI_TIME_SET_TIMER = 0;
+    constexpr uint64_t SIE_STIE = uint64_t(1u) << 5;
+
+    // Numbered, as assemblers only know it by name when Sstc is enabled.
+    constexpr uint64_t CSR_STIMECMP = 0x14D;
+
+    void _set_timer(uint64_t time)
+    {
+        // Sstc lets us write the comparator ourselves, which saves a round trip through M mode on every timer.
+        if (has_isa_extension(IsaExtension::SSTC))
+            asm volatile("csrw %0, %1" : : "i"(CSR_STIMECMP), "r"(time) : "memory");
+        else
+            sbi_call(SBI_EXT_TIME, SBI_TIME_SET_TIMER, time, 0, 0, 0, 0, 0);
+    }
+
+    void _enable_timer_interrupts()
+    {
+        asm volatile("csrs sie, %0" : : "r"(SIE_STIE) : "memory");
+    }
+
+    constexpr uint64_t SSTATUS_VS_SHIFT = 9;
+    constexpr uint64_t SSTATUS_FS_SHIFT = 13;
+    constexpr uint64_t SSTATUS_EXTENSION_STATUS_MASK = 0x3;
+    // Numbered, as assemblers only know it by name when the V extension is enabled.
+    constexpr uint64_t CSR_VLENB = 0xC22;
+
+    static ExtensionStatus get_extension_status(uint64_t shift)
+    {
+        uint64_t sstatus;
+        asm volatile("csrr %0, sstatus" : "=r"(sstatus));
+        return static_cast<ExtensionStatus>((sstatus >> shift) & SSTATUS_EXTENSION_STATUS_MASK);
+    }
+
+    static void set_extension_status(uint64_t shift, ExtensionStatus status)
+    {
+        uint64_t clear = SSTATUS_EXTENSION_STATUS_MASK << shift;
+        uint64_t set = static_cast<uint64_t>(status) << shift;
+        asm volatile("csrc sstatus, %0\n\tcsrs sstatus, %1" : : "r"(clear), "r"(set) : "memory");
+    }
+
+    ExtensionStatus _get_fp_status()
+    {
+        return get_extension_status(SSTATUS_FS_SHIFT);
+    }
+
+    void _set_fp_status(ExtensionStatus status)
+    {
+        set_extension_status(SSTATUS_FS_SHIFT, status);
+    }
+
+    ExtensionStatus _get_vector_status()
+    {
+        return get_extension_status(SSTATUS_VS_SHIFT);
+    }
+
+    void _set_vector_status(ExtensionStatus status)
+    {
+        set_extension_status(SSTATUS_VS_SHIFT, status);
+    }
+
+    size_t _get_vector_register_size()
     {
-        sbi_call(0x0, 0, ticks, 0, 0, 0, 0, 0);
+        // Vector CSRs can't be read while VS is OFF.
+        ExtensionStatus status = _get_vector_status();
+        _set_vector_status(ExtensionStatus::INITIAL);
+        size_t size;
+        asm volatile("csrr %0, %1" : "=r"(size) : "i"(CSR_VLENB));
+        _set_vector_status(status);
+        return size;
+    }
+
+    void _cpu_relax()
+    {
+        asm volatile(".insn i 0x0F, 0, x0, x0, 0x010" : : : "memory");
     }
 
     void _flush_tlb()
@@ -68,6 +348,37 @@ namespace hls
         asm volatile("sfence.vma x0, x0");
     }
 
+    void _flush_tlb_page(const void *vaddress)
+    {
+        asm volatile("sfence.vma %0, x0" : : "r"(vaddress) : "memory");
+    }
+
+#ifdef SVAUTO
+    static FrameOrder s_root_order = FrameOrder::THIRD_ORDER;
+
+    FrameOrder get_root_order()
+    {
+        return s_root_order;
+    }
+#endif
+
+    void initialize_paging_mode(uint64_t satp_mode)
+    {
+#ifdef SVAUTO
+        s_root_order = root_order_for(satp_mode);
+#else
+        if (root_order_for(satp_mode) != get_root_order())
+            PANIC("Boot code selected a paging mode this image wasn't built for.");
+#endif
+        kdebug("Paging with {} levels.", static_cast<size_t>(get_root_order()) + 1);
+    }
+
+    void _set_root_table(const PageTable *table)
+    {
+        uint64_t satp = (to_uintptr_t(table) >> 12) | satp_mode_for(get_root_order());
+        asm volatile("csrw satp, %0; sfence.vma x0, x0" : : "r"(satp) : "memory");
+    }
+
     void TableEntry::point_to_frame(const void *frame)
     {
         data = to_uintptr_t(frame) >> 2;
@@ -75,6 +386,14 @@ namespace hls
         set_system_flags(VM_READ_FLAG);
     }
 
+    void TableEntry::point_to_napot_frame(const void *frame)
+    {
+        // The lowest 4 bits of the PPN encode the block size, 0b1000 for 64 KiB.
+        data = (to_uintptr_t(frame) >> 2) | (uint64_t(0x8) << 10);
+        data = data | VALID | NAPOT;
+        set_system_flags(VM_READ_FLAG);
+    }
+
     void TableEntry::set_system_flags(uint64_t flags)
     {
         if (flags & VM_VALID_FLAG)
@@ -89,6 +408,8 @@ namespace hls
             data = data | ACCESS;
         if (flags & VM_EXECUTE_FLAG)
             data = data | EXECUTE;
+        if (flags & VM_COW_FLAG)
+            data = data | COPY_ON_WRITE;
     }
 
     void TableEntry::unset_system_flags(uint64_t flags)
@@ -105,6 +426,8 @@ namespace hls
             data = (data | ACCESS) ^ ACCESS;
         if (flags & VM_EXECUTE_FLAG)
             data = (data | EXECUTE) ^ EXECUTE;
+        if (flags & VM_COW_FLAG)
+            data = (data | COPY_ON_WRITE) ^ COPY_ON_WRITE;
     }
 
     void TableEntry::erase()
@@ -120,7 +443,15 @@ namespace hls
 
     void *TableEntry::as_pointer()
     {
-        return to_ptr((data << 2) & 0xFFFFFFFFFFFFF000);
+        uintptr_t pointer = (data << 2) & 0xFFFFFFFFFFFFF000;
+        if (is_napot())
+            pointer = pointer & ~(NAPOT_FRAME_SIZE - 1);
+        return to_ptr(pointer);
+    }
+
+    bool TableEntry::is_napot()
+    {
+        return (data & NAPOT) != 0;
     }
 
     bool TableEntry::is_leaf()
@@ -161,6 +492,8 @@ namespace hls
             flags = flags | VM_ACCESS_FLAG;
         if (data & DIRTY)
             flags = flags | VM_DIRTY_FLAG;
+        if (data & COPY_ON_WRITE)
+            flags = flags | VM_COW_FLAG;
         return flags;
     }
 
@@ -174,8 +507,10 @@ namespace hls
         uintptr_t p = to_uintptr_t(vaddress);
         uintptr_t vpn_idx = static_cast<size_t>(order);
         p = p | ((entry_idx & 0x1FF) << ((vpn_idx * 9) + 12));
-        if (p & (1ull << 47))
-            p = p | 0xFFFF000000000000ULL;
+        // Addresses are sign extended from the highest bit translated by the root table.
+        size_t va_bits = (static_cast<size_t>(get_root_order()) + 1) * 9 + 12;
+        if (p & (1ull << (va_bits - 1)))
+            p = p | ~((1ull << va_bits) - 1);
         return to_ptr(p);
     }
 
@@ -207,6 +542,78 @@ namespace hls
         return entries()[entry_index];
     }
 
+    // Bits 0 to 9 hold permissions, A/D and the software bits. They must match for entries to be merged.
+    static constexpr uint64_t ENTRY_FLAG_BITS = 0x3FF;
+
+    bool PageTable::is_contiguous_run(size_t first_index, size_t count, size_t entry_size)
+    {
+        if (first_index + count > ENTRIES_PER_TABLE)
+            return false;
+
+        auto &first = get_entry(first_index);
+        if (!first.is_leaf() || first.is_napot() || !is_aligned(first.as_pointer(), count * entry_size))
+            return false;
+
+        byte *frame = as_byte_ptr(first.as_pointer());
+        for (size_t i = 1; i < count; ++i)
+        {
+            auto &entry = get_entry(first_index + i);
+            if (!entry.is_leaf() || entry.is_napot() || as_byte_ptr(entry.as_pointer()) != frame + i * entry_size)
+                return false;
+            if ((entry.data & ENTRY_FLAG_BITS) != (first.data & ENTRY_FLAG_BITS))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool PageTable::can_form_napot(size_t first_index)
+    {
+        if (first_index % NAPOT_ENTRIES != 0)
+            return false;
+        return is_contiguous_run(first_index, NAPOT_ENTRIES, PAGE_FRAME_SIZE);
+    }
+
+    void PageTable::make_napot(size_t first_index)
+    {
+        auto &first = get_entry(first_index);
+        void *frame = first.as_pointer();
+        uint64_t flags = first.data & ENTRY_FLAG_BITS;
+        for (size_t i = 0; i < NAPOT_ENTRIES; ++i)
+        {
+            auto &entry = get_entry(first_index + i);
+            entry.point_to_napot_frame(frame);
+            entry.data = entry.data | flags;
+        }
+    }
+
+    void PageTable::split_napot(size_t entry_index)
+    {
+        size_t first_index = entry_index - entry_index % NAPOT_ENTRIES;
+        auto &first = get_entry(first_index);
+        byte *frame = as_byte_ptr(first.as_pointer());
+        uint64_t flags = first.data & ENTRY_FLAG_BITS;
+        for (size_t i = 0; i < NAPOT_ENTRIES; ++i)
+        {
+            auto &entry = get_entry(first_index + i);
+            entry.point_to_frame(frame + i * PAGE_FRAME_SIZE);
+            entry.data = entry.data | flags;
+        }
+    }
+
+    void PageTable::split_leaf(TableEntry leaf, FrameOrder order)
+    {
+        byte *frame = as_byte_ptr(leaf.as_pointer());
+        size_t frame_size = get_frame_size(next_vpn(order));
+        uint64_t flags = leaf.data & ENTRY_FLAG_BITS;
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; ++i)
+        {
+            auto &entry = get_entry(i);
+            entry.point_to_frame(frame + i * frame_size);
+            entry.data = entry.data | flags;
+        }
+    }
+
     FrameOrder next_vpn(FrameOrder v)
     {
         if (v == FrameOrder::LOWEST_ORDER)
@@ -224,10 +631,10 @@ namespace hls
             return FrameInfo<FrameOrder::SECOND_ORDER>::s_size;
         case FrameOrder::THIRD_ORDER:
             return FrameInfo<FrameOrder::THIRD_ORDER>::s_size;
-#ifdef SV48
         case FrameOrder::FOURTH_ORDER:
             return FrameInfo<FrameOrder::FOURTH_ORDER>::s_size;
-#endif
+        case FrameOrder::FIFTH_ORDER:
+            return FrameInfo<FrameOrder::FIFTH_ORDER>::s_size;
         default:
             return 0;
         }
@@ -240,7 +647,7 @@ namespace hls
 
     FrameOrder get_fit_level(size_t bytes)
     {
-        FrameOrder lvl = FrameOrder::HIGHEST_ORDER;
+        FrameOrder lvl = get_root_order();
 
         while (lvl != FrameOrder::LOWEST_ORDER)
         {
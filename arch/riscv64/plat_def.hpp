@@ -46,6 +46,80 @@ namespace hls
     constexpr uint64_t G_WHAT = uint64_t(1u) << 5;
     constexpr uint64_t ACCESS = uint64_t(1u) << 6;
     constexpr uint64_t DIRTY = uint64_t(1u) << 7;
+    // Bits 8 and 9 are reserved for supervisor software
+    constexpr uint64_t COPY_ON_WRITE = uint64_t(1u) << 8;
+    // Svnapot. A leaf with this bit is one of 16 identical entries translating a naturally aligned 64 KiB block,
+    // which the TLB may cache as a single entry.
+    constexpr uint64_t NAPOT = uint64_t(1u) << 63;
+    constexpr size_t NAPOT_ENTRIES = 16;
+    constexpr size_t NAPOT_FRAME_SIZE = NAPOT_ENTRIES * PAGE_FRAME_SIZE;
+
+    // Range of kernel virtual addresses handed out by VMMap when no address is requested. It sits below the
+    // kernel image, which lives at the topmost GiB.
+    constexpr uintptr_t KERNEL_DYNAMIC_BEGIN = 0xFFFFFFC000000000;
+    constexpr uintptr_t KERNEL_DYNAMIC_END = 0xFFFFFFFF80000000;
+    // Lower half address the copy-on-write self test maps its pages at. Nothing lives there once the low kernel is
+    // unmapped.
+    constexpr uintptr_t COW_SELF_TEST_ADDRESS = 0x40000000;
+
+    // Must match EXCEPTION_STACK_SIZE in trapentry.S
+    constexpr size_t EXCEPTION_STACK_SIZE = 0x4000;
+    // Stack of every hart but the boot one, whose stack is part of the kernel image.
+    constexpr size_t KERNEL_STACK_SIZE = 0x10000;
+    // Unmapped gap below each stack handed out by VMMap. Keeps stack bottoms 64 KiB aligned as well.
+    constexpr size_t STACK_GUARD_SIZE = NAPOT_FRAME_SIZE;
+
+    constexpr uint64_t SCAUSE_INTERRUPT = uint64_t(1u) << 63;
+
+    enum class TrapCause : uint64_t
+    {
+        INSTRUCTION_MISALIGNED = 0,
+        INSTRUCTION_ACCESS_FAULT = 1,
+        ILLEGAL_INSTRUCTION = 2,
+        BREAKPOINT = 3,
+        LOAD_MISALIGNED = 4,
+        LOAD_ACCESS_FAULT = 5,
+        STORE_MISALIGNED = 6,
+        STORE_ACCESS_FAULT = 7,
+        USER_ECALL = 8,
+        SUPERVISOR_ECALL = 9,
+        INSTRUCTION_PAGE_FAULT = 12,
+        LOAD_PAGE_FAULT = 13,
+        STORE_PAGE_FAULT = 15
+    };
+
+    enum class InterruptCause : uint64_t
+    {
+        SOFTWARE = 1,
+        TIMER = 5,
+        EXTERNAL = 9
+    };
+
+    // Optional ISA extensions the kernel knows how to use. Values are bits, so that a set fits in an integer.
+    enum class IsaExtension : uint64_t
+    {
+        SVNAPOT = uint64_t(1u) << 0,
+        SVADU = uint64_t(1u) << 1,
+        ZACAS = uint64_t(1u) << 2,
+        V = uint64_t(1u) << 3,
+        SSTC = uint64_t(1u) << 4
+    };
+
+    /**
+     * @brief Records which optional extensions are implemented by every hart described in the device tree, looking
+     * at riscv,isa-extensions and falling back to the riscv,isa string.
+     * @remark Thread safety: ST. Must run before other harts are started.
+     */
+    void detect_isa_extensions(const void *fdt);
+    bool has_isa_extension(IsaExtension extension);
+
+    /**
+     * @brief Asks the SBI to let the hardware set the A and D bits (Svadu). Otherwise accessing a page with A clear,
+     * or writing one with D clear, raises a page fault and the bits are set by software.
+     * @remark Thread safety: ST. Affects the calling hart only.
+     * @return true if the hardware now updates the bits.
+     */
+    bool enable_hardware_ad_updates();
 
     using uintreg_t = uint64_t;
     using max_align_t = void *;
@@ -57,17 +131,57 @@ namespace hls
         SECOND_ORDER = 1,
         THIRD_ORDER = 2,
         FOURTH_ORDER = 3,
+        FIFTH_ORDER = 4,
+        INVALID = 5,
+        // Deepest root level this image may run with. Images built with SVAUTO probe the actual one at boot.
 #ifdef SV39
-        HIGHEST_ORDER = THIRD_ORDER,
+        HIGHEST_ORDER = THIRD_ORDER
 #elif SV48
-        HIGHEST_ORDER = FOURTH_ORDER,
+        HIGHEST_ORDER = FOURTH_ORDER
+#elif defined(SV57) || defined(SVAUTO)
+        HIGHEST_ORDER = FIFTH_ORDER
 #endif
-        INVALID
     };
 
+    constexpr uint64_t SATP_MODE_SHIFT = 60;
+
+    // satp encodes Sv39, Sv48 and Sv57 as 8, 9 and 10, one more for each extra level.
+    constexpr uint64_t satp_mode_for(FrameOrder root_order)
+    {
+        return (uint64_t(static_cast<size_t>(root_order)) + 6) << SATP_MODE_SHIFT;
+    }
+
+    constexpr FrameOrder root_order_for(uint64_t satp_mode)
+    {
+        return static_cast<FrameOrder>((satp_mode >> SATP_MODE_SHIFT) - 6);
+    }
+
+    /**
+     * @brief Level of the root page table, i.e. Sv39, Sv48 or Sv57. Known at compile time unless the image is built
+     * with SVAUTO.
+     */
+#ifdef SVAUTO
+    FrameOrder get_root_order();
+#else
+    constexpr FrameOrder get_root_order()
+    {
+        return FrameOrder::HIGHEST_ORDER;
+    }
+#endif
+
+    /**
+     * @brief Records the paging mode selected by the boot code.
+     * @remark Thread safety: ST. Must run before any page table is walked.
+     */
+    void initialize_paging_mode(uint64_t satp_mode);
+
+    struct PageTable;
+
     void kinit_putchar(char c);
     FrameOrder next_vpn(FrameOrder v);
     void _flush_tlb();
+    void _flush_tlb_page(const void *vaddress);
+    void _set_root_table(const PageTable *table);
 
     template <FrameOrder P>
     struct FrameInfo
@@ -129,6 +243,7 @@ namespace hls
 
         bool is_leaf();
         bool is_table_pointer();
+        bool is_napot();
 
         bool is_writable();
         bool is_readable();
@@ -142,6 +257,12 @@ namespace hls
 
         void point_to_frame(const void *frame);
 
+        /**
+         * @brief Makes the entry one of the 16 leaves of a 64 KiB NAPOT block. **frame** must be 64 KiB aligned.
+         * as_pointer returns the start of the block for such entries.
+         */
+        void point_to_napot_frame(const void *frame);
+
         void set_system_flags(uint64_t flags);
 
         void unset_system_flags(uint64_t flags);
@@ -184,6 +305,25 @@ namespace hls
         void *compose_address_with_entry(void *vaddress, size_t entry_idx, FrameOrder order);
         void print_entries();
         bool is_empty();
+
+        /**
+         * @brief Checks whether **count** entries starting at **first_index** are leaves of **entry_size** bytes
+         * mapping physically contiguous memory with identical flags, starting at an address aligned to the size of
+         * the whole run. Such a run can be replaced by a single larger leaf.
+         */
+        bool is_contiguous_run(size_t first_index, size_t count, size_t entry_size);
+
+        // NAPOT helpers, only meaningful for tables of the lowest level. Entries are grouped in runs of
+        // NAPOT_ENTRIES starting at multiples of it.
+        bool can_form_napot(size_t first_index);
+        void make_napot(size_t first_index);
+        void split_napot(size_t entry_index);
+
+        /**
+         * @brief Fills the table with leaves one order below **order** translating the same memory as **leaf**, a
+         * leaf of **order**, with the same flags.
+         */
+        void split_leaf(TableEntry leaf, FrameOrder order);
     };
 
     using FrameKB = PageFrame<FrameOrder::FIRST_ORDER>;
@@ -194,10 +334,8 @@ namespace hls
     using FrameGB = PageFrame<FrameOrder::THIRD_ORDER>;
     static_assert(sizeof(FrameGB) == FrameInfo<FrameOrder::THIRD_ORDER>::s_size);
 
-#ifdef SV48
     using FrameTB = PageFrame<FrameOrder::FOURTH_ORDER>;
     static_assert(sizeof(FrameTB) == FrameInfo<FrameOrder::FOURTH_ORDER>::s_size);
-#endif
 
     struct __attribute__((packed)) _reg_as_data
     {
@@ -245,6 +383,225 @@ namespace hls
         } reg;
     };
 
+    /**
+     * @brief State saved by _s_trap on every trap. The layout is shared with trapentry.S. sepc and sstatus are
+     * written back on return, so handlers may modify them.
+     */
+    struct TrapFrame
+    {
+        uint64_t regs[32];
+        uint64_t sepc;
+        uint64_t sstatus;
+        uint64_t scause;
+        uint64_t stval;
+    };
+
+    static_assert(sizeof(TrapFrame) == 288);
+
+    /**
+     * @brief Installs the trap vector on the calling hart. Exceptions are handled on the boot exception stack.
+     * @remark Thread safety: ST.
+     */
+    void initialize_trap_handling();
+
+    /**
+     * @brief Same as initialize_trap_handling(), for harts that bring their own exception stack.
+     * @param exception_stack_top Top of an EXCEPTION_STACK_SIZE bytes stack owned by the calling hart.
+     */
+    void initialize_trap_handling(void *exception_stack_top);
+
+    // States reported by the SBI Hart State Management extension.
+    enum class HartStatus : uint64_t
+    {
+        STARTED = 0,
+        STOPPED = 1,
+        START_PENDING = 2,
+        STOP_PENDING = 3,
+        SUSPENDED = 4,
+        SUSPEND_PENDING = 5,
+        RESUME_PENDING = 6,
+        UNKNOWN = ~uint64_t(0)
+    };
+
+    /**
+     * @brief What a secondary hart needs to leave _secondary_start, which runs with translation off. The layout is
+     * shared with asm.S. Must not cross a page boundary, as the hart reads it through its physical address.
+     */
+    struct alignas(64) SecondaryBootData
+    {
+        uint64_t satp;
+        void *v_continuation;
+        void *v_stack_top;
+        void (*v_entry)(size_t cpu_id);
+        size_t cpu_id;
+    };
+
+    static_assert(sizeof(SecondaryBootData) == 64);
+
+    /**
+     * @brief Asks the SBI to start **hart_id** at the physical address **p_entry**, with a0 holding the hart id and
+     * a1 holding **opaque**.
+     * @return true if the request was accepted. The hart may take a while to actually start running.
+     */
+    bool _start_hart(size_t hart_id, const void *p_entry, uintptr_t opaque);
+    HartStatus _get_hart_status(size_t hart_id);
+
+    /**
+     * @brief Whether the SBI implements HSM HART_SUSPEND, which needs version 0.3 of the specification.
+     */
+    bool _sbi_has_hart_suspend();
+
+    /**
+     * @brief Suspends the calling hart in the retentive state **suspend_type** until an interrupt enabled in sie is
+     * pending, whether sstatus.SIE is set or not. Registers and CSRs are kept, as with wfi.
+     * @return false if the SBI refused, in which case the hart didn't sleep.
+     */
+    bool _sbi_hart_suspend(uint32_t suspend_type);
+    uint64_t _get_satp();
+
+    // tp is never touched by compiled code, as the kernel has no TLS. It points at the per hart area of the running
+    // hart.
+    uintptr_t _get_thread_pointer();
+    void _set_thread_pointer(uintptr_t value);
+    void _wait_for_interrupt();
+    // Whether an interrupt enabled in sie is pending, which is what ends wfi.
+    bool _has_pending_interrupt();
+
+    constexpr uint64_t SSTATUS_SIE = uint64_t(1u) << 1;
+
+    // Clears sstatus.SIE and returns its previous value, to be handed to _restore_interrupts.
+    uint64_t _disable_interrupts();
+    void _restore_interrupts(uint64_t state);
+    uint64_t _read_cycle_counter();
+    // Zihintpause. Executes as a plain fence hint on harts without it.
+    void _cpu_relax();
+    // The time CSR. Unlike cycle, it ticks at the same rate on every hart and is synchronised between them.
+    uint64_t _read_time();
+
+    /**
+     * @brief Reads how fast the time CSR ticks from /cpus/timebase-frequency.
+     * @remark Thread safety: ST. Must run before other harts are started.
+     */
+    void detect_timebase_frequency(const void *fdt);
+
+    // Ticks of the time CSR per second. Assumed to be 10 MHz, as on QEMU, when the device tree doesn't say.
+    uint64_t get_timebase_frequency();
+
+    /**
+     * @brief Registers a thread keeps across _switch_context. The calling convention has the caller save everything
+     * else. The layout is shared with context.S.
+     */
+    struct ThreadContext
+    {
+        uint64_t ra;
+        uint64_t sp;
+        uint64_t s[12];
+    };
+
+    static_assert(sizeof(ThreadContext) == 112);
+
+    /**
+     * @brief Saves the callee saved registers of the running thread into **from** and resumes the thread described by
+     * **to**. Returns once some other thread switches back to **from**.
+     * @remark Thread safety: ST. Interrupts should be masked, a trap in between would run on a half switched thread.
+     */
+    extern "C" void _switch_context(ThreadContext *from, const ThreadContext *to);
+
+    /**
+     * @brief Prepares **context** so that switching to it calls **entry(argument)** on the stack ending at
+     * **stack_top**. **entry** must not return.
+     */
+    void _initialize_context(ThreadContext *context, void *stack_top, void (*entry)(void *), void *argument);
+
+    // Values of sstatus.FS and sstatus.VS. The hardware moves a field to DIRTY whenever the registers it covers are
+    // written, and instructions touching them raise an illegal instruction exception while it is OFF.
+    enum class ExtensionStatus : uint64_t
+    {
+        OFF = 0,
+        INITIAL = 1,
+        CLEAN = 2,
+        DIRTY = 3
+    };
+
+    ExtensionStatus _get_fp_status();
+    void _set_fp_status(ExtensionStatus status);
+    ExtensionStatus _get_vector_status();
+    void _set_vector_status(ExtensionStatus status);
+
+    // The layout is shared with context.S.
+    struct FpState
+    {
+        uint64_t f[32];
+        uint64_t fcsr;
+    };
+
+    static_assert(sizeof(FpState) == 264);
+
+    /**
+     * @brief Vector CSRs, followed by the 32 vector registers, _get_vector_register_size() bytes each. The layout is
+     * shared with context.S.
+     */
+    struct VectorState
+    {
+        uint64_t vstart;
+        uint64_t vl;
+        uint64_t vtype;
+        uint64_t vcsr;
+    };
+
+    static_assert(sizeof(VectorState) == 32);
+
+    /**
+     * @brief FP and vector registers of a thread, switched lazily. Threads that never touch them never pay for them.
+     */
+    struct ExtensionContext
+    {
+        FpState fp = {};
+        // Allocated on first vector use.
+        VectorState *vector = nullptr;
+        // Hart whose registers last received this state, if any. Together with the owner recorded by that hart, it
+        // tells whether the registers still hold the state and the restore can be skipped.
+        size_t fp_cpu = ~size_t(0);
+        size_t vector_cpu = ~size_t(0);
+    };
+
+    // FS must not be OFF, or VS for the vector functions. Restores leave the field DIRTY.
+    extern "C" void _save_fp_state(FpState *state);
+    extern "C" void _restore_fp_state(const FpState *state);
+    extern "C" void _save_vector_state(VectorState *state);
+    extern "C" void _restore_vector_state(const VectorState *state);
+
+    // vlenb. Only meaningful on harts with the V extension.
+    size_t _get_vector_register_size();
+
+    /**
+     * @brief Looks for an ACLINT SSWI device in the device tree. Without one, IPIs go through the SBI.
+     * @remark Thread safety: ST. Must run before other harts are started.
+     */
+    void detect_ipi_controller(const void *fdt);
+
+    /**
+     * @brief Raises a supervisor software interrupt on each hart whose id is **hart_mask_base** plus the index of a
+     * bit set in **hart_mask**.
+     */
+    void _send_ipi(uint64_t hart_mask, uint64_t hart_mask_base);
+    bool _sbi_send_ipi(uint64_t hart_mask, uint64_t hart_mask_base);
+
+    /**
+     * @brief Has the harts in the mask, in the SBI's base plus mask notation, execute sfence.vma over
+     * [**vaddress**, **vaddress** + **size**). A size of ~0 flushes everything.
+     */
+    bool _sbi_remote_sfence_vma(uint64_t hart_mask, uint64_t hart_mask_base, const void *vaddress, size_t size);
+    void _clear_ipi();
+    void _enable_software_interrupts();
+
+    /**
+     * @brief Has the supervisor timer interrupt fire once the time CSR reaches **time**, by writing stimecmp on harts
+     * with Sstc and through the SBI TIME extension otherwise. Also clears a pending timer interrupt.
+     */
+    void _set_timer(uint64_t time);
+    void _enable_timer_interrupts();
+
 } // namespace hls
 
 #endif
@@ -0,0 +1,382 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/smp.hpp"
+#include "libfdt.h"
+#include "mem/mmap.hpp"
+#include "mem/tlb.hpp"
+#include "plat_def.hpp"
+#include "sys/cpu.hpp"
+#include "sys/fpu.hpp"
+#include "sys/idle.hpp"
+#include "sys/ipi.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "sys/rcu.hpp"
+#include "sys/string.hpp"
+#include "sys/task.hpp"
+#include "sys/thread.hpp"
+#include "sys/timer.hpp"
+#include "ulib/atomic.hpp"
+
+extern "C" byte _secondary_high;
+
+namespace hls
+{
+    // How many times the boot hart polls a started hart before giving up on it.
+    constexpr size_t HART_START_SPINS = 1 << 24;
+
+    struct HartInfo
+    {
+        size_t hart_id;
+        HartState state;
+        void *stack_top;
+        void *exception_stack_top;
+        uint32_t phandle;
+        uint32_t cluster;
+        uint32_t numa_node;
+    };
+
+    static HartInfo s_harts[MAX_HARTS];
+    static size_t s_hart_count = 0;
+    static SecondaryBootData s_boot_data[MAX_HARTS];
+
+    static bool is_usable_cpu_node(const void *fdt, int node)
+    {
+        const char *type = reinterpret_cast<const char *>(fdt_getprop(fdt, node, "device_type", nullptr));
+        if (type == nullptr || strncmp(type, "cpu", 4) != 0)
+            return false;
+
+        // A missing status means the node is enabled.
+        const char *status = reinterpret_cast<const char *>(fdt_getprop(fdt, node, "status", nullptr));
+        return status == nullptr || strncmp(status, "okay", 5) == 0 || strncmp(status, "ok", 3) == 0;
+    }
+
+    Result<size_t> read_hart_id(const void *fdt, int node, int address_cells)
+    {
+        int length = 0;
+        auto reg = fdt_getprop(fdt, node, "reg", &length);
+        if (reg == nullptr || length < address_cells * 4)
+            return error<size_t>(Error::NOT_FOUND);
+
+        if (address_cells == 2)
+            return value(size_t(fdt64_ld(reinterpret_cast<const fdt64_t *>(reg))));
+        return value(size_t(fdt32_ld(reinterpret_cast<const fdt32_t *>(reg))));
+    }
+
+    // U-Boot's go command doesn't tell us which hart we are running on. Firmware usually records it in
+    // /chosen/boot-hartid. Failing that, the boot hart is the only listed hart HSM reports as started.
+    static Result<size_t> find_boot_hart_id(const void *fdt, int cpus, int address_cells)
+    {
+        int chosen = fdt_path_offset(fdt, "/chosen");
+        if (chosen >= 0)
+        {
+            int length = 0;
+            auto prop = fdt_getprop(fdt, chosen, "boot-hartid", &length);
+            if (prop != nullptr && length == 4)
+                return value(size_t(fdt32_ld(reinterpret_cast<const fdt32_t *>(prop))));
+            if (prop != nullptr && length == 8)
+                return value(size_t(fdt64_ld(reinterpret_cast<const fdt64_t *>(prop))));
+        }
+
+        size_t started = 0;
+        size_t boot_hart_id = 0;
+        for (auto node = fdt_first_subnode(fdt, cpus); node >= 0; node = fdt_next_subnode(fdt, node))
+        {
+            if (!is_usable_cpu_node(fdt, node))
+                continue;
+            auto hart_id = read_hart_id(fdt, node, address_cells);
+            if (hart_id.is_error() || _get_hart_status(hart_id.get_value()) != HartStatus::STARTED)
+                continue;
+            boot_hart_id = hart_id.get_value();
+            ++started;
+        }
+
+        if (started != 1)
+            return error<size_t>(Error::NOT_FOUND);
+        return value(boot_hart_id);
+    }
+
+    static uint32_t read_numa_node(const void *fdt, int node)
+    {
+        int length = 0;
+        auto prop = fdt_getprop(fdt, node, "numa-node-id", &length);
+        if (prop == nullptr || length != 4)
+            return 0;
+        return fdt32_ld(reinterpret_cast<const fdt32_t *>(prop));
+    }
+
+    static void enumerate_harts(const void *fdt, int cpus, int address_cells, size_t boot_hart_id)
+    {
+        s_hart_count = 1;
+        for (auto node = fdt_first_subnode(fdt, cpus); node >= 0; node = fdt_next_subnode(fdt, node))
+        {
+            if (!is_usable_cpu_node(fdt, node))
+                continue;
+            auto hart_id = read_hart_id(fdt, node, address_cells);
+            if (hart_id.is_error())
+                continue;
+
+            HartInfo info = {.hart_id = hart_id.get_value(), .state = HartState::OFFLINE, .stack_top = nullptr,
+                             .exception_stack_top = nullptr, .phandle = fdt_get_phandle(fdt, node), .cluster = 0,
+                             .numa_node = read_numa_node(fdt, node)};
+            if (info.hart_id == boot_hart_id)
+            {
+                info.state = HartState::ONLINE;
+                s_harts[0] = info;
+                continue;
+            }
+            if (s_hart_count == MAX_HARTS)
+            {
+                kprintln("More than {} harts. Hart {} is left alone.", MAX_HARTS, hart_id.get_value());
+                continue;
+            }
+
+            s_harts[s_hart_count++] = info;
+        }
+    }
+
+    // Leaves of the cpu-map are core or thread nodes pointing at a cpu node. Each cluster, nested or not, gets its
+    // own number, and a hart belongs to the innermost cluster around it.
+    static void read_cpu_map(const void *fdt, int parent, uint32_t cluster, uint32_t &cluster_count)
+    {
+        int node;
+        fdt_for_each_subnode(node, fdt, parent)
+        {
+            int length = 0;
+            auto cpu = fdt_getprop(fdt, node, "cpu", &length);
+            if (cpu != nullptr && length == 4)
+            {
+                uint32_t phandle = fdt32_ld(reinterpret_cast<const fdt32_t *>(cpu));
+                for (size_t cpu_id = 0; cpu_id < s_hart_count; ++cpu_id)
+                {
+                    if (s_harts[cpu_id].phandle == phandle)
+                        s_harts[cpu_id].cluster = cluster;
+                }
+                continue;
+            }
+
+            const char *name = fdt_get_name(fdt, node, nullptr);
+            bool is_cluster = name != nullptr && strncmp(name, "cluster", 7) == 0;
+            read_cpu_map(fdt, node, is_cluster ? cluster_count++ : cluster, cluster_count);
+        }
+    }
+
+    [[noreturn]] static void secondary_main(size_t cpu_id)
+    {
+        enter_per_hart_area(cpu_id);
+        set_cpu_id(cpu_id);
+        initialize_trap_handling(s_harts[cpu_id].exception_stack_top);
+        tlb_set_active_root(VMMap::get_global_instance().get_root_table());
+        // Hardware A/D updating is a per hart setting. Harts without it fall back to software updates.
+        enable_hardware_ad_updates();
+        enable_ipi();
+        disable_fpu();
+        enable_timers();
+        start_scheduler_tick();
+        enable_interrupts();
+        kprintln("Hart {} is online as cpu {}.", s_harts[cpu_id].hart_id, cpu_id);
+        atomic_store(&s_harts[cpu_id].state, HartState::ONLINE, MemoryOrder::RELEASE);
+        idle_loop();
+    }
+
+    static bool start_hart(size_t cpu_id, const bootinfo *b_info)
+    {
+        auto &vmmap = VMMap::get_global_instance();
+        HartInfo &hart = s_harts[cpu_id];
+
+        if (create_per_hart_area(cpu_id).is_error())
+            return false;
+        auto stack = vmmap.allocate_stack(KERNEL_STACK_SIZE);
+        if (stack.is_error())
+        {
+            destroy_per_hart_area(cpu_id);
+            return false;
+        }
+        auto exception_stack = vmmap.allocate_stack(EXCEPTION_STACK_SIZE);
+        if (exception_stack.is_error())
+        {
+            vmmap.free_stack(stack.get_value(), KERNEL_STACK_SIZE);
+            destroy_per_hart_area(cpu_id);
+            return false;
+        }
+        hart.stack_top = stack.get_value();
+        hart.exception_stack_top = exception_stack.get_value();
+
+        // Secondary harts share the kernel page table, so they use the satp of the boot hart.
+        SecondaryBootData &data = s_boot_data[cpu_id];
+        data = {.satp = _get_satp(), .v_continuation = &_secondary_high, .v_stack_top = hart.stack_top,
+                .v_entry = secondary_main, .cpu_id = cpu_id};
+
+        auto mapping = vmmap.get_mapping_data(&data);
+        if (mapping.is_error())
+            PANIC("Kernel data isn't mapped.");
+        auto &info = mapping.get_value();
+        uintptr_t offset = to_uintptr_t(&data) - to_uintptr_t(info.get_vaddress());
+        uintptr_t p_data = to_uintptr_t(info.get_paddress()) + offset;
+
+        hart.state = HartState::STARTING;
+        if (!_start_hart(hart.hart_id, b_info->p_secondary_start, p_data))
+        {
+            hart.state = HartState::OFFLINE;
+            vmmap.free_stack(hart.exception_stack_top, EXCEPTION_STACK_SIZE);
+            vmmap.free_stack(hart.stack_top, KERNEL_STACK_SIZE);
+            destroy_per_hart_area(cpu_id);
+            return false;
+        }
+
+        for (size_t spin = 0; spin < HART_START_SPINS; ++spin)
+        {
+            if (atomic_load(&hart.state, MemoryOrder::ACQUIRE) == HartState::ONLINE)
+                return true;
+        }
+
+        // The hart may still show up later, so its stacks stay allocated.
+        return false;
+    }
+
+    size_t start_secondary_harts(const void *fdt, const bootinfo *b_info)
+    {
+        int cpus = fdt_path_offset(fdt, "/cpus");
+        int address_cells = cpus >= 0 ? fdt_address_cells(fdt, cpus) : -1;
+        auto boot_hart_id = cpus >= 0 ? find_boot_hart_id(fdt, cpus, address_cells) : error<size_t>(Error::NOT_FOUND);
+        if (boot_hart_id.is_error() || (address_cells != 1 && address_cells != 2))
+        {
+            // Without knowing who we are, starting other harts could start ourselves.
+            kprintln("Couldn't identify the boot hart. Running on a single hart.");
+            s_harts[0] = {.hart_id = 0, .state = HartState::ONLINE, .stack_top = nullptr,
+                          .exception_stack_top = nullptr, .phandle = 0, .cluster = 0, .numa_node = 0};
+            s_hart_count = 1;
+            return 1;
+        }
+
+        s_harts[0] = {.hart_id = boot_hart_id.get_value(), .state = HartState::ONLINE, .stack_top = nullptr,
+                      .exception_stack_top = nullptr, .phandle = 0, .cluster = 0, .numa_node = 0};
+        enumerate_harts(fdt, cpus, address_cells, boot_hart_id.get_value());
+        int cpu_map = fdt_subnode_offset(fdt, cpus, "cpu-map");
+        if (cpu_map >= 0)
+        {
+            // Cluster 0 gathers the harts that aren't inside any cluster.
+            uint32_t cluster_count = 1;
+            read_cpu_map(fdt, cpu_map, 0, cluster_count);
+        }
+        kprintln("Hart {} is online as cpu 0, the boot hart. {} harts described.", boot_hart_id.get_value(),
+                 s_hart_count);
+
+        size_t online = 1;
+        for (size_t cpu_id = 1; cpu_id < s_hart_count; ++cpu_id)
+        {
+            if (_get_hart_status(s_harts[cpu_id].hart_id) != HartStatus::STOPPED)
+            {
+                kprintln("Hart {} isn't stopped. Leaving it alone.", s_harts[cpu_id].hart_id);
+                continue;
+            }
+
+            if (start_hart(cpu_id, b_info))
+                ++online;
+            else
+                kprintln("Hart {} failed to start.", s_harts[cpu_id].hart_id);
+        }
+
+        return online;
+    }
+
+    size_t get_hart_count()
+    {
+        return s_hart_count;
+    }
+
+    size_t get_online_hart_count()
+    {
+        size_t online = 0;
+        for (size_t cpu_id = 0; cpu_id < s_hart_count; ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                ++online;
+        }
+
+        return online;
+    }
+
+    size_t get_hart_id(size_t cpu_id)
+    {
+        return s_harts[cpu_id].hart_id;
+    }
+
+    HartState get_hart_state(size_t cpu_id)
+    {
+        return atomic_load(&s_harts[cpu_id].state, MemoryOrder::ACQUIRE);
+    }
+
+    HartDistance get_hart_distance(size_t cpu_id, size_t other_cpu_id)
+    {
+        const HartInfo &hart = s_harts[cpu_id];
+        const HartInfo &other = s_harts[other_cpu_id];
+        if (hart.numa_node != other.numa_node)
+            return HartDistance::REMOTE;
+        return hart.cluster == other.cluster ? HartDistance::SAME_CLUSTER : HartDistance::SAME_NODE;
+    }
+
+    CpuMask get_online_cpu_mask()
+    {
+        CpuMask mask = 0;
+        for (size_t cpu_id = 0; cpu_id < s_hart_count; ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                mask |= cpu_mask_of(cpu_id);
+        }
+
+        return mask;
+    }
+
+    void idle_loop()
+    {
+        while (true)
+        {
+            reap_threads();
+            run_tasks();
+            // Runs the ready threads, stealing from other harts once ours are done, and comes back when none is left.
+            thread_yield();
+            // Then helps other harts with the work they forked.
+            run_stolen_work();
+
+            // wfi and the SBI suspend wake up on pending interrupts even when they are masked. Keeping them masked
+            // means handlers only run once the hart stopped counting as idle for RCU, and a thread readied by one
+            // can't be missed.
+            InterruptState state = disable_interrupts();
+            if (!has_ready_tasks() && scheduler_enter_idle())
+            {
+                rcu_enter_idle();
+                tlb_enter_lazy();
+                enter_idle_state();
+                tlb_exit_lazy();
+                rcu_exit_idle();
+                scheduler_exit_idle();
+            }
+            restore_interrupts(state);
+        }
+    }
+
+} // namespace hls
@@ -0,0 +1,118 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "mem/mmap.hpp"
+#include "plat_def.hpp"
+#include "sys/deferred.hpp"
+#include "sys/fpu.hpp"
+#include "sys/ipi.hpp"
+#include "sys/panic.hpp"
+#include "sys/print.hpp"
+#include "sys/thread.hpp"
+#include "sys/timer.hpp"
+
+extern "C" byte _trap_sp_end;
+extern "C" void _setup_trap_handling(void *exception_stack_top);
+
+namespace hls
+{
+
+    void initialize_trap_handling()
+    {
+        _setup_trap_handling(&_trap_sp_end);
+    }
+
+    void initialize_trap_handling(void *exception_stack_top)
+    {
+        _setup_trap_handling(exception_stack_top);
+    }
+
+    void unhandled_trap(TrapFrame *frame)
+    {
+        kprintln("Unhandled trap. scause: {} sepc: {} stval: {}", to_ptr(frame->scause), to_ptr(frame->sepc),
+                 to_ptr(frame->stval));
+        PANIC("Unhandled trap.");
+    }
+
+    void handle_interrupt(TrapFrame *frame)
+    {
+        switch (static_cast<InterruptCause>(frame->scause & ~SCAUSE_INTERRUPT))
+        {
+        case InterruptCause::SOFTWARE:
+            handle_ipi();
+            break;
+        case InterruptCause::TIMER:
+            handle_timer_interrupt();
+            break;
+        default:
+            unhandled_trap(frame);
+        }
+    }
+
+    bool handle_page_fault(TrapFrame *frame)
+    {
+        uint64_t access = 0;
+        switch (static_cast<TrapCause>(frame->scause))
+        {
+        case TrapCause::INSTRUCTION_PAGE_FAULT:
+            access = VM_EXECUTE_FLAG;
+            break;
+        case TrapCause::LOAD_PAGE_FAULT:
+            access = VM_READ_FLAG;
+            break;
+        case TrapCause::STORE_PAGE_FAULT:
+            access = VM_WRITE_FLAG;
+            break;
+        default:
+            return false;
+        }
+
+        // The faulting instruction is retried on return, as sepc still points to it.
+        return VMMap::get_global_instance().handle_page_fault(to_ptr(frame->stval), access);
+    }
+
+} // namespace hls
+
+using namespace hls;
+
+extern "C" void traphandler(TrapFrame *frame)
+{
+    if (frame->scause & SCAUSE_INTERRUPT)
+    {
+        interrupt_enter();
+        handle_interrupt(frame);
+        // Runs what the handler deferred, with interrupts enabled again.
+        interrupt_exit();
+        // We are on the stack of the interrupted thread, so it can be switched away from here and resumed later.
+        preempt_from_interrupt();
+        return;
+    }
+
+    // FP and vector instructions trap while their registers are off, until the thread's state is loaded.
+    bool handled = static_cast<TrapCause>(frame->scause) == TrapCause::ILLEGAL_INSTRUCTION ? handle_fpu_trap(frame)
+                                                                                           : handle_page_fault(frame);
+    if (!handled)
+        unhandled_trap(frame);
+}
@@ -23,12 +23,16 @@ SOFTWARE.
 
 ---------------------------------------------------------------------------------*/
 
+#ifndef _FRAMEMANAGER_HPP_
+#define _FRAMEMANAGER_HPP_
+
 #include "mem/bumpallocator.hpp"
 #include "mem/nodeallocator.hpp"
 #include "misc/macros.hpp"
 #include "misc/types.hpp"
 #include "plat_def.hpp"
 #include "sys/bootdata.hpp"
+#include "sys/spinlock.hpp"
 #include "ulib/pair.hpp"
 #include "ulib/rb_tree.hpp"
 #include "ulib/singleton.hpp"
@@ -47,9 +51,15 @@ namespace hls
     {
     };
 
+    // Kept for frames holding page tables, so that empty tables are found without scanning them.
+    struct PageTableData
+    {
+        size_t valid_entries;
+    };
+
     class FrameData
     {
-        using UserData = Variant<placeholder_XXX>;
+        using UserData = Variant<placeholder_XXX, PageTableData>;
 
         FrameKB *m_frame_pointer;
         size_t m_frame_count;
@@ -79,9 +89,14 @@ namespace hls
         size_t get_frame_count() const;
         size_t size() const;
 
+        size_t get_use_count() const;
+        void increment_use_count();
+        size_t decrement_use_count();
+
         FrameKB *get_frame_pointer() const;
         FrameData &shrink_begin(size_t frames);
         FrameData &shrink_end(size_t frames);
+        FrameData &grow_end(size_t frames);
 
         template <typename U>
         void set_userdata(U &&newdata)
@@ -103,7 +118,17 @@ namespace hls
         }
     };
 
-    class FrameManager : public Singleton<FrameManager>
+    /**
+     * @brief Serializes the FrameManager and VMMap. They call into each other, for instance when a tree node allocator
+     * grows, so they share one lock the holding hart may take again.
+     */
+    RecursiveLock &get_memory_lock();
+
+    /**
+     * @brief Hands out physical frames and keeps a use count for each frame in use.
+     * @remark Thread safety: MT. Every public member takes get_memory_lock().
+     */
+    class FrameManager : public StaticSingleton<FrameManager>
     {
         using tree = RedBlackTree<FrameData, Hash, LessComparator, NodeAllocator>;
         BumpAllocator m_bump_allocator;
@@ -114,14 +139,59 @@ namespace hls
         FrameManager();
         FrameManager(const FrameManager &) = delete;
         FrameManager(FrameManager &&) = delete;
-        friend class Singleton<FrameManager>;
+        friend class StaticSingleton<FrameManager>;
+
+        static FrameData *find_range(tree &frames, const void *frame_pointer);
+        static FrameData *find_next_range(tree &frames, const void *frame_pointer);
+        // Adds frames to the free tree, merged with the free ranges right before and after them.
+        void insert_free_range(FrameKB *frames, size_t count);
+        // Splits the used range holding **frame** so that one starts at it. Sharing and releasing part of an
+        // allocation then only changes the counts of the frames involved.
+        void split_used_range(FrameKB *frame);
 
       public:
         void expand_memory(const Pair<void *, size_t> mem_info);
         FrameData *get_frames(size_t count, uint64_t flags);
-        void release_frames(void *frame_pointer);
+
+        /**
+         * @brief Drops one reference to each of the **count** frames starting at **frame_pointer**. Counts are kept
+         * per frame, so the range may cover part of an allocation, or several. Frames become free once nobody else
+         * shares them. Frames the FrameManager doesn't manage are ignored.
+         * @remark Thread safety: MT.
+         */
+        void release_frames(void *frame_pointer, size_t count);
+
+        /**
+         * @brief Adds a reference to each of the **count** frames starting at **frame_pointer**, so that they
+         * survive one more release_frames call. Frames the FrameManager doesn't manage are ignored.
+         * @remark Thread safety: MT.
+         */
+        void share_frames(void *frame_pointer, size_t count);
+
+        /**
+         * @brief References held on the frame at **frame_pointer**, which may lie anywhere within an allocation.
+         * @remark Thread safety: MT.
+         * @return 0 if the frame isn't in use or isn't managed by the FrameManager.
+         */
+        size_t get_use_count(const void *frame_pointer);
+
+        /**
+         * @brief Returns bookkeeping data of frames returned by get_frames.
+         * @remark Thread safety: MT.
+         * @return nullptr if **frame_pointer** is not the start of an allocation.
+         */
+        FrameData *get_frame_data(void *frame_pointer);
+
+        /**
+         * @brief Starts tracking **count** frames that were allocated before the FrameManager existed, as single
+         * frame allocations. They can then be shared, carry user data and be released like any other frame.
+         * @remark Thread safety: MT.
+         */
+        void track_frames(FrameKB *frames, size_t count);
     };
 
     void initialize_frame_manager(void *fdt, bootinfo *b_info);
 
 } // namespace hls
+
+#endif
@@ -1,4 +1,9 @@
+#ifndef _MMAP_HPP_
+#define _MMAP_HPP_
+
 #include "mem/bumpallocator.hpp"
+#include "mem/framemanager.hpp"
+#include "mem/tlb.hpp"
 #include "mem/nodeallocator.hpp"
 #include "misc/macros.hpp"
 #include "misc/types.hpp"
@@ -17,6 +22,42 @@ namespace hls
     constexpr uint64_t VM_EXECUTE_FLAG = 0x1 << 3;
     constexpr uint64_t VM_ACCESS_FLAG = 0x1 << 4;
     constexpr uint64_t VM_DIRTY_FLAG = 0x1 << 5;
+    // Not a page table flag. Marks a reservation whose frames are only allocated on first touch.
+    constexpr uint64_t VM_LAZY_FLAG = 0x1 << 6;
+    // Page is shared read-only and gets copied on the first write.
+    constexpr uint64_t VM_COW_FLAG = 0x1 << 7;
+    // Not a page table flag. Pages of the reservation are mapped with A/D clear, so their use can be harvested.
+    constexpr uint64_t VM_TRACK_FLAG = 0x1 << 8;
+
+    /**
+     * @brief Page counts gathered by VMMap::harvest_access_bits.
+     */
+    struct WorkingSetSample
+    {
+        size_t mapped_pages = 0;
+        size_t accessed_pages = 0;
+        size_t dirty_pages = 0;
+    };
+
+    /**
+     * @brief Summary of an address space, gathered by VMMap::inspect_address_space.
+     */
+    struct PageTableStatistics
+    {
+        // Leaves of each order. NAPOT leaves are counted both here, as 4 KiB leaves, and in napot_blocks.
+        size_t leaves[static_cast<size_t>(FrameOrder::HIGHEST_ORDER) + 1] = {};
+        size_t napot_blocks = 0;
+        // Every table, the root included.
+        size_t tables = 0;
+        size_t table_bytes = 0;
+        size_t mapped_bytes = 0;
+        // Tables whose entries could be replaced by one leaf of the next order, per order of the resulting leaf.
+        size_t promotable[static_cast<size_t>(FrameOrder::HIGHEST_ORDER) + 1] = {};
+        // Runs of 16 pages that could become NAPOT blocks.
+        size_t promotable_napot = 0;
+
+        void print() const;
+    };
 
     class MemMapInfo
     {
@@ -71,24 +112,240 @@ namespace hls
         }
     };
 
-    class VMMap : public Singleton<VMMap>
+    /**
+     * @brief A range of virtual addresses owned by someone, either mapped upfront or populated on demand.
+     */
+    class VMReservation
     {
+        byte *m_vaddress;
+        size_t m_size;
+        uint64_t m_flags;
+
+      public:
+        VMReservation(void *vaddress, size_t size, uint64_t flags)
+            : m_vaddress(as_byte_ptr(vaddress)), m_size(size), m_flags(flags)
+        {
+        }
+
+        void *get_vaddress() const
+        {
+            return m_vaddress;
+        }
+
+        void *get_end() const
+        {
+            return m_vaddress + m_size;
+        }
+
+        size_t get_size() const
+        {
+            return m_size;
+        }
+
+        uint64_t get_flags() const
+        {
+            return m_flags;
+        }
+
+        bool contains(const void *vaddress) const
+        {
+            return as_byte_ptr(vaddress) >= m_vaddress && as_byte_ptr(vaddress) < (m_vaddress + m_size);
+        }
+    };
+
+    template <>
+    class Hash<VMReservation>
+    {
+        SET_USING_CLASS(VMReservation, type);
+        SET_USING_CLASS(uintptr_t, hash_result);
+
+      public:
+        hash_result operator()(type_const_reference v) const
+        {
+            return to_uintptr_t(v.get_vaddress());
+        }
+    };
+
+    /**
+     * @brief Maps kernel virtual memory and keeps track of reserved ranges.
+     * @remark Thread safety: MT. Public members take get_memory_lock(), shared with the FrameManager.
+     */
+    class VMMap : public StaticSingleton<VMMap>
+    {
+        using reservation_tree = RedBlackTree<VMReservation, Hash, LessComparator, NodeAllocator>;
+
+        // Scratch mappings each hart has for accessing frames that aren't mapped anywhere.
+        static constexpr size_t s_scratch_slots = 2;
+
         PageTable *m_p_root_table;
         PageTable *m_v_scratch_table;
+        BumpAllocator m_bump_allocator;
+        reservation_tree m_reservations;
+        // Set while a caller gathers unmappings into a single shootdown.
+        TlbBatch *m_tlb_batch = nullptr;
 
         PageTable *get_scratch_table();
-        FrameKB *physical_frame_to_scratch_frame(FrameKB *frame);
+        FrameKB *physical_frame_to_scratch_frame(FrameKB *frame, size_t slot = 0);
         Pair<FrameOrder, PageTable *> table_walk(const void *vaddress, PageTable *table, FrameOrder order);
+        TableEntry *find_leaf_entry(const void *vaddress, FrameOrder *order, PageTable **table = nullptr);
+        size_t count_valid_entries(PageTable *table);
+        PageTableData *get_table_data(PageTable *table);
+        void add_table_entries(PageTable *table, size_t count);
+        size_t remove_table_entry(PageTable *table);
+        void split_napot(const void *vaddress);
+        // Replaces the huge leaf translating vaddress by tables of smaller leaves down to a page, keeping its flags.
+        bool split_huge_leaf(const void *vaddress);
+        Result<MemMapInfo> map_napot(void *paddress, void *vaddress, uint64_t flags);
+        PageTable *allocate_table();
+        Result<PageTable *> clone_table(PageTable *table, FrameOrder order, size_t entries);
+        void destroy_table(PageTable *table, FrameOrder order, size_t entries);
+        bool resolve_copy_on_write(const void *vaddress);
+        // Handles faults on leaves that already allow the access: missing A or D bits, and spurious faults.
+        bool resolve_access_fault(const void *vaddress, uint64_t access);
+        void harvest_table(PageTable *table, FrameOrder order, uintptr_t begin, uintptr_t end,
+                           WorkingSetSample &sample);
+        void inspect_table(PageTable *table, FrameOrder order, void *vbase, PageTableStatistics &stats,
+                           bool print_ranges);
+        const VMReservation *find_reservation(const void *vaddress) const;
+        Result<void *> find_free_range(size_t size, size_t alignment) const;
+        Result<MemMapInfo> populate(const void *vaddress, uint64_t flags);
         VMMap(PageTable *table, PageTable *scratch_table);
 
       public:
         Result<MemMapInfo> map_memory(void *paddress, void *vaddress, FrameOrder order, uint64_t flags);
         Result<MemMapInfo> map_first_fit(void *paddress, FrameOrder order, uint64_t flags);
+
+        /**
+         * @brief Maps **size** bytes of physically contiguous memory using the largest leaves allowed by the
+         * alignment of both addresses. When Svnapot is available, 64 KiB blocks that can't use a megapage are
+         * mapped as NAPOT leaves.
+         * @remark Thread safety: MT.
+         * @param size Size in bytes. Rounded up to a multiple of the page size.
+         * @return **vaddress**. Nothing is left mapped on error.
+         */
+        Result<void *> map_range(void *paddress, void *vaddress, size_t size, uint64_t flags);
+
+        /**
+         * @brief Turns runs of 4 KiB leaves within [begin, end) that are physically contiguous, 64 KiB aligned and
+         * share flags into NAPOT leaves. Does nothing without Svnapot.
+         * @remark Thread safety: MT.
+         * @return Number of 64 KiB blocks created.
+         */
+        size_t coalesce_range(void *begin, void *end);
+
         void unmap_memory(void *v_address);
-        Result<MemMapInfo> get_mapping_data(const void *vaddress) const;
+        Result<MemMapInfo> get_mapping_data(const void *vaddress);
         bool is_address_mapped(const void *vaddress);
         bool is_valid_virtual_address(const void *vaddress);
 
-        friend class Singleton<VMMap>;
+        /**
+         * @brief Reserves **size** bytes of kernel virtual address space without mapping anything. When flags
+         * contain VM_LAZY_FLAG, frames are allocated and mapped one page at a time on first touch.
+         * @remark Thread safety: MT.
+         * @param size Size in bytes. Rounded up to a multiple of the page size.
+         * @param alignment Alignment of the returned address. Must be a power of two multiple of the page size.
+         * @param flags VM_* flags applied to pages when they get mapped.
+         * @return The first address of the reserved range.
+         */
+        Result<void *> reserve_memory(size_t size, size_t alignment, uint64_t flags);
+
+        /**
+         * @brief Same as reserve_memory, but at a fixed address.
+         * @remark Thread safety: MT.
+         */
+        Result<void *> reserve_memory_at(void *vaddress, size_t size, uint64_t flags);
+
+        /**
+         * @brief Releases a reservation, unmapping every populated page. Frames of lazy reservations are given
+         * back to the FrameManager.
+         * @remark Thread safety: MT.
+         * @param vaddress First address of the reservation, as returned by reserve_memory.
+         */
+        void release_memory(void *vaddress);
+
+        /**
+         * @brief Maps **size** bytes of device registers at **paddress** into the dynamic region.
+         * @remark Thread safety: MT.
+         * @param paddress Physical address of the registers. Needn't be page aligned.
+         * @return The virtual address matching **paddress**.
+         */
+        Result<void *> map_device(void *paddress, size_t size);
+
+        /**
+         * @brief Allocates a kernel stack of **size** bytes. An unmapped guard region lies below it, so overflows
+         * end in a page fault instead of silently corrupting a neighbour. The stack is populated up front: an
+         * interrupt frame is pushed on the interrupted stack while sscratch is swapped, where a fault can't be taken.
+         * @remark Thread safety: MT.
+         * @param size Size in bytes. Rounded up to a multiple of the page size.
+         * @return The top of the stack, which is where the stack pointer starts.
+         */
+        Result<void *> allocate_stack(size_t size);
+
+        /**
+         * @brief Frees a stack returned by allocate_stack.
+         * @remark Thread safety: MT.
+         * @param stack_top Value returned by allocate_stack.
+         */
+        void free_stack(void *stack_top, size_t size);
+
+        /**
+         * @brief Resolves a page fault at **vaddress**.
+         * @remark Thread safety: MT.
+         * @param vaddress Faulting address.
+         * @param access VM_READ_FLAG, VM_WRITE_FLAG or VM_EXECUTE_FLAG, depending on the faulting access.
+         * @return true if the access may be retried, false if the fault is fatal.
+         */
+        bool handle_page_fault(const void *vaddress, uint64_t access);
+
+        /**
+         * @brief Counts the pages of [begin, end) in the address space rooted at **root** whose A and D bits are set,
+         * then clears them. Pages touched afterwards get their bits set again, either by the hardware or by
+         * handle_page_fault. The range must not cover memory used by the trap path.
+         * @remark Thread safety: MT.
+         */
+        WorkingSetSample harvest_access_bits(PageTable *root, void *begin, void *end);
+
+        /**
+         * @brief Walks the address space rooted at **root** and counts leaves, tables and ranges that could be mapped
+         * with larger leaves.
+         * @remark Thread safety: MT.
+         * @param print_ranges Prints every promotable range as it is found.
+         */
+        PageTableStatistics inspect_address_space(PageTable *root, bool print_ranges = false);
+
+        PageTable *get_root_table() const;
+
+        /**
+         * @brief Creates a copy-on-write clone of the current address space. Writable leaves of the lower half are
+         * made read-only in both spaces and their frames shared; frames are copied on the first write fault. The
+         * kernel half is shared as is.
+         * @remark Thread safety: MT.
+         * @return Physical address of the root table of the clone.
+         */
+        Result<PageTable *> clone_address_space();
+
+        /**
+         * @brief Makes **root** the current address space of the calling hart.
+         * @remark Thread safety: MT. The VMMap keeps a single current address space, which every hart operates on.
+         */
+        void switch_address_space(PageTable *root);
+
+        /**
+         * @brief Releases every table and frame reference held by the lower half of an address space that is not
+         * the current one.
+         * @remark Thread safety: MT.
+         */
+        void destroy_address_space(PageTable *root);
+
+        friend class StaticSingleton<VMMap>;
     };
+
+    /**
+     * @brief Clones an address space whose pages share one multi-frame allocation, copies a page on write in the
+     * clone, destroys the parent first and checks frame use counts and contents along the way. Panics on failure.
+     * @remark Thread safety: ST. Uses the lower half of the current address space, which must be unused.
+     */
+    void run_copy_on_write_self_test();
 } // namespace hls
+
+#endif
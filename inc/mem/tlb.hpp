@@ -0,0 +1,116 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _TLB_HPP_
+#define _TLB_HPP_
+
+#include "misc/types.hpp"
+#include "plat_def.hpp"
+#include "sys/smp.hpp"
+
+namespace hls
+{
+    // Ranges a TlbBatch keeps before degrading to a full flush.
+    constexpr size_t TLB_BATCH_RANGES = 8;
+    // Flushing a range costs one sfence.vma per page on every target, so beyond this many pages a full flush wins.
+    constexpr size_t TLB_FULL_FLUSH_PAGES = 64;
+    // Frames a TlbBatch holds back until its flush, as stale translations may still point at them.
+    constexpr size_t TLB_BATCH_FRAMES = 16;
+
+    struct TlbStatistics
+    {
+        uint64_t flushes = 0;
+        uint64_t ranges = 0;
+        uint64_t full_flushes = 0;
+        // Remote harts sent an RFENCE, and harts skipped because they sat idle in lazy TLB mode.
+        uint64_t remote_harts = 0;
+        uint64_t lazy_harts_skipped = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Collects translations invalidated in one address space and flushes them from every hart that may cache
+     * them in one go: sfence.vma locally, SBI RFENCE remotely. Kernel addresses are shared by every address space,
+     * so they are flushed on all online harts. Other addresses only on harts currently running **root**. Harts idle
+     * in lazy TLB mode are skipped and flush everything when they wake up.
+     * @remark Thread safety: ST. A batch belongs to the hart that created it.
+     */
+    class TlbBatch
+    {
+        struct Range
+        {
+            uintptr_t begin;
+            uintptr_t end;
+        };
+
+        const PageTable *m_root;
+        Range m_ranges[TLB_BATCH_RANGES];
+        size_t m_range_count = 0;
+        size_t m_pages = 0;
+        bool m_flush_all = false;
+        bool m_has_kernel_addresses = false;
+        void *m_frames[TLB_BATCH_FRAMES];
+        size_t m_frame_count = 0;
+
+        CpuMask get_targets();
+
+      public:
+        explicit TlbBatch(const PageTable *root);
+        ~TlbBatch();
+
+        TlbBatch(const TlbBatch &) = delete;
+        TlbBatch &operator=(const TlbBatch &) = delete;
+
+        void add(const void *vaddress, size_t size);
+        void add_all(bool kernel_addresses);
+
+        /**
+         * @brief Gives frames back to the FrameManager after the flush. Page tables and frames of unmapped pages
+         * must wait for it, or a stale translation could reach them after they were reused.
+         */
+        void release_after_flush(void *frame_pointer);
+
+        void flush();
+    };
+
+    /**
+     * @brief Brackets idle periods in which the hart touches no mapping that could be removed, so shootdowns may
+     * skip it. Leaving lazy mode flushes the local TLB if a shootdown was skipped meanwhile.
+     * @remark Thread safety: MT. Affects the calling hart only. Interrupts must stay masked in between.
+     */
+    void tlb_enter_lazy();
+    void tlb_exit_lazy();
+
+    /**
+     * @brief Records that the calling hart now translates through **root**.
+     */
+    void tlb_set_active_root(const PageTable *root);
+
+    TlbStatistics &get_tlb_statistics(size_t cpu_id);
+
+} // namespace hls
+
+#endif
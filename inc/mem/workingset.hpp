@@ -0,0 +1,125 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _WORKINGSET_HPP_
+#define _WORKINGSET_HPP_
+
+#include "mem/bumpallocator.hpp"
+#include "mem/mmap.hpp"
+#include "mem/nodeallocator.hpp"
+#include "misc/types.hpp"
+#include "ulib/rb_tree.hpp"
+#include "ulib/result.hpp"
+#include "ulib/singleton.hpp"
+
+namespace hls
+{
+    // Time between scans, in milliseconds.
+    constexpr uint64_t WORKING_SET_SCAN_PERIOD = 100;
+
+    /**
+     * @brief A range of an address space whose working set is being estimated.
+     */
+    class TrackedSpace
+    {
+        PageTable *m_root;
+        byte *m_begin;
+        byte *m_end;
+        size_t m_estimate;
+        WorkingSetSample m_last_sample;
+
+      public:
+        TrackedSpace(PageTable *root, void *begin, void *end);
+
+        PageTable *get_root() const;
+        void *get_begin() const;
+        void *get_end() const;
+
+        /**
+         * @brief Moving average of the pages touched between scans.
+         */
+        size_t get_estimate() const;
+        const WorkingSetSample &get_last_sample() const;
+        void add_sample(const WorkingSetSample &sample);
+    };
+
+    template <>
+    class Hash<TrackedSpace>
+    {
+        SET_USING_CLASS(TrackedSpace, type);
+        SET_USING_CLASS(uintptr_t, hash_result);
+
+      public:
+        hash_result operator()(type_const_reference v) const
+        {
+            return to_uintptr_t(v.get_root());
+        }
+    };
+
+    /**
+     * @brief Periodically harvests the A/D bits of registered address spaces to estimate their working sets. Ranges
+     * should be mapped with VM_TRACK_FLAG, so that pages don't start out as accessed.
+     */
+    class WorkingSetScanner : public Singleton<WorkingSetScanner>
+    {
+        using space_tree = RedBlackTree<TrackedSpace, Hash, LessComparator, NodeAllocator>;
+
+        BumpAllocator m_bump_allocator;
+        space_tree m_spaces;
+        uint64_t m_period;
+        uint64_t m_last_scan;
+
+        WorkingSetScanner(uint64_t period);
+        friend class Singleton<WorkingSetScanner>;
+
+      public:
+        /**
+         * @brief Starts estimating the working set of [begin, end) in the address space rooted at **root**. One
+         * range is tracked per address space.
+         * @remark Thread safety: ST. Scans run from a timer interrupt of the boot hart, so call from the boot hart
+         * with interrupts masked.
+         */
+        Result<const TrackedSpace *> track(PageTable *root, void *begin, void *end);
+        void untrack(PageTable *root);
+
+        /**
+         * @brief Harvests every tracked address space.
+         * @remark Thread safety: ST.
+         */
+        void scan();
+
+        /**
+         * @brief Scans if at least one period went by since the last scan. Meant to be called from a periodic
+         * timer.
+         * @remark Thread safety: ST.
+         * @param now Current time, in the same unit as the period.
+         */
+        void tick(uint64_t now);
+
+        Result<size_t> get_estimate(PageTable *root) const;
+    };
+} // namespace hls
+
+#endif
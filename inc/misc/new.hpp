@@ -29,9 +29,8 @@ SOFTWARE.
 #include "misc/macros.hpp"
 #include "misc/types.hpp"
 
-// Taken from stack overflow. GCC requires these functions to initialize local
-// static variables. Note that this offers no race protection, thus it is only
-// safe for single threaded code!
+// GCC requires these functions to initialize local static variables. Harts racing for the same variable are
+// serialised, and the losers wait until the winner is done.
 __extension__ typedef int __guard __attribute__((mode(__DI__)));
 
 extern "C" int __cxa_guard_acquire(__guard *g);
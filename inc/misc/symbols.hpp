@@ -41,6 +41,9 @@ extern "C" byte _driverinfo_end;
 extern "C" byte _rodata_end;
 extern "C" byte _data_begin;
 extern "C" byte _data_end;
+extern "C" byte _per_hart_begin;
+extern "C" byte _per_hart_end;
+extern "C" byte _boot_per_hart_begin;
 extern "C" byte _bss_begin;
 extern "C" byte _bss_end;
 extern "C" byte _stack_begin;
@@ -46,6 +46,10 @@ namespace hls
         byte *p_kernel_physical_end;
         byte *v_device_drivers_begin;
         byte *v_device_drivers_end;
+        // Mode bits of satp, as selected by the boot code. Read by asm.S.
+        uint64_t satp_mode;
+        // Physical address where secondary harts start.
+        void *p_secondary_start;
     };
 } // namespace hls
 
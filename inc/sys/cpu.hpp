@@ -31,9 +31,35 @@ SOFTWARE.
 namespace hls
 {
 
+    /**
+     * @brief Logical id of the calling hart. The boot hart is 0.
+     */
     size_t get_cpu_id();
+    void set_cpu_id(size_t cpu_id);
+    void wait_for_interrupt();
+
+    using InterruptState = uint64_t;
+
+    /**
+     * @brief Masks interrupts on the calling hart.
+     * @return What restore_interrupts needs to bring back the previous state. Calls may nest.
+     */
+    InterruptState disable_interrupts();
+    void restore_interrupts(InterruptState state);
+    void enable_interrupts();
+    uint64_t read_cycle_counter();
+
+    /**
+     * @brief Hints the hart that it is spinning, so that it may save power or yield to a sibling.
+     */
+    void cpu_relax();
     void flush_tlb();
-    void die();
+    void flush_tlb_page(const void *vaddress);
+
+    /**
+     * @brief Stops the calling hart for good. Interrupts are masked, and the hart sleeps instead of spinning.
+     */
+    [[noreturn]] void die();
 
 }; // namespace hls
 
@@ -0,0 +1,105 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _DEFERRED_HPP_
+#define _DEFERRED_HPP_
+
+#include "misc/types.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    // Items run per pass, on the way out of an interrupt or by the worker thread, and how long a pass may take. A
+    // pass stops at whichever comes first, and leaves the rest to the worker thread of the hart.
+    constexpr size_t DEFERRED_BATCH_SIZE = 32;
+    constexpr uint64_t DEFERRED_EXIT_BUDGET_US = 100;
+    constexpr uint64_t DEFERRED_WORKER_BUDGET_US = 1000;
+
+    using DeferredFunction = void (*)(void *argument);
+
+    /**
+     * @brief Work deferred by an interrupt handler, or by code that can't do it on the spot. Callers own the
+     * storage, which must stay valid while the item is queued. The fields belong to the deferred work queue.
+     */
+    struct DeferredWork
+    {
+        DeferredWork *next = nullptr;
+        DeferredFunction function = nullptr;
+        void *argument = nullptr;
+        // Set from queueing until the item starts running. A word, as byte sized atomics can't be exchanged.
+        Atomic<uint32_t> pending = 0;
+    };
+
+    /**
+     * @brief Per hart deferred work counters. Each hart only updates its own, so reading another hart's is
+     * approximate.
+     */
+    struct DeferredStatistics
+    {
+        uint64_t queued = 0;
+        // Items run on the way out of interrupts, and by the worker thread.
+        uint64_t exit_runs = 0;
+        uint64_t worker_runs = 0;
+        // Interrupt exits that ran out of budget and left items to the worker thread.
+        uint64_t budget_exhausted = 0;
+        uint64_t largest_batch = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Queues **work** on the calling hart to run **function(argument)**. Items run in the order they were
+     * queued, on the hart that queued them, so that whatever the interrupt handler touched is still in its caches.
+     * Items queued from an interrupt handler run on its way out, the others wake up the worker thread of the hart.
+     * Items run with interrupts enabled and preemption disabled, possibly on top of the thread the interrupt
+     * stopped. They must be short and must not block, and locks they take must be taken with interrupts masked
+     * everywhere else.
+     * @remark Thread safety: MT. May be called from interrupt handlers. An item may be queued again once it started
+     * running, also by itself.
+     * @return false if **work** was already queued, in which case it runs once.
+     */
+    bool queue_deferred_work(DeferredWork &work, DeferredFunction function, void *argument);
+
+    /**
+     * @brief Bracket interrupt handlers. Leaving the outermost one runs the deferred work of the hart, up to
+     * DEFERRED_BATCH_SIZE items or DEFERRED_EXIT_BUDGET_US, whichever comes first.
+     * @remark Thread safety: MT. Affects the calling hart only. Called with interrupts masked.
+     */
+    void interrupt_enter();
+    void interrupt_exit();
+
+    /**
+     * @brief Starts a worker thread pinned to each online hart, which runs the deferred work interrupt exits left
+     * over and the one queued outside of interrupt handlers. Until then, deferred work only runs on interrupt exits.
+     * @remark Thread safety: ST. Called by the boot hart once the secondary harts are online.
+     */
+    void start_deferred_workers();
+
+    DeferredStatistics &get_deferred_statistics(size_t cpu_id);
+    void print_deferred_statistics();
+
+} // namespace hls
+
+#endif
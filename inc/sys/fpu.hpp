@@ -0,0 +1,99 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _FPU_HPP_
+#define _FPU_HPP_
+
+#include "misc/types.hpp"
+#include "plat_def.hpp"
+
+namespace hls
+{
+    /**
+     * @brief Per hart counters of the lazy FP and vector switching. Each hart only updates its own, so reading
+     * another hart's is approximate.
+     */
+    struct FpuStatistics
+    {
+        // Switches away from a thread that had written its FP registers, and the others, which saved nothing.
+        uint64_t saves = 0;
+        uint64_t skipped_saves = 0;
+        // First uses after a switch that loaded the thread's registers, and those that found them still loaded.
+        uint64_t restores = 0;
+        uint64_t skipped_restores = 0;
+        uint64_t vector_saves = 0;
+        uint64_t vector_skipped_saves = 0;
+        uint64_t vector_restores = 0;
+        uint64_t vector_skipped_restores = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Sizes the vector state when every hart has the V extension. FP and vector registers start turned off,
+     * and each thread gets them back on first use.
+     * @remark Thread safety: ST. Called by the boot hart after detect_isa_extensions, before other harts are started.
+     */
+    void initialize_fpu();
+
+    /**
+     * @brief Turns the FP and vector registers off on the calling hart. The SBI may leave them on. Secondary harts
+     * call it on their way up.
+     */
+    void disable_fpu();
+
+    /**
+     * @brief Saves the FP and vector registers of the thread being switched away from, if it wrote them since they
+     * were last saved or restored, and turns them off for the next thread. The registers stay loaded, so a thread
+     * resuming on the same hart with nobody else having used them in between skips the restore.
+     * @remark Thread safety: MT. Affects the calling hart only. Interrupts must be masked.
+     */
+    void fpu_switch_out(ExtensionContext &context);
+
+    /**
+     * @brief Same as fpu_switch_out, for a thread that won't run again. Nothing is saved.
+     */
+    void fpu_discard(ExtensionContext &context);
+
+    /**
+     * @brief Frees the vector state of a thread that exited.
+     * @remark Thread safety: MT.
+     */
+    void fpu_release(ExtensionContext &context);
+
+    /**
+     * @brief Illegal instruction handler. Turns the registers back on and loads the state of the current thread if
+     * the instruction is an FP or vector one that trapped because they were off. Kernel code must not use them from
+     * interrupt handlers, which would then load them on behalf of the interrupted thread.
+     * @return true if the instruction can be retried.
+     */
+    bool handle_fpu_trap(TrapFrame *frame);
+
+    FpuStatistics &get_fpu_statistics(size_t cpu_id);
+    void print_fpu_statistics();
+
+} // namespace hls
+
+#endif
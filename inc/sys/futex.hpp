@@ -0,0 +1,55 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _FUTEX_HPP_
+#define _FUTEX_HPP_
+
+#include "misc/types.hpp"
+
+namespace hls
+{
+    // The futex table has 2^FUTEX_HASH_BITS wait queues, shared by the addresses that hash to them.
+    constexpr size_t FUTEX_HASH_BITS = 8;
+    constexpr size_t FUTEX_BUCKETS = size_t(1) << FUTEX_HASH_BITS;
+
+    /**
+     * @brief Blocks the calling thread until futex_wake is called on **address**, if it still holds **expected**.
+     * The check and the wait are atomic with respect to futex_wake, so a waker that changes the word before waking
+     * can't be missed. Waits needn't be paired with anything: the word is all the state there is.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers.
+     * @return false if the word didn't hold **expected**, so the thread didn't wait.
+     */
+    bool futex_wait(const uint32_t *address, uint32_t expected);
+
+    /**
+     * @brief Wakes up to **count** threads waiting on **address**, oldest first.
+     * @remark Thread safety: MT. May be called from interrupt handlers.
+     * @return How many were woken up.
+     */
+    size_t futex_wake(const uint32_t *address, size_t count);
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,82 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _IDLE_HPP_
+#define _IDLE_HPP_
+
+#include "misc/types.hpp"
+
+namespace hls
+{
+    constexpr size_t MAX_IDLE_STATES = 8;
+    // Idle periods predicted to be shorter than this are spent polling, as wfi costs more to get out of.
+    constexpr uint64_t IDLE_POLL_US = 10;
+    // Deeper states that take longer than this to enter and leave are never used.
+    constexpr uint64_t IDLE_EXIT_LATENCY_LIMIT_US = 1000;
+
+    struct IdleStateStatistics
+    {
+        uint64_t entries = 0;
+        // Time spent in the state, in time CSR ticks.
+        uint64_t residency = 0;
+        // Entries that woke up before the state paid for itself.
+        uint64_t early_wakeups = 0;
+    };
+
+    /**
+     * @brief Per hart idle residency. Each hart only updates its own, so reading another hart's is approximate.
+     */
+    struct IdleStatistics
+    {
+        IdleStateStatistics states[MAX_IDLE_STATES];
+        // When the hart first went idle, which residency is compared against.
+        uint64_t since = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Builds the table of idle states: polling, wfi, and the retentive states listed under
+     * /cpus/idle-states when the SBI can suspend harts. Until it runs, idle harts use wfi.
+     * @remark Thread safety: ST. Called by the boot hart after detect_timebase_frequency, before other harts are
+     * started.
+     */
+    void detect_idle_states(const void *fdt);
+
+    /**
+     * @brief Idles the calling hart until an interrupt is pending. The state is chosen from how long the hart is
+     * expected to stay idle, which is the time left until its next timer, or less if its recent idle periods were
+     * shorter than that.
+     * @remark Thread safety: MT. Interrupts must be masked, and stay so. The pending interrupt is taken once the
+     * caller unmasks them.
+     */
+    void enter_idle_state();
+
+    IdleStatistics &get_idle_statistics(size_t cpu_id);
+    void print_idle_statistics();
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,112 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _IPI_HPP_
+#define _IPI_HPP_
+
+#include "misc/types.hpp"
+#include "sys/smp.hpp"
+
+namespace hls
+{
+    /**
+     * @brief A function queued for execution on another hart. Callers own the storage, which must stay valid until
+     * **done** is set.
+     */
+    struct CrossCall
+    {
+        CrossCall *next;
+        void (*function)(void *argument);
+        void *argument;
+        uint64_t sent_time;
+        uint32_t done;
+    };
+
+    /**
+     * @brief Per hart IPI counters. Each hart only updates its own, so reading another hart's is approximate.
+     */
+    struct IpiStatistics
+    {
+        // Sender side
+        uint64_t ipis_sent = 0;
+        uint64_t calls_sent = 0;
+        // Calls posted to a hart that already had an IPI on its way, so none was sent.
+        uint64_t calls_coalesced = 0;
+        // Receiver side
+        uint64_t ipis_received = 0;
+        uint64_t calls_handled = 0;
+        uint64_t largest_batch = 0;
+        // Sum over handled calls of the time between posting and running them, in time CSR ticks.
+        uint64_t latency_ticks = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Picks the IPI mechanism and enables software interrupts on the calling hart.
+     * @remark Thread safety: ST. Called by the boot hart before other harts are started.
+     */
+    void initialize_ipi(const void *fdt);
+
+    /**
+     * @brief Enables software interrupts on the calling hart. Secondary harts call it on their way up.
+     */
+    void enable_ipi();
+
+    /**
+     * @brief Runs the calls queued for the calling hart. Called from the software interrupt handler, and by harts
+     * waiting on cross calls, so that two harts calling each other can't deadlock.
+     * @remark Thread safety: MT. Affects the calling hart only.
+     */
+    void handle_ipi();
+
+    /**
+     * @brief Queues **call** on **cpu_id** and returns without waiting. The call runs in interrupt context.
+     * @remark Thread safety: MT.
+     */
+    void cross_call_async(size_t cpu_id, CrossCall &call, void (*function)(void *argument), void *argument);
+
+    /**
+     * @brief Runs **function** on every online hart in **cpus** and waits until all of them are done. The calling
+     * hart, when in **cpus**, runs it directly. Harts that need an interrupt get it from a single send.
+     * @remark Thread safety: MT. Must not be called with interrupts masked on a hart that could be waiting on us.
+     */
+    void cross_call_mask(CpuMask cpus, void (*function)(void *argument), void *argument);
+
+    void cross_call(size_t cpu_id, void (*function)(void *argument), void *argument);
+
+    /**
+     * @brief Interrupts **cpu_id** without giving it anything to run, so that it leaves wfi and looks for work. Does
+     * nothing if an IPI is already on its way there.
+     * @remark Thread safety: MT.
+     */
+    void wake_hart(size_t cpu_id);
+
+    IpiStatistics &get_ipi_statistics(size_t cpu_id);
+    void print_ipi_statistics();
+
+} // namespace hls
+
+#endif
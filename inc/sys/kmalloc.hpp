@@ -30,21 +30,32 @@ SOFTWARE.
 
 namespace hls
 {
+    // Blocks come in power of two size classes from KMALLOC_MIN_BLOCK to KMALLOC_MAX_BLOCK bytes, each starting
+    // with a KMALLOC_ALIGNMENT bytes header.
+    constexpr size_t KMALLOC_MIN_BLOCK = 32;
+    constexpr size_t KMALLOC_MAX_BLOCK = 2048;
+    constexpr size_t KMALLOC_ALIGNMENT = 16;
+    constexpr size_t KMALLOC_MAX_SIZE = KMALLOC_MAX_BLOCK - KMALLOC_ALIGNMENT;
 
+    /**
+     * @brief Sets up the size classes.
+     * @remark Thread safety: ST. Called by the boot hart once the frame manager and the kernel VMMap are up.
+     */
     void initialize_kmalloc();
 
     /**
-     * @brief Allocates **bytes** bytes of memory. Note that alignment is at maximum 8 bytes.
-     *
-     * @param bytes How many bytes we wan to allocate.
+     * @brief Allocates **bytes** bytes of memory, aligned to KMALLOC_ALIGNMENT bytes.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers, as growing a size class maps memory.
+     * @param bytes How many bytes we wan to allocate. At most KMALLOC_MAX_SIZE.
      * @return nullptr in case of failure or memory address in case of success.
      */
     void *kmalloc(size_t bytes);
 
     /**
      * @brief Releases memory allocated with kmalloc.
+     * @remark Thread safety: MT.
      *
-     * @param ptr Pointer to be released.
+     * @param ptr Pointer to be released. May be nullptr.
      */
     void kfree(void *ptr);
 
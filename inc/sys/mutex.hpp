@@ -0,0 +1,141 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _MUTEX_HPP_
+#define _MUTEX_HPP_
+
+#include "misc/types.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    /**
+     * @brief A sleeping lock. Uncontended lock and unlock are a single atomic each. Contended ones go through the
+     * futex table, and waiters give up their hart instead of spinning. Unlike spinlocks, it may be held across
+     * blocking calls, but can't be taken from interrupt handlers.
+     * @remark Thread safety: MT.
+     */
+    class Mutex
+    {
+        // MUTEX_UNLOCKED, MUTEX_LOCKED, or MUTEX_CONTENDED when threads may be waiting.
+        Atomic<uint32_t> m_state = 0;
+
+        friend class ConditionVariable;
+        // Takes the lock without losing track of other waiters, which the caller may be one of.
+        void lock_contended();
+
+      public:
+        constexpr Mutex() = default;
+        Mutex(const Mutex &) = delete;
+        Mutex &operator=(const Mutex &) = delete;
+
+        void lock();
+        bool try_lock();
+        void unlock();
+        bool is_locked() const;
+    };
+
+    /**
+     * @brief Holds a Mutex for the lifetime of the guard.
+     */
+    class MutexGuard
+    {
+        Mutex &m_mutex;
+
+      public:
+        explicit MutexGuard(Mutex &mutex) : m_mutex(mutex)
+        {
+            m_mutex.lock();
+        }
+
+        ~MutexGuard()
+        {
+            m_mutex.unlock();
+        }
+
+        MutexGuard(const MutexGuard &) = delete;
+        MutexGuard &operator=(const MutexGuard &) = delete;
+    };
+
+    /**
+     * @brief A counting semaphore. down waits while the count is zero.
+     * @remark Thread safety: MT. up may be called from interrupt handlers.
+     */
+    class Semaphore
+    {
+        Atomic<uint32_t> m_count;
+        // Lets up skip the futex table when nobody waits.
+        Atomic<uint32_t> m_waiters = 0;
+
+      public:
+        constexpr explicit Semaphore(uint32_t count = 0) : m_count(count)
+        {
+        }
+
+        Semaphore(const Semaphore &) = delete;
+        Semaphore &operator=(const Semaphore &) = delete;
+
+        void down();
+        bool try_down();
+        void up();
+    };
+
+    /**
+     * @brief Lets threads holding a Mutex wait for a condition it protects. Waiters must check the condition again
+     * once wait returns, as another thread may have got to it first.
+     * @remark Thread safety: MT.
+     */
+    class ConditionVariable
+    {
+        // Bumped by every signal, so that a waiter notices one that came between its unlock and its wait.
+        Atomic<uint32_t> m_sequence = 0;
+
+      public:
+        constexpr ConditionVariable() = default;
+        ConditionVariable(const ConditionVariable &) = delete;
+        ConditionVariable &operator=(const ConditionVariable &) = delete;
+
+        /**
+         * @brief Releases **mutex**, waits for a signal and takes **mutex** again.
+         */
+        void wait(Mutex &mutex);
+
+        /**
+         * @brief Waits until **condition()** returns true. It is evaluated with **mutex** held.
+         */
+        template <typename Condition>
+        void wait(Mutex &mutex, Condition condition)
+        {
+            while (!condition())
+                wait(mutex);
+        }
+
+        void signal();
+        void broadcast();
+    };
+
+} // namespace hls
+
+#endif
@@ -41,7 +41,7 @@ extern "C" void stack_trace();
  * everything and reboots. If the system is not fully loaded, then it should
  * print to console and freeze.
  */
-extern "C" void die();
+extern "C" [[noreturn]] void die();
 
 /**
  * @brief Macro used to print current registers values.
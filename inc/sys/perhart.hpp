@@ -0,0 +1,123 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _PERHART_HPP_
+#define _PERHART_HPP_
+
+#include "misc/symbols.hpp"
+#include "misc/types.hpp"
+#include "plat_def.hpp"
+#include "ulib/result.hpp"
+#include <type_traits>
+
+// Places a PerHart variable in the per hart section. The linked copy is only a template: every hart gets its own
+// copy of the section, so the variable must be constant initialised, as no constructor will ever run for it.
+// constinit has the compiler enforce that.
+#define PER_HART __attribute__((section(".per_hart"))) constinit
+
+namespace hls
+{
+    /**
+     * @brief Copies the per hart template into the area the linker reserves for the boot hart, and points tp at it.
+     * @remark Thread safety: ST. Must be the first thing the boot hart does, as anything may use per hart state.
+     */
+    void initialize_boot_per_hart_area();
+
+    /**
+     * @brief Allocates and fills the per hart area of **cpu_id** from the template.
+     * @remark Thread safety: ST. Must be called before the hart starts running.
+     */
+    Result<byte *> create_per_hart_area(size_t cpu_id);
+    void destroy_per_hart_area(size_t cpu_id);
+
+    /**
+     * @brief Makes the calling hart use the area of **cpu_id**.
+     * @remark Thread safety: MT. Affects the calling hart only.
+     */
+    void enter_per_hart_area(size_t cpu_id);
+
+    byte *get_per_hart_area(size_t cpu_id);
+
+    inline byte *get_local_per_hart_area()
+    {
+        return reinterpret_cast<byte *>(_get_thread_pointer());
+    }
+
+    /**
+     * @brief A variable every hart has its own copy of. Accessing the local copy costs an addition to tp, and
+     * involves neither atomics nor cache lines shared with other harts.
+     * @remark Thread safety: get() is MT, as each hart touches its own copy. get(cpu_id) accesses another hart's
+     * copy, so synchronising with that hart is up to the caller.
+     */
+    template <typename T>
+    class PerHart
+    {
+        // Hart copies are made bytewise from the template and never destroyed. The template must not point into
+        // itself either, as the copies would point back at it.
+        static_assert(std::is_trivially_destructible_v<T>, "Per hart data is never destroyed.");
+
+        T m_template;
+
+        size_t get_offset() const
+        {
+            return static_cast<size_t>(reinterpret_cast<const byte *>(this) - &_per_hart_begin);
+        }
+
+      public:
+        constexpr PerHart() : m_template()
+        {
+        }
+
+        constexpr PerHart(const T &initial) : m_template(initial)
+        {
+        }
+
+        PerHart(const PerHart &) = delete;
+        PerHart &operator=(const PerHart &) = delete;
+
+        T &get()
+        {
+            return *reinterpret_cast<T *>(get_local_per_hart_area() + get_offset());
+        }
+
+        T &get(size_t cpu_id)
+        {
+            return *reinterpret_cast<T *>(get_per_hart_area(cpu_id) + get_offset());
+        }
+
+        T &operator*()
+        {
+            return get();
+        }
+
+        T *operator->()
+        {
+            return &get();
+        }
+    };
+
+} // namespace hls
+
+#endif
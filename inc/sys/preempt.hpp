@@ -0,0 +1,50 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _PREEMPT_HPP_
+#define _PREEMPT_HPP_
+
+#include "misc/types.hpp"
+
+namespace hls
+{
+    /**
+     * @brief Keeps the scheduler from switching away from the calling thread until the matching preempt_enable.
+     * Calls nest. Spinlocks and RCU read side sections disable preemption for as long as they are held.
+     * @remark Thread safety: MT. Affects the calling hart only.
+     */
+    void preempt_disable();
+
+    /**
+     * @brief Undoes a preempt_disable. Leaving the outermost one switches away right there if the timer asked for it
+     * in the meantime, unless interrupts are masked.
+     */
+    void preempt_enable();
+
+    bool is_preemptible();
+
+} // namespace hls
+
+#endif
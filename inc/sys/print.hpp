@@ -27,6 +27,7 @@ SOFTWARE.
 
 #include "misc/types.hpp"
 #include "misc/utilities.hpp"
+#include "sys/spinlock.hpp"
 #include <limits>
 #include <type_traits>
 
@@ -164,9 +165,15 @@ namespace hls
         }
     }
 
+    /**
+     * @brief Lock kprint and kprintln hold for a whole message, so messages of different harts don't interleave.
+     * Others printing piecewise take it around what must stay together.
+     */
+    RecursiveLock &get_console_lock();
+
     /**
      * @brief Function to print to default console, supporting formatting.
-     * @remark Thread safety: ST.
+     * @remark Thread safety: MT.
      * @tparam Args Type of arguments to be printed if any.
      * @param str String to be printed and/or formatted if needed.
      * @param args Arguments to be formatted into string.
@@ -174,6 +181,7 @@ namespace hls
     template <typename... Args>
     void kprint(const char *str, Args... args)
     {
+        RecursiveLockGuard guard(get_console_lock());
         if constexpr (sizeof...(args) == 0)
         {
             strprint(str);
@@ -186,7 +194,7 @@ namespace hls
 
     /**
      * @brief Same as kprint, but inserts a new line at the end.
-     * @remark Thread safety: ST.
+     * @remark Thread safety: MT.
      * @tparam Args Type of arguments to be printed if any.
      * @param str String to be printed and/or formatted if needed.
      * @param args Arguments to be formatted into string.
@@ -194,6 +202,7 @@ namespace hls
     template <typename... Args>
     void kprintln(const char *str, Args... args)
     {
+        RecursiveLockGuard guard(get_console_lock());
         if constexpr (sizeof...(args) == 0)
         {
             strprint(str);
@@ -226,8 +235,12 @@ namespace hls
         }                                                                                                              \
     }
 #define kdebug(...)                                                                                                    \
-    kprint("kdebug: ");                                                                                                \
-    kprintln(__VA_ARGS__)
+    if constexpr (true)                                                                                                \
+    {                                                                                                                  \
+        RecursiveLockGuard __guard(get_console_lock());                                                                \
+        kprint("kdebug: ");                                                                                            \
+        kprintln(__VA_ARGS__);                                                                                         \
+    }
 #else
 #define kspit(expr)
 #define kdebug(...)
@@ -0,0 +1,115 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _RCU_HPP_
+#define _RCU_HPP_
+
+#include "misc/types.hpp"
+#include "sys/preempt.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    /**
+     * @brief Intrusive link for call_rcu. Embed it in the object to be reclaimed.
+     */
+    struct RcuHead
+    {
+        RcuHead *next;
+        void (*callback)(RcuHead *head);
+        uint64_t grace_period;
+    };
+
+    /*
+     * Quiescent state based RCU. Readers pay next to nothing: a read side section is any stretch of code that
+     * doesn't pass through a quiescent state, which harts report on context switches and while idle. Sections
+     * disable preemption so that the timer can't switch away from them, and readers must not block or yield inside
+     * one. Writers publish new versions with rcu_assign_pointer and reclaim the
+     * old ones once every hart went through a quiescent state, either by waiting in synchronize_rcu or by deferring
+     * the work with call_rcu.
+     */
+
+    // Read side sections only need to keep the compiler from moving accesses out of them.
+    inline void rcu_read_lock()
+    {
+        preempt_disable();
+    }
+
+    inline void rcu_read_unlock()
+    {
+        preempt_enable();
+    }
+
+    template <typename T>
+    T *rcu_dereference(T *const &pointer)
+    {
+        return atomic_load(&pointer, MemoryOrder::ACQUIRE);
+    }
+
+    template <typename T>
+    void rcu_assign_pointer(T *&pointer, T *value)
+    {
+        atomic_store(&pointer, value, MemoryOrder::RELEASE);
+    }
+
+    /**
+     * @brief Reports that the calling hart holds no references to RCU protected data, and runs its callbacks whose
+     * grace period is over. Called by the scheduler on every context switch.
+     * @remark Thread safety: MT. Must not be called from a read side section.
+     */
+    void rcu_quiescent_state();
+
+    /**
+     * @brief Brackets idle periods. An idle hart counts as quiescent for as long as it stays idle, so grace periods
+     * don't wait for it to wake up.
+     * @remark Thread safety: MT. Affects the calling hart only.
+     */
+    void rcu_enter_idle();
+    void rcu_exit_idle();
+
+    /**
+     * @brief Waits until every online hart went through a quiescent state, so that no reader may still hold a
+     * pointer that was unpublished before the call.
+     * @remark Thread safety: MT. Must not be called from a read side section or with interrupts masked on a hart
+     * other harts wait for.
+     */
+    void synchronize_rcu();
+
+    /**
+     * @brief Runs **callback** on the calling hart once a grace period has elapsed.
+     * @remark Thread safety: MT. **head** must stay valid until the callback runs.
+     */
+    void call_rcu(RcuHead *head, void (*callback)(RcuHead *head));
+
+    /**
+     * @brief Returns frames to the FrameManager once a grace period has elapsed. Meant for frames readers may still
+     * be walking, such as page tables. Needs no RcuHead, as the frame pointers are queued per hart.
+     * @remark Thread safety: MT, but the FrameManager itself is ST.
+     */
+    void rcu_release_frames(void *frame_pointer);
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,145 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _SMP_HPP_
+#define _SMP_HPP_
+
+#include "misc/types.hpp"
+#include "sys/bootdata.hpp"
+#include "ulib/result.hpp"
+
+namespace hls
+{
+    // Most harts the kernel manages. Logical hart ids, as returned by get_cpu_id, go from 0 to MAX_HARTS - 1. Each
+    // one owns VMMap scratch slots, so raising it eats into the scratch table.
+    constexpr size_t MAX_HARTS = 32;
+
+    // Set of logical hart ids, one bit each.
+    using CpuMask = uint64_t;
+    static_assert(MAX_HARTS <= sizeof(CpuMask) * 8);
+
+    constexpr CpuMask cpu_mask_of(size_t cpu_id)
+    {
+        return CpuMask(1) << cpu_id;
+    }
+
+    /**
+     * @brief Number of harts in a mask. Counted by hand, the kernel does not link against libgcc's popcount.
+     */
+    constexpr size_t count_cpus(CpuMask cpus)
+    {
+        size_t count = 0;
+        for (; cpus != 0; cpus &= cpus - 1)
+            ++count;
+        return count;
+    }
+
+    enum class HartState : size_t
+    {
+        OFFLINE,
+        STARTING,
+        ONLINE
+    };
+
+    // Ordered from nearest to farthest, so that it can be used as an index.
+    enum class HartDistance : size_t
+    {
+        SAME_CLUSTER,
+        SAME_NODE,
+        REMOTE
+    };
+
+    constexpr size_t HART_DISTANCE_COUNT = 3;
+
+    /**
+     * @brief Enumerates the harts described under /cpus and starts every one but the calling hart, which becomes
+     * logical hart 0. Each started hart gets its own stack and exception stack, switches to the kernel page table
+     * and parks in idle_loop.
+     * @remark Thread safety: ST. Must be called once, from the boot hart, after the FrameManager and VMMap are up.
+     * @return Number of harts online, the calling one included.
+     */
+    size_t start_secondary_harts(const void *fdt, const bootinfo *b_info);
+
+    /**
+     * @brief Number of usable harts found in the device tree, whether they came online or not.
+     */
+    size_t get_hart_count();
+    size_t get_online_hart_count();
+
+    /**
+     * @brief Hardware id of the hart with logical id **cpu_id**. That's the id the SBI expects.
+     */
+    size_t get_hart_id(size_t cpu_id);
+    HartState get_hart_state(size_t cpu_id);
+    CpuMask get_online_cpu_mask();
+
+    /**
+     * @brief How far apart two harts are, going by the clusters of /cpus/cpu-map and the numa-node-id of the cpu
+     * nodes. Harts the device tree says nothing about share cluster and node.
+     */
+    HartDistance get_hart_distance(size_t cpu_id, size_t other_cpu_id);
+
+    /**
+     * @brief Splits **cpus** into the base plus 64 bit mask notation the SBI uses for hart ids, calling
+     * **send(hart_mask, hart_mask_base)** once per window.
+     */
+    template <typename Function>
+    void for_each_hart_window(CpuMask cpus, Function send)
+    {
+        while (cpus != 0)
+        {
+            size_t base = ~size_t(0);
+            for (size_t cpu_id = 0; cpu_id < MAX_HARTS; ++cpu_id)
+            {
+                if ((cpus & cpu_mask_of(cpu_id)) && get_hart_id(cpu_id) < base)
+                    base = get_hart_id(cpu_id);
+            }
+
+            uint64_t hart_mask = 0;
+            for (size_t cpu_id = 0; cpu_id < MAX_HARTS; ++cpu_id)
+            {
+                if (!(cpus & cpu_mask_of(cpu_id)) || get_hart_id(cpu_id) - base >= 64)
+                    continue;
+                hart_mask |= uint64_t(1) << (get_hart_id(cpu_id) - base);
+                cpus &= ~cpu_mask_of(cpu_id);
+            }
+
+            send(hart_mask, base);
+        }
+    }
+
+    /**
+     * @brief Reads the hart id from the reg property of a cpu node. **address_cells** is #address-cells of /cpus.
+     */
+    Result<size_t> read_hart_id(const void *fdt, int cpu_node, int address_cells);
+
+    /**
+     * @brief Where harts go when they have nothing to do. Runs the ready threads of the hart, and reaps the dead ones.
+     */
+    [[noreturn]] void idle_loop();
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,238 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _SPINLOCK_HPP_
+#define _SPINLOCK_HPP_
+
+#include "misc/types.hpp"
+#include "sys/cpu.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    // Operations each measurement of the boot time atomics benchmark averages over.
+    constexpr size_t ATOMICS_BENCHMARK_ITERATIONS = 100000;
+
+    /**
+     * @brief Contention figures of a lock. Only the lock holder updates them, so they need no atomics.
+     */
+    struct LockStatistics
+    {
+        uint64_t acquisitions = 0;
+        uint64_t contended = 0;
+        uint64_t wait_cycles = 0;
+
+        void record(bool was_contended, uint64_t cycles);
+        void reset();
+        void print(const char *name) const;
+    };
+
+    /**
+     * @brief FIFO spinlock for short critical sections. Harts take a ticket and spin on the owner field, so the lock
+     * is fair, but every waiter spins on the same cache line.
+     * @remark Thread safety: MT. Not recursive. Use lock_irqsave when the lock is also taken by interrupt handlers.
+     */
+    class TicketLock
+    {
+        Atomic<uint32_t> m_next = 0;
+        Atomic<uint32_t> m_owner = 0;
+        LockStatistics *m_statistics = nullptr;
+
+      public:
+        constexpr TicketLock() = default;
+        TicketLock(const TicketLock &) = delete;
+        TicketLock &operator=(const TicketLock &) = delete;
+
+        void lock();
+        bool try_lock();
+        void unlock();
+        bool is_locked() const;
+
+        InterruptState lock_irqsave();
+        void unlock_irqrestore(InterruptState state);
+
+        /**
+         * @brief Starts recording contention into **statistics**, or stops when it is nullptr.
+         * @remark Thread safety: ST. Must not be called while the lock is in use.
+         */
+        void set_statistics(LockStatistics *statistics);
+    };
+
+    /**
+     * @brief Queue node of an McsLock. Each acquirer brings its own, usually on its stack, and must keep it alive
+     * until it unlocks.
+     */
+    struct alignas(64) McsNode
+    {
+        Atomic<McsNode *> next = nullptr;
+        Atomic<uint32_t> locked = 0;
+    };
+
+    /**
+     * @brief MCS queue lock for contended critical sections. Waiters form a FIFO queue and each one spins on its own
+     * node, so releasing the lock touches a single remote cache line however many harts are waiting.
+     * @remark Thread safety: MT. Not recursive. Use lock_irqsave when the lock is also taken by interrupt handlers.
+     */
+    class McsLock
+    {
+        Atomic<McsNode *> m_tail = nullptr;
+        LockStatistics *m_statistics = nullptr;
+
+      public:
+        constexpr McsLock() = default;
+        McsLock(const McsLock &) = delete;
+        McsLock &operator=(const McsLock &) = delete;
+
+        void lock(McsNode &node);
+        bool try_lock(McsNode &node);
+        void unlock(McsNode &node);
+        bool is_locked() const;
+
+        InterruptState lock_irqsave(McsNode &node);
+        void unlock_irqrestore(McsNode &node, InterruptState state);
+
+        /**
+         * @brief Same as TicketLock::set_statistics.
+         */
+        void set_statistics(LockStatistics *statistics);
+    };
+
+    /**
+     * @brief Spinlock the holding hart may take again, for subsystems whose operations call back into each other. It
+     * is always held with interrupts masked, so handlers may take it and the holder stays on its hart.
+     * @remark Thread safety: MT. Each lock must be matched by an unlock given the state it returned.
+     */
+    class RecursiveLock
+    {
+        static constexpr size_t NO_OWNER = ~size_t(0);
+
+        TicketLock m_lock;
+        Atomic<size_t> m_owner = NO_OWNER;
+        // Only touched by the holder.
+        size_t m_depth = 0;
+
+      public:
+        constexpr RecursiveLock() = default;
+        RecursiveLock(const RecursiveLock &) = delete;
+        RecursiveLock &operator=(const RecursiveLock &) = delete;
+
+        InterruptState lock();
+        void unlock(InterruptState state);
+    };
+
+    /**
+     * @brief Holds a RecursiveLock for the lifetime of the guard.
+     */
+    class RecursiveLockGuard
+    {
+        RecursiveLock &m_lock;
+        InterruptState m_state;
+
+      public:
+        explicit RecursiveLockGuard(RecursiveLock &lock) : m_lock(lock), m_state(lock.lock())
+        {
+        }
+
+        ~RecursiveLockGuard()
+        {
+            m_lock.unlock(m_state);
+        }
+
+        RecursiveLockGuard(const RecursiveLockGuard &) = delete;
+        RecursiveLockGuard &operator=(const RecursiveLockGuard &) = delete;
+    };
+
+    /**
+     * @brief Holds a TicketLock for the lifetime of the guard, with interrupts masked when **IRQ** is true.
+     */
+    template <bool IRQ = false>
+    class TicketLockGuard
+    {
+        TicketLock &m_lock;
+        InterruptState m_state = 0;
+
+      public:
+        explicit TicketLockGuard(TicketLock &lock) : m_lock(lock)
+        {
+            if constexpr (IRQ)
+                m_state = m_lock.lock_irqsave();
+            else
+                m_lock.lock();
+        }
+
+        ~TicketLockGuard()
+        {
+            if constexpr (IRQ)
+                m_lock.unlock_irqrestore(m_state);
+            else
+                m_lock.unlock();
+        }
+
+        TicketLockGuard(const TicketLockGuard &) = delete;
+        TicketLockGuard &operator=(const TicketLockGuard &) = delete;
+    };
+
+    /**
+     * @brief Holds an McsLock for the lifetime of the guard, which also provides the queue node.
+     */
+    template <bool IRQ = false>
+    class McsLockGuard
+    {
+        McsLock &m_lock;
+        McsNode m_node;
+        InterruptState m_state = 0;
+
+      public:
+        explicit McsLockGuard(McsLock &lock) : m_lock(lock)
+        {
+            if constexpr (IRQ)
+                m_state = m_lock.lock_irqsave(m_node);
+            else
+                m_lock.lock(m_node);
+        }
+
+        ~McsLockGuard()
+        {
+            if constexpr (IRQ)
+                m_lock.unlock_irqrestore(m_node, m_state);
+            else
+                m_lock.unlock(m_node);
+        }
+
+        McsLockGuard(const McsLockGuard &) = delete;
+        McsLockGuard &operator=(const McsLockGuard &) = delete;
+    };
+
+    /**
+     * @brief Reports the cycles an uncontended operation costs, for the atomics of ulib/atomic.hpp and the locks built
+     * on them. A plain increment and an increment through a compare-exchange loop, which is what code hand-rolling
+     * lr/sc ends up with, are the baselines the AMOs compare against.
+     * @remark Thread safety: MT. Masks interrupts on the calling hart while measuring.
+     */
+    void run_atomics_benchmark(size_t iterations);
+
+} // namespace hls
+
+#endif
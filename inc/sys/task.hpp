@@ -0,0 +1,385 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _TASK_HPP_
+#define _TASK_HPP_
+
+#include "misc/new.hpp"
+#include "misc/types.hpp"
+#include "misc/utilities.hpp"
+#include "sys/timer.hpp"
+#include "ulib/atomic.hpp"
+#include <coroutine>
+
+namespace hls
+{
+    // Tasks a hart resumes per pass of its idle loop, before it looks at its threads again.
+    constexpr size_t TASK_BATCH_SIZE = 64;
+
+    /**
+     * @brief The part of a task promise that doesn't depend on the result type. Holds the link that queues the task
+     * for resumption, so that waking it up never allocates.
+     */
+    struct TaskPromiseBase
+    {
+        TaskPromiseBase *next = nullptr;
+        std::coroutine_handle<> handle;
+        // The coroutine awaiting this one. Spawned tasks have none, and free their frame when they finish.
+        std::coroutine_handle<> continuation;
+        // Hart the task runs on. It is resumed there whoever wakes it up.
+        size_t cpu_id = 0;
+
+        /**
+         * @brief Frames come from kmalloc. One larger than KMALLOC_MAX_SIZE is a bug in the coroutine, and panics.
+         */
+        static void *operator new(size_t size);
+        static void operator delete(void *ptr);
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                return handle.promise().finish();
+            }
+
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception();
+
+        // Hands the hart to the awaiting coroutine, or frees the frame of a spawned task.
+        std::coroutine_handle<> finish() noexcept;
+    };
+
+    template <typename T>
+    class Task;
+
+    template <typename T>
+    struct TaskPromise : TaskPromiseBase
+    {
+        alignas(T) byte value[sizeof(T)];
+        bool has_value = false;
+
+        ~TaskPromise()
+        {
+            if (has_value)
+                reinterpret_cast<T *>(value)->~T();
+        }
+
+        Task<T> get_return_object() noexcept;
+
+        void return_value(T result)
+        {
+            new (value) T(hls::move(result));
+            has_value = true;
+        }
+
+        T take_value()
+        {
+            T &stored = *reinterpret_cast<T *>(value);
+            T result = hls::move(stored);
+            stored.~T();
+            has_value = false;
+            return result;
+        }
+    };
+
+    template <>
+    struct TaskPromise<void> : TaskPromiseBase
+    {
+        Task<void> get_return_object() noexcept;
+
+        void return_void() noexcept
+        {
+        }
+
+        void take_value()
+        {
+        }
+    };
+
+    /**
+     * @brief A coroutine run by the per hart task executor. Tasks start suspended, and either get awaited by another
+     * task, which runs them on its hart and gets their result, or get spawned. A suspended task has no stack: only
+     * its frame, allocated from kmalloc, stays around, so a hart can have many in flight.
+     * @remark Thread safety: ST. A task only runs on one hart at a time.
+     */
+    template <typename T = void>
+    class [[nodiscard]] Task
+    {
+        std::coroutine_handle<TaskPromise<T>> m_handle;
+
+      public:
+        using promise_type = TaskPromise<T>;
+
+        Task() = default;
+
+        explicit Task(std::coroutine_handle<TaskPromise<T>> handle) : m_handle(handle)
+        {
+        }
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+
+        Task(Task &&other) : m_handle(other.m_handle)
+        {
+            other.m_handle = nullptr;
+        }
+
+        Task &operator=(Task &&other)
+        {
+            if (this != &other)
+            {
+                if (m_handle)
+                    m_handle.destroy();
+                m_handle = other.m_handle;
+                other.m_handle = nullptr;
+            }
+            return *this;
+        }
+
+        ~Task()
+        {
+            if (m_handle)
+                m_handle.destroy();
+        }
+
+        /**
+         * @brief Gives up ownership of the frame, which then frees itself when the task finishes.
+         */
+        std::coroutine_handle<TaskPromise<T>> release()
+        {
+            auto handle = m_handle;
+            m_handle = nullptr;
+            return handle;
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        // Starts the task right away on the awaiting one's hart, without going through the queue.
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+        {
+            TaskPromise<T> &promise = m_handle.promise();
+            promise.continuation = awaiting;
+            promise.cpu_id = static_cast<TaskPromiseBase &>(awaiting.promise()).cpu_id;
+            return m_handle;
+        }
+
+        T await_resume()
+        {
+            return m_handle.promise().take_value();
+        }
+    };
+
+    template <typename T>
+    Task<T> TaskPromise<T>::get_return_object() noexcept
+    {
+        auto handle = std::coroutine_handle<TaskPromise<T>>::from_promise(*this);
+        this->handle = handle;
+        return Task<T>(handle);
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object() noexcept
+    {
+        auto handle = std::coroutine_handle<TaskPromise<void>>::from_promise(*this);
+        this->handle = handle;
+        return Task<void>(handle);
+    }
+
+    /**
+     * @brief Queues a suspended task to be resumed on its hart, waking the hart up if it is another one.
+     * @remark Thread safety: MT. May be called from interrupt handlers.
+     */
+    void schedule_task(TaskPromiseBase &promise);
+
+    /**
+     * @brief Runs **task** on **cpu_id** from its idle loop. The frame is freed when the task finishes.
+     * @remark Thread safety: MT.
+     */
+    void spawn_task(Task<void> task, size_t cpu_id);
+
+    /**
+     * @brief Same as above, on the calling hart.
+     */
+    void spawn_task(Task<void> task);
+
+    /**
+     * @brief Puts the calling task at the back of its hart's queue.
+     */
+    struct TaskYield
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            schedule_task(handle.promise());
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    inline TaskYield task_yield()
+    {
+        return {};
+    }
+
+    /**
+     * @brief Suspends the calling task until the time CSR reaches a given time. The timer lives in the awaiter, and so
+     * in the frame of the task.
+     */
+    class TaskSleep
+    {
+        Timer m_timer;
+        uint64_t m_expires;
+
+        void arm(TaskPromiseBase &promise);
+
+      public:
+        explicit TaskSleep(uint64_t expires) : m_expires(expires)
+        {
+        }
+
+        bool await_ready() const noexcept;
+
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            arm(handle.promise());
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    TaskSleep task_sleep_until(uint64_t time);
+    TaskSleep task_sleep_for(uint64_t microseconds);
+
+    /**
+     * @brief A one shot event a single task can await, which is what an I/O completion looks like to the task that
+     * started the I/O. Awaiting an event that is already set doesn't suspend.
+     * @remark Thread safety: MT. set may be called from interrupt handlers.
+     */
+    class AsyncEvent
+    {
+        // EVENT_CLEAR, EVENT_SET, or the promise of the waiting task.
+        Atomic<uintptr_t> m_state = 0;
+
+        bool add_waiter(TaskPromiseBase &promise);
+
+      public:
+        AsyncEvent() = default;
+        AsyncEvent(const AsyncEvent &) = delete;
+        AsyncEvent &operator=(const AsyncEvent &) = delete;
+
+        /**
+         * @brief Sets the event and schedules the waiting task, if any.
+         */
+        void set();
+
+        /**
+         * @brief Clears a set event, so that it can be awaited again. Must not be called while a task waits on it.
+         */
+        void reset();
+        bool is_set() const;
+
+        bool await_ready() const noexcept
+        {
+            return is_set();
+        }
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return add_waiter(handle.promise());
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    /**
+     * @brief Per hart executor counters. Each hart only updates its own, so reading another hart's is approximate.
+     */
+    struct TaskStatistics
+    {
+        uint64_t spawned = 0;
+        uint64_t completed = 0;
+        uint64_t resumes = 0;
+        // Tasks queued from another hart than theirs, such as by a completion interrupt routed elsewhere.
+        uint64_t remote_wakeups = 0;
+        uint64_t largest_batch = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Whether the calling hart has tasks waiting to be resumed. The idle loop checks it with interrupts
+     * masked before going to sleep.
+     */
+    bool has_ready_tasks();
+
+    /**
+     * @brief Resumes up to TASK_BATCH_SIZE of the tasks queued on the calling hart. Tasks queued meanwhile wait for
+     * the next call, so tasks that keep yielding can't starve the threads.
+     * @remark Thread safety: MT. Affects the calling hart only. Called by the idle loop.
+     */
+    void run_tasks();
+
+    TaskStatistics &get_task_statistics(size_t cpu_id);
+    void print_task_statistics();
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,331 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _THREAD_HPP_
+#define _THREAD_HPP_
+
+#include "misc/types.hpp"
+#include "plat_def.hpp"
+#include "ulib/atomic.hpp"
+#include "ulib/rb_tree.hpp"
+#include "ulib/result.hpp"
+
+namespace hls
+{
+    // Yields each thread of the boot time context switch benchmark does.
+    constexpr size_t CONTEXT_SWITCH_BENCHMARK_ROUND_TRIPS = 10000;
+    // New threads each hart can have waiting to be placed in its run queue. Must be a power of two.
+    constexpr size_t THREAD_QUEUE_CAPACITY = 256;
+    // Forked work items each hart can have waiting to be taken. Must be a power of two. Forking more runs the item on
+    // the spot.
+    constexpr size_t WORK_QUEUE_CAPACITY = 256;
+    // Items the boot time fork/join benchmark forks, and the rounds of busy work each of them does.
+    constexpr size_t FORK_JOIN_BENCHMARK_ITEMS = 64;
+    constexpr size_t FORK_JOIN_BENCHMARK_ROUNDS = 100000;
+
+    constexpr uint64_t SCHEDULER_TICK_HZ = 250;
+    // Ticks between two load balancing passes on a hart.
+    constexpr uint64_t SCHEDULER_BALANCE_TICKS = 4;
+    // Every runnable thread gets to run once per latency target, unless there are so many that slices would drop
+    // below the minimum granularity. Together with the tick, that bounds how long a runnable thread waits.
+    constexpr uint64_t SCHEDULER_LATENCY_US = 6000;
+    constexpr uint64_t SCHEDULER_MIN_GRANULARITY_US = 750;
+    // A new thread preempts the running one if the latter is ahead of the queue by more than this, in vruntime.
+    constexpr uint64_t SCHEDULER_WAKEUP_GRANULARITY_US = 1000;
+
+    // Nice levels, as in Unix. Each level is worth about 10% of CPU time against a thread one level apart.
+    constexpr int NICE_MIN = -20;
+    constexpr int NICE_MAX = 19;
+    constexpr int NICE_DEFAULT = 0;
+    // For CPU bound background work, such as zeroing frames or scanning working sets.
+    constexpr int NICE_BACKGROUND = NICE_MAX;
+
+    enum class ThreadState
+    {
+        READY,
+        RUNNING,
+        // Waiting for an event but still running, until it gets to give up its hart. A wakeup in between cancels it.
+        BLOCKING,
+        // Waiting for an event, off its hart. Only wake_thread makes it runnable again.
+        BLOCKED,
+        DEAD
+    };
+
+    using ThreadFunction = void (*)(void *argument);
+
+    struct Thread;
+
+    /**
+     * @brief A runnable thread in the run queue of its hart, ordered by vruntime. The id breaks ties, so that keys
+     * are unique.
+     */
+    struct RunQueueEntry
+    {
+        uint64_t vruntime;
+        size_t id;
+        Thread *thread;
+    };
+
+    /**
+     * @brief A kernel thread. Threads own a KERNEL_STACK_SIZE stack allocated from the kernel address space, except
+     * for the boot thread of each hart, which keeps the stack the hart came up with and runs whenever nothing else is
+     * ready.
+     */
+    struct Thread
+    {
+        ThreadContext context = {};
+        // FP and vector registers, only saved and restored for threads that use them.
+        ExtensionContext extensions;
+        ThreadState state = ThreadState::RUNNING;
+        // Set from the moment a hart picks the thread until the next thread on that hart finished switching in. A
+        // thread queued by a hart on its way out can be stolen before its registers are saved.
+        Atomic<bool> on_cpu = false;
+        // Pinned threads are never stolen by other harts.
+        bool pinned = false;
+        size_t last_cpu = 0;
+        int nice = NICE_DEFAULT;
+        uint32_t weight = 1024;
+        // Run time scaled by 1024 / weight, in time CSR ticks. The run queue runs the lowest first.
+        uint64_t vruntime = 0;
+        // When the thread was last accounted for, and when its current slice started.
+        uint64_t exec_start = 0;
+        uint64_t slice_start = 0;
+        // Run queue tree node. Runnable threads bring their own, so that scheduling never allocates.
+        alignas(RBTreeNode<RunQueueEntry>) byte run_node[sizeof(RBTreeNode<RunQueueEntry>)] = {};
+        // Link in the list of dead threads waiting to be reaped.
+        Thread *next = nullptr;
+        void *stack_top = nullptr;
+        ThreadFunction function = nullptr;
+        void *argument = nullptr;
+        const char *name = "boot";
+        size_t id = 0;
+    };
+
+    /**
+     * @brief Per hart scheduler counters. Each hart only updates its own, so reading another hart's is approximate.
+     */
+    struct SchedulerStatistics
+    {
+        uint64_t context_switches = 0;
+        // Threads taken from the queue of another hart, and attempts that lost the race for one.
+        uint64_t steals = 0;
+        uint64_t failed_steals = 0;
+        // Threads resumed on another hart than the one they last ran on.
+        uint64_t migrations = 0;
+        // Threads pulled by periodic balancing, and idle harts woken up to take surplus threads.
+        uint64_t balance_pulls = 0;
+        uint64_t idle_wakeups = 0;
+        // Switches forced by the tick or by a new thread, rather than asked for.
+        uint64_t preemptions = 0;
+        // Threads that gave up the hart to wait for an event, and wakeups of such threads, counted by the waker.
+        // Remote ones woke up a thread that last ran on another hart.
+        uint64_t blocks = 0;
+        uint64_t wakeups = 0;
+        uint64_t remote_wakeups = 0;
+        // Ticks that didn't happen because the tick was stopped, while idle or while running a single thread.
+        uint64_t idle_ticks_avoided = 0;
+        uint64_t busy_ticks_avoided = 0;
+        // Work items forked on this hart, and items taken from the work deque of another hart.
+        uint64_t work_forked = 0;
+        uint64_t work_steals = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    using WorkFunction = void (*)(void *argument);
+
+    /**
+     * @brief Items forked together, and waited for together by join_work.
+     */
+    struct WorkGroup
+    {
+        // Items forked and not finished yet.
+        Atomic<size_t> pending = 0;
+    };
+
+    /**
+     * @brief A piece of fork/join work. Callers own the storage, which must stay valid until its group is joined.
+     * The fields belong to the scheduler.
+     */
+    struct WorkItem
+    {
+        WorkFunction function = nullptr;
+        void *argument = nullptr;
+        WorkGroup *group = nullptr;
+    };
+
+    /**
+     * @brief Computes the scheduler periods from the timebase frequency.
+     * @remark Thread safety: ST. Called by the boot hart, before other harts are started.
+     */
+    void initialize_scheduler();
+
+    /**
+     * @brief Arms the periodic timer that drives preemption and load balancing on the calling hart. The tick stops
+     * while the hart idles or has a single runnable thread, and comes back when a second one is queued.
+     * @remark Thread safety: MT. Affects the calling hart only. Timers must be enabled on it.
+     */
+    void start_scheduler_tick();
+
+    /**
+     * @brief Scheduler timer callback. Charges the running thread for its time and asks for a switch once its slice,
+     * its share of the latency target according to its weight, is over. The boot thread is never preempted: it is
+     * either initialising the kernel or idle, and then yields by itself.
+     */
+    void scheduler_tick();
+
+    /**
+     * @brief Switches away from the interrupted thread if the scheduler asked for it. Called on the way out of
+     * interrupt handlers, which run on the stack of the thread they interrupted.
+     */
+    void preempt_from_interrupt();
+
+    /**
+     * @brief Creates a thread that runs **function(argument)** and queues it on the calling hart. Idle harts may
+     * steal it, unless it is **pinned**. Returning from **function** exits the thread.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers.
+     * @param name Must outlive the thread.
+     * @param nice From NICE_MIN, the largest share of CPU time, to NICE_MAX, the smallest.
+     */
+    Result<Thread *> create_thread(ThreadFunction function, void *argument, const char *name, int nice = NICE_DEFAULT,
+                                   bool pinned = false);
+
+    /**
+     * @brief Same as create_thread, but the thread is pinned to hart **cpu_id**, which may be another than the
+     * calling one.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers. Hart **cpu_id** must be online.
+     */
+    Result<Thread *> create_pinned_thread(size_t cpu_id, ThreadFunction function, void *argument, const char *name,
+                                          int nice = NICE_DEFAULT);
+
+    Thread *get_current_thread();
+
+    /**
+     * @brief Changes the nice level of the calling thread. Clamped to [NICE_MIN, NICE_MAX].
+     */
+    void thread_set_nice(int nice);
+
+    /**
+     * @brief Lets the runnable thread with the lowest vruntime run, even if the calling one is lower, and queues the
+     * calling one. Returns immediately if nothing else is ready. The boot thread steals from other harts when its own
+     * queue is empty.
+     * @remark Thread safety: MT. Must not be called from a RCU read side section or with a spinlock held.
+     */
+    void thread_yield();
+
+    /**
+     * @brief Whether the calling thread may block. The boot thread of a hart can't, as it is what the hart runs when
+     * every other thread is blocked. Blocking primitives have it poll instead.
+     */
+    bool thread_can_block();
+
+    /**
+     * @brief First half of blocking: marks the calling thread as waiting. Call it before publishing the thread to
+     * wakers, such as by queuing it on a wait queue, and call thread_block after. A wakeup in between makes
+     * thread_block return right away, so none is lost.
+     * @remark Thread safety: MT. Interrupts must stay masked from here until thread_block.
+     */
+    void thread_prepare_block();
+
+    /**
+     * @brief Gives up the hart until wake_thread is called on the calling thread, unless it already was since
+     * thread_prepare_block.
+     * @remark Thread safety: MT. Must not be called from a RCU read side section or with a spinlock held.
+     */
+    void thread_block();
+
+    /**
+     * @brief Makes a thread that called thread_prepare_block runnable again, on the hart it last ran on. It goes in
+     * with its vruntime raised to at least min_vruntime minus half the latency target: a short sleep is no reason to
+     * lose its place, but sleeping can't bank CPU time either. It preempts the running thread if that one is ahead by
+     * more than the wakeup granularity.
+     * @remark Thread safety: MT. May be called from interrupt handlers.
+     * @return false if the thread wasn't waiting.
+     */
+    bool wake_thread(Thread *thread);
+
+    /**
+     * @brief Ends the calling thread. Its stack is freed later on, by the boot thread of the hart.
+     */
+    [[noreturn]] void thread_exit();
+
+    /**
+     * @brief Has **item** run **function(argument)** as part of **group**, on whichever hart gets to it first. It goes
+     * to the bottom of the work deque of the calling hart, where join_work takes the newest item, and idle harts
+     * steal the oldest from the top. Forking onto a full deque runs the item on the spot.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers. Idle harts run items on their boot
+     * thread, so items must not block.
+     */
+    void fork_work(WorkGroup &group, WorkItem &item, WorkFunction function, void *argument);
+
+    /**
+     * @brief Returns once every item forked into **group** finished. Until then the caller runs forked items itself,
+     * from its own hart newest first, then stolen from the others, nearest first.
+     * @remark Thread safety: MT. Must not be called from interrupt handlers, a RCU read side section or with a
+     * spinlock held.
+     */
+    void join_work(WorkGroup &group);
+
+    /**
+     * @brief Runs the items other harts forked until none is left. Called by the idle loop of every hart.
+     * @remark Thread safety: MT.
+     */
+    void run_stolen_work();
+
+    /**
+     * @brief Marks the calling hart as idle, so that harts with surplus threads or forked work wake it up, and stops
+     * its tick.
+     * @remark Thread safety: MT. Interrupts must be masked.
+     * @return false if threads or work got queued in the meantime, in which case the hart must not wait.
+     */
+    bool scheduler_enter_idle();
+    void scheduler_exit_idle();
+
+    /**
+     * @brief Frees the stacks of the threads that exited on the calling hart.
+     * @remark Thread safety: MT. Called by the idle loop of every hart.
+     */
+    void reap_threads();
+
+    uint64_t get_context_switch_count();
+    SchedulerStatistics &get_scheduler_statistics(size_t cpu_id);
+    void print_scheduler_statistics();
+
+    /**
+     * @brief Has two pinned threads yield to each other **round_trips** times, and reports the switches per second.
+     * @remark Thread safety: ST. Must be called from the boot thread.
+     */
+    void run_context_switch_benchmark(size_t round_trips);
+
+    /**
+     * @brief Forks **items** work items of **rounds** rounds of busy work each, joins them, and reports how long it
+     * took and how many ran on other harts.
+     * @remark Thread safety: ST. Must be called from the boot thread.
+     */
+    void run_fork_join_benchmark(size_t items, size_t rounds);
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,127 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _TIMER_HPP_
+#define _TIMER_HPP_
+
+#include "misc/types.hpp"
+
+namespace hls
+{
+    // Length of a wheel slot. Timers expiring within the same slot fire from the same interrupt, and never early.
+    constexpr uint64_t TIMER_RESOLUTION_US = 100;
+    // Each level of the wheel has 2^TIMER_WHEEL_LEVEL_BITS slots, each as long as a whole turn of the level below.
+    constexpr size_t TIMER_WHEEL_LEVEL_BITS = 6;
+    constexpr size_t TIMER_WHEEL_SLOTS = size_t(1) << TIMER_WHEEL_LEVEL_BITS;
+    // Five levels of 64 slots of 100 us reach a little over a day. Later timers wait in the last slot, and are
+    // filed again each time it comes around.
+    constexpr size_t TIMER_WHEEL_LEVELS = 5;
+
+    using TimerCallback = void (*)(void *argument);
+
+    /**
+     * @brief A one shot or periodic timer. Callers own the storage, which must stay valid while the timer is armed.
+     * The fields belong to the timer wheel.
+     */
+    struct Timer
+    {
+        Timer *next = nullptr;
+        Timer *previous = nullptr;
+        // List the timer is on, nullptr when it isn't armed.
+        Timer **list = nullptr;
+        TimerCallback callback = nullptr;
+        void *argument = nullptr;
+        // In time CSR ticks, and in wheel slots.
+        uint64_t expires = 0;
+        uint64_t expires_slot = 0;
+        // Periodic timers are armed again this many ticks after each expiration.
+        uint64_t period = 0;
+        size_t cpu_id = 0;
+    };
+
+    /**
+     * @brief Per hart timer counters. Each hart only updates its own, so reading another hart's is approximate.
+     */
+    struct TimerStatistics
+    {
+        uint64_t interrupts = 0;
+        uint64_t expirations = 0;
+        // Expirations that shared their interrupt with an earlier one.
+        uint64_t coalesced = 0;
+        // Timers moved down a level as their time came closer.
+        uint64_t cascaded = 0;
+
+        void print(size_t cpu_id) const;
+    };
+
+    /**
+     * @brief Sizes the wheel slots from the timebase frequency and enables timers on the calling hart.
+     * @remark Thread safety: ST. Called by the boot hart after detect_timebase_frequency, before other harts are
+     * started.
+     */
+    void initialize_timers();
+
+    /**
+     * @brief Starts the timer wheel of the calling hart and enables timer interrupts. Secondary harts call it on
+     * their way up.
+     */
+    void enable_timers();
+
+    /**
+     * @brief Arms **timer** on the calling hart to run **callback(argument)** from its timer interrupt once the time
+     * CSR reaches **expires**. A **period** other than 0 makes it fire every **period** ticks after that. Arming an
+     * armed timer moves it. O(1).
+     * @remark Thread safety: MT. Callbacks run with interrupts masked and must be short.
+     */
+    void arm_timer(Timer &timer, uint64_t expires, TimerCallback callback, void *argument, uint64_t period = 0);
+
+    /**
+     * @brief Disarms **timer**. A callback already running on another hart isn't waited for. O(1).
+     * @remark Thread safety: MT.
+     * @return true if the timer was armed.
+     */
+    bool cancel_timer(Timer &timer);
+
+    bool is_timer_armed(const Timer &timer);
+
+    /**
+     * @brief Timer interrupt handler. Runs the callbacks of the expired timers and programs the next interrupt.
+     */
+    void handle_timer_interrupt();
+
+    /**
+     * @brief Time at which the timer interrupt of the calling hart is set to fire, or ~0 if no timer is armed on it.
+     */
+    uint64_t get_next_timer_expiration();
+
+    uint64_t time_from_microseconds(uint64_t microseconds);
+    uint64_t time_to_microseconds(uint64_t time);
+
+    TimerStatistics &get_timer_statistics(size_t cpu_id);
+    void print_timer_statistics();
+
+} // namespace hls
+
+#endif
@@ -0,0 +1,158 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _WAIT_HPP_
+#define _WAIT_HPP_
+
+#include "misc/types.hpp"
+#include "sys/cpu.hpp"
+#include "sys/spinlock.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    struct Thread;
+
+    /**
+     * @brief A thread waiting on a WaitQueue. Lives on the stack of the waiter for as long as it waits.
+     */
+    struct WaitQueueEntry
+    {
+        WaitQueueEntry *next = nullptr;
+        WaitQueueEntry *previous = nullptr;
+        Thread *thread = nullptr;
+        // What the thread waits for, when several kinds of waiters share the queue. nullptr matches any wakeup.
+        const void *key = nullptr;
+        // Set by the waker once the entry is off the queue. A word, as byte sized atomics can't be exchanged.
+        Atomic<uint32_t> woken = 0;
+    };
+
+    /**
+     * @brief Threads waiting for a condition, woken up in FIFO order. Waiters give up their hart, except for the boot
+     * thread of a hart, which polls. The condition is checked with the queue locked, and wakers change it before
+     * waking, so no wakeup is lost.
+     * @remark Thread safety: MT. Waking may be done from interrupt handlers, waiting may not.
+     */
+    class WaitQueue
+    {
+        TicketLock m_lock;
+        WaitQueueEntry *m_head = nullptr;
+        WaitQueueEntry *m_tail = nullptr;
+
+        void enqueue(WaitQueueEntry &entry);
+        void remove(WaitQueueEntry &entry);
+        // Called with the lock held and interrupts masked. Returns with neither.
+        void block(WaitQueueEntry &entry, InterruptState state);
+
+      public:
+        constexpr WaitQueue() = default;
+        WaitQueue(const WaitQueue &) = delete;
+        WaitQueue &operator=(const WaitQueue &) = delete;
+
+        /**
+         * @brief Waits until woken up, if **should_wait()** returns true. It is evaluated with the queue locked, so
+         * it must be short and must not block.
+         * @param key Only wakeups for this key, or for any, end the wait.
+         * @return false if it didn't wait.
+         */
+        template <typename Predicate>
+        bool wait_if(Predicate should_wait, const void *key = nullptr)
+        {
+            WaitQueueEntry entry;
+            entry.key = key;
+            InterruptState state = m_lock.lock_irqsave();
+            if (!should_wait())
+            {
+                m_lock.unlock_irqrestore(state);
+                return false;
+            }
+
+            block(entry, state);
+            return true;
+        }
+
+        /**
+         * @brief Waits until **condition()** returns true. Wakers must make it true before calling wake.
+         */
+        template <typename Condition>
+        void wait_until(Condition condition)
+        {
+            while (wait_if([&] { return !condition(); }))
+                ;
+        }
+
+        /**
+         * @brief Wakes up to **count** waiters, oldest first, whose key is **key**. A nullptr key wakes any.
+         * @return How many were woken up.
+         */
+        size_t wake(size_t count, const void *key = nullptr);
+
+        size_t wake_one()
+        {
+            return wake(1);
+        }
+
+        size_t wake_all()
+        {
+            return wake(~size_t(0));
+        }
+
+        bool has_waiters() const;
+    };
+
+    /**
+     * @brief Signals that something is done to threads waiting for it. Each complete lets one wait through, in any
+     * order, and complete_all lets every current and future one through.
+     * @remark Thread safety: MT. complete and complete_all may be called from interrupt handlers.
+     */
+    class Completion
+    {
+        WaitQueue m_waiters;
+        Atomic<uint32_t> m_done = 0;
+
+        bool try_consume();
+
+      public:
+        constexpr Completion() = default;
+
+        void wait();
+
+        /**
+         * @brief Same as wait, without waiting.
+         * @return true if a completion was consumed.
+         */
+        bool try_wait();
+        void complete();
+        void complete_all();
+
+        /**
+         * @brief Makes the completion usable again. Must not be called while threads wait on it.
+         */
+        void reinitialize();
+    };
+
+} // namespace hls
+
+#endif
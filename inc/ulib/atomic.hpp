@@ -0,0 +1,317 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _ATOMIC_HPP_
+#define _ATOMIC_HPP_
+
+#include "misc/types.hpp"
+
+namespace hls
+{
+    /*
+     * Orders map to RISC-V as follows. Loads: relaxed is a plain load, acquire adds fence r,rw after it, seq_cst also
+     * puts fence rw,rw before it. Stores: release puts fence rw,w before, seq_cst as well. Read-modify-write
+     * operations become a single AMO with the aq/rl bits the order asks for, or an lr/sc loop for compare-exchange,
+     * unless Zacas is around. `make check-atomics` disassembles probes of these functions and checks this mapping.
+     */
+    enum class MemoryOrder : int
+    {
+        RELAXED = __ATOMIC_RELAXED,
+        ACQUIRE = __ATOMIC_ACQUIRE,
+        RELEASE = __ATOMIC_RELEASE,
+        ACQ_REL = __ATOMIC_ACQ_REL,
+        SEQ_CST = __ATOMIC_SEQ_CST
+    };
+
+    namespace detail
+    {
+        constexpr int to_builtin(MemoryOrder order)
+        {
+            return static_cast<int>(order);
+        }
+
+        // The failure order of a compare-exchange can't release, and can't be stronger than the success one.
+        constexpr MemoryOrder failure_order_for(MemoryOrder order)
+        {
+            if (order == MemoryOrder::ACQ_REL)
+                return MemoryOrder::ACQUIRE;
+            if (order == MemoryOrder::RELEASE)
+                return MemoryOrder::RELAXED;
+            return order;
+        }
+
+        // Set by detect_isa_extensions when every hart implements Zacas.
+        inline constinit bool use_zacas = false;
+
+        // amocas.w and amocas.d, always with aq and rl set. Spelled as .insn so that older assemblers take it.
+        template <typename T>
+        T amocas(T *address, T expected, T desired)
+        {
+            if constexpr (sizeof(T) == 8)
+                asm volatile(".insn r 0x2F, 0x3, 0x17, %0, %1, %2" : "+r"(expected) : "r"(address), "r"(desired)
+                             : "memory");
+            else
+                asm volatile(".insn r 0x2F, 0x2, 0x17, %0, %1, %2" : "+r"(expected) : "r"(address), "r"(desired)
+                             : "memory");
+            return expected;
+        }
+
+        template <typename T>
+        constexpr bool is_rmw_size = sizeof(T) == 4 || sizeof(T) == 8;
+    } // namespace detail
+
+    inline void atomic_thread_fence(MemoryOrder order)
+    {
+        __atomic_thread_fence(detail::to_builtin(order));
+    }
+
+    // Only keeps the compiler from reordering, for state shared with interrupt handlers of the same hart.
+    inline void atomic_signal_fence(MemoryOrder order)
+    {
+        __atomic_signal_fence(detail::to_builtin(order));
+    }
+
+    /*
+     * Free functions work on plain memory, for data whose layout is fixed elsewhere, like ABI guards. Read-modify-write
+     * operations only exist for 32 and 64 bit types: the A extension has nothing narrower, and the compiler would turn
+     * to libatomic, which we don't have.
+     */
+
+    template <typename T>
+    T atomic_load(const T *address, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_load_n(address, detail::to_builtin(order));
+    }
+
+    template <typename T>
+    void atomic_store(T *address, T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        __atomic_store_n(address, value, detail::to_builtin(order));
+    }
+
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    T atomic_exchange(T *address, T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_exchange_n(address, value, detail::to_builtin(order));
+    }
+
+    /**
+     * @brief Stores **desired** at **address** if it holds **expected**. Otherwise **expected** receives the value
+     * found. Uses amocas when Zacas is available, and an lr/sc loop otherwise.
+     * @return true if **desired** was stored.
+     */
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    bool atomic_compare_exchange(T *address, T &expected, T desired, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        if (detail::use_zacas)
+        {
+            T found = detail::amocas(address, expected, desired);
+            bool success = found == expected;
+            expected = found;
+            return success;
+        }
+
+        return __atomic_compare_exchange_n(address, &expected, desired, false, detail::to_builtin(order),
+                                           detail::to_builtin(detail::failure_order_for(order)));
+    }
+
+    /**
+     * @brief Same as atomic_compare_exchange, but may fail spuriously, which saves the retry inside lr/sc loops.
+     * Meant for callers that loop anyway.
+     */
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    bool atomic_compare_exchange_weak(T *address, T &expected, T desired, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        if (detail::use_zacas)
+            return atomic_compare_exchange(address, expected, desired, order);
+
+        return __atomic_compare_exchange_n(address, &expected, desired, true, detail::to_builtin(order),
+                                           detail::to_builtin(detail::failure_order_for(order)));
+    }
+
+    template <typename T, typename U>
+        requires(detail::is_rmw_size<T>)
+    T atomic_fetch_add(T *address, U value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_fetch_add(address, value, detail::to_builtin(order));
+    }
+
+    template <typename T, typename U>
+        requires(detail::is_rmw_size<T>)
+    T atomic_fetch_sub(T *address, U value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_fetch_sub(address, value, detail::to_builtin(order));
+    }
+
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    T atomic_fetch_and(T *address, T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_fetch_and(address, value, detail::to_builtin(order));
+    }
+
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    T atomic_fetch_or(T *address, T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_fetch_or(address, value, detail::to_builtin(order));
+    }
+
+    template <typename T>
+        requires(detail::is_rmw_size<T>)
+    T atomic_fetch_xor(T *address, T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return __atomic_fetch_xor(address, value, detail::to_builtin(order));
+    }
+
+    /*
+     * Bitmap operations. Bit n lives in word n / 64, and each one is a single amoor.d, amoand.d or amoxor.d.
+     */
+
+    inline bool atomic_test_and_set_bit(uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        return (atomic_fetch_or(bitmap + bit / 64, mask, order) & mask) != 0;
+    }
+
+    inline bool atomic_test_and_clear_bit(uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        return (atomic_fetch_and(bitmap + bit / 64, ~mask, order) & mask) != 0;
+    }
+
+    inline bool atomic_test_and_change_bit(uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        return (atomic_fetch_xor(bitmap + bit / 64, mask, order) & mask) != 0;
+    }
+
+    inline void atomic_set_bit(uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        atomic_test_and_set_bit(bitmap, bit, order);
+    }
+
+    inline void atomic_clear_bit(uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        atomic_test_and_clear_bit(bitmap, bit, order);
+    }
+
+    inline bool atomic_test_bit(const uint64_t *bitmap, size_t bit, MemoryOrder order = MemoryOrder::SEQ_CST)
+    {
+        return (atomic_load(bitmap + bit / 64, order) & (uint64_t(1) << (bit % 64))) != 0;
+    }
+
+    /**
+     * @brief A value only accessed atomically. Every operation takes an explicit order, defaulting to sequential
+     * consistency.
+     * @remark Thread safety: MT.
+     */
+    template <typename T>
+    class Atomic
+    {
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8,
+                      "Atomic supports naturally aligned scalars of at most 64 bits.");
+
+        alignas(sizeof(T)) T m_value;
+
+      public:
+        constexpr Atomic() : m_value()
+        {
+        }
+
+        constexpr Atomic(T value) : m_value(value)
+        {
+        }
+
+        Atomic(const Atomic &) = delete;
+        Atomic &operator=(const Atomic &) = delete;
+
+        T load(MemoryOrder order = MemoryOrder::SEQ_CST) const
+        {
+            return atomic_load(&m_value, order);
+        }
+
+        void store(T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            atomic_store(&m_value, value, order);
+        }
+
+        T exchange(T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_exchange(&m_value, value, order);
+        }
+
+        bool compare_exchange(T &expected, T desired, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_compare_exchange(&m_value, expected, desired, order);
+        }
+
+        bool compare_exchange_weak(T &expected, T desired, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_compare_exchange_weak(&m_value, expected, desired, order);
+        }
+
+        template <typename U>
+        T fetch_add(U value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_fetch_add(&m_value, value, order);
+        }
+
+        template <typename U>
+        T fetch_sub(U value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_fetch_sub(&m_value, value, order);
+        }
+
+        T fetch_and(T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_fetch_and(&m_value, value, order);
+        }
+
+        T fetch_or(T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_fetch_or(&m_value, value, order);
+        }
+
+        T fetch_xor(T value, MemoryOrder order = MemoryOrder::SEQ_CST)
+        {
+            return atomic_fetch_xor(&m_value, value, order);
+        }
+
+        /**
+         * @brief Raw storage, for code that must hand the address to hardware or assembly.
+         */
+        T *get_address()
+        {
+            return &m_value;
+        }
+    };
+
+} // namespace hls
+
+#endif
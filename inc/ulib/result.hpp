@@ -92,7 +92,7 @@ namespace hls
         }
 
       public:
-        Result(Result &&other)
+        Result(Result &&other) : m_is_error(other.m_is_error)
         {
             if (other.is_error())
             {
@@ -105,7 +105,7 @@ namespace hls
             }
         }
 
-        Result(const Result &other)
+        Result(const Result &other) : m_is_error(other.m_is_error)
         {
             if (other.is_error())
             {
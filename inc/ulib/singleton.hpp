@@ -33,6 +33,7 @@ SOFTWARE.
 #include "sys/mem.hpp"
 #include "sys/panic.hpp"
 #include "sys/print.hpp"
+#include "ulib/atomic.hpp"
 #include "ulib/pair.hpp"
 
 namespace hls
@@ -54,7 +55,7 @@ namespace hls
         static class_t_reference get_global_instance()
         {
             auto p = mem_get();
-            if (*(p.second) == false)
+            if (atomic_load(p.second, MemoryOrder::ACQUIRE) == false)
                 PANIC("Attempting to use unitialized singleton.");
             return *(p.first);
         }
@@ -66,10 +67,51 @@ namespace hls
             if (*(p.second) == false)
             {
                 new (p.first) class_t(hls::forward<Args>(args)...);
-                *(p.second) = true;
+                atomic_store(p.second, true, MemoryOrder::RELEASE);
             }
         }
     };
+
+    // Storage of StaticSingleton. A variable template, as the class isn't complete yet when StaticSingleton is
+    // instantiated as its base.
+    template <typename ClassType>
+    alignas(ClassType) constinit inline byte static_singleton_storage[sizeof(ClassType)] = {};
+
+    template <typename ClassType>
+    constinit inline bool static_singleton_initialized = false;
+
+    /**
+     * @brief Singleton whose storage is a constant initialised global, so get_global_instance is just its address:
+     * no guard, no flag, no branch. Meant for classes on hot paths that are initialised at boot, before any other
+     * hart runs. Only DEBUG builds catch uses before initialisation.
+     * @remark Thread safety: get_global_instance is MT. initialize_global_instance is ST.
+     */
+    template <typename ClassType>
+    class StaticSingleton
+    {
+        SET_USING_CLASS(ClassType, class_t);
+
+      public:
+        static class_t_reference get_global_instance()
+        {
+#ifdef DEBUG
+            if (!static_singleton_initialized<class_t>)
+                PANIC("Attempting to use unitialized singleton.");
+#endif
+            return *reinterpret_cast<class_t_ptr>(static_singleton_storage<class_t>);
+        }
+
+        template <typename... Args>
+        static void initialize_global_instance(Args... args)
+        {
+            if (static_singleton_initialized<class_t>)
+                return;
+
+            new (static_singleton_storage<class_t>) class_t(hls::forward<Args>(args)...);
+            // Other harts are started after boot initialisation, and starting them orders this store.
+            static_singleton_initialized<class_t> = true;
+        }
+    };
 } // namespace hls
 
 #endif
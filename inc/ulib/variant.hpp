@@ -195,7 +195,7 @@ namespace hls
     class Variant
     {
         using helper = typename detail::Helper<sizeof...(Args) + 1, 0, T, Args...>;
-        using BiggestType = detail::compare_property<detail::biggest_type_t, T, Args...>::property_first;
+        using BiggestType = detail::compare_property<detail::biggest_type, T, Args...>::property_first;
 
         alignas(BiggestType) byte m_data[sizeof(BiggestType)];
         size_t m_held_id;
@@ -216,20 +216,20 @@ namespace hls
         Variant() : m_held_id(0), m_has_val(false) {};
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         explicit Variant(U &&val)
         {
             using t = std::remove_cvref_t<U>;
             m_held_id = helper::template get_type_index<t>();
 
             void *ptr = helper::aligned_buffer(get_held_id(), m_data, sizeof(m_data));
-            new (ptr) U(hls::move(val));
+            new (ptr) t(hls::forward<U>(val));
             m_has_val = true;
         }
 
         // Uses RVO to construct a variant in place
         template <typename U, typename... UArgs>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         static Variant in_place(UArgs &&...args)
         {
             Variant v;
@@ -241,7 +241,7 @@ namespace hls
             return v;
         }
 
-        Variant(const Variant &other)
+        Variant(const Variant &other) : m_held_id(0), m_has_val(false)
         {
             if (!other.is_empty())
             {
@@ -251,7 +251,7 @@ namespace hls
             }
         }
 
-        Variant(Variant &&other)
+        Variant(Variant &&other) : m_held_id(0), m_has_val(false)
         {
             if (!other.is_empty())
             {
@@ -275,6 +275,7 @@ namespace hls
                 if (!other.is_empty())
                 {
                     helper::get_copy_fn(other.get_held_id())(this, &other);
+                    m_held_id = other.get_held_id();
                     m_has_val = true;
                 }
             }
@@ -298,7 +299,7 @@ namespace hls
         }
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         U &get_value_or_default(U &&def)
         {
             const auto &as_const = *this;
@@ -306,7 +307,7 @@ namespace hls
         }
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         const U &get_value_or_default(U &&def) const
         {
             auto p = get_value_ptr<U>();
@@ -316,7 +317,7 @@ namespace hls
         }
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         const U *get_value_ptr() const
         {
             if (!is_empty() && ((get_held_id()) == helper::template get_type_index<U>()))
@@ -328,7 +329,7 @@ namespace hls
         }
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         U *get_value_ptr()
         {
             const auto &as_const = *this;
@@ -346,7 +347,7 @@ namespace hls
         }
 
         template <typename U>
-            requires(std::is_same_v<U, T> || (std::is_same_v<T, Args> || ...))
+            requires(std::is_same_v<std::remove_cvref_t<U>, T> || (std::is_same_v<std::remove_cvref_t<U>, Args> || ...))
         Variant &operator=(U &&val)
         {
             if (!is_empty())
@@ -354,7 +355,8 @@ namespace hls
             using type = std::remove_cvref_t<U>;
             size_t type_idx = helper::template get_type_index<type>();
             void *ptr = helper::aligned_buffer(type_idx, m_data, sizeof(m_data));
-            new (ptr) type(hls::move(val));
+            new (ptr) type(hls::forward<U>(val));
+            m_held_id = type_idx;
             m_has_val = true;
             return *this;
         }
@@ -0,0 +1,135 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#ifndef _WORK_DEQUE_HPP_
+#define _WORK_DEQUE_HPP_
+
+#include "misc/types.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    /**
+     * @brief Chase-Lev work stealing deque of at most **CAPACITY** elements. The owner pushes and pops at the bottom
+     * without atomic read-modify-writes, except when racing for the last element. Any hart may take the oldest
+     * element from the top with a single compare-exchange. Orders follow Lê et al., "Correct and Efficient
+     * Work-Stealing for Weak Memory Models".
+     * @remark Thread safety: push and pop are ST, reserved to the owner. steal and size are MT.
+     */
+    template <typename T, size_t CAPACITY>
+    class WorkStealingDeque
+    {
+        static_assert(CAPACITY != 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two.");
+        static constexpr int64_t MASK = static_cast<int64_t>(CAPACITY - 1);
+
+        // Thieves hammer the top while the owner works at the bottom. Keeping them apart avoids false sharing.
+        alignas(64) Atomic<int64_t> m_top = 0;
+        alignas(64) Atomic<int64_t> m_bottom = 0;
+        T m_buffer[CAPACITY] = {};
+
+      public:
+        constexpr WorkStealingDeque() = default;
+        WorkStealingDeque(const WorkStealingDeque &) = delete;
+        WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+        /**
+         * @brief Adds **element** at the bottom.
+         * @return false if the deque is full.
+         */
+        bool push(T element)
+        {
+            int64_t bottom = m_bottom.load(MemoryOrder::RELAXED);
+            int64_t top = m_top.load(MemoryOrder::ACQUIRE);
+            if (bottom - top >= static_cast<int64_t>(CAPACITY))
+                return false;
+
+            atomic_store(&m_buffer[bottom & MASK], element, MemoryOrder::RELAXED);
+            // Thieves that see the new bottom must see the element as well.
+            atomic_thread_fence(MemoryOrder::RELEASE);
+            m_bottom.store(bottom + 1, MemoryOrder::RELAXED);
+            return true;
+        }
+
+        /**
+         * @brief Takes the newest element, the one most likely to still be in the cache.
+         * @return false if the deque is empty, or a thief got the last element first.
+         */
+        bool pop(T &element)
+        {
+            int64_t bottom = m_bottom.load(MemoryOrder::RELAXED) - 1;
+            m_bottom.store(bottom, MemoryOrder::RELAXED);
+            // Announcing the claim on the bottom element must be ordered before looking at what thieves did.
+            atomic_thread_fence(MemoryOrder::SEQ_CST);
+            int64_t top = m_top.load(MemoryOrder::RELAXED);
+            if (top > bottom)
+            {
+                m_bottom.store(bottom + 1, MemoryOrder::RELAXED);
+                return false;
+            }
+
+            element = atomic_load(&m_buffer[bottom & MASK], MemoryOrder::RELAXED);
+            if (top != bottom)
+                return true;
+
+            // Last element. Thieves may be after it too, whoever moves the top first wins.
+            bool won = m_top.compare_exchange(top, top + 1, MemoryOrder::SEQ_CST);
+            m_bottom.store(bottom + 1, MemoryOrder::RELAXED);
+            return won;
+        }
+
+        /**
+         * @brief Takes the oldest element.
+         * @return false if the deque is empty, or another hart took the element first.
+         */
+        bool steal(T &element)
+        {
+            int64_t top = m_top.load(MemoryOrder::ACQUIRE);
+            atomic_thread_fence(MemoryOrder::SEQ_CST);
+            int64_t bottom = m_bottom.load(MemoryOrder::ACQUIRE);
+            if (top >= bottom)
+                return false;
+
+            element = atomic_load(&m_buffer[top & MASK], MemoryOrder::RELAXED);
+            return m_top.compare_exchange(top, top + 1, MemoryOrder::SEQ_CST);
+        }
+
+        /**
+         * @brief Number of elements. Only a snapshot when other harts may be stealing.
+         */
+        size_t size() const
+        {
+            int64_t size = m_bottom.load(MemoryOrder::RELAXED) - m_top.load(MemoryOrder::RELAXED);
+            return size > 0 ? static_cast<size_t>(size) : 0;
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+    };
+
+} // namespace hls
+
+#endif
@@ -23,7 +23,7 @@ else
     exit
 fi
 
-qemu-system-riscv64 -serial stdio -monitor unix:qemu-monitor-socket,server,nowait -parallel none -machine virt -cpu rv64 -smp 1 -m 1G -machine virt -device ich9-ahci,id=ahci -drive if=none,file=hdd.dmg,format=raw,id=mydisk -device ide-hd,drive=mydisk,bus=ahci.0 -device qemu-xhci,id=xhci -device usb-kbd,bus=xhci.0 -bios u-boot-dtb.bin -device loader,file=u-boot.itb,addr=0x80200000 
+qemu-system-riscv64 -serial stdio -monitor unix:qemu-monitor-socket,server,nowait -parallel none -machine virt -cpu rv64 -smp 4 -m 1G -machine virt -device ich9-ahci,id=ahci -drive if=none,file=hdd.dmg,format=raw,id=mydisk -device ide-hd,drive=mydisk,bus=ahci.0 -device qemu-xhci,id=xhci -device usb-kbd,bus=xhci.0 -bios u-boot-dtb.bin -device loader,file=u-boot.itb,addr=0x80200000 
 
 rm $hdd_image_name.dmg
 
@@ -42,7 +42,7 @@ namespace hls
 
     void BumpAllocator::expand_from_frame(void *frame_address)
     {
-        for (byte *i = as_byte_ptr(frame_address); (i + m_type_size) < (as_byte_ptr(frame_address) + FrameKB::s_size);
+        for (byte *i = as_byte_ptr(frame_address); (i + m_type_size) <= (as_byte_ptr(frame_address) + FrameKB::s_size);
              i += m_type_size)
             release_mem(i);
     }
@@ -64,7 +64,7 @@ namespace hls
             {
                 PANIC("Shouldn't panic!");
             }
-            expand_from_frame(result.get_value().get_paddress());
+            expand_from_frame(result.get_value().get_vaddress());
         }
 
         --m_items_count;
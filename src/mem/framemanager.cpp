@@ -94,6 +94,23 @@ namespace hls
         return m_frame_count * FrameKB::s_size;
     }
 
+    size_t FrameData::get_use_count() const
+    {
+        return m_use_count;
+    }
+
+    void FrameData::increment_use_count()
+    {
+        ++m_use_count;
+    }
+
+    size_t FrameData::decrement_use_count()
+    {
+        if (m_use_count > 0)
+            --m_use_count;
+        return m_use_count;
+    }
+
     FrameKB *FrameData::get_frame_pointer() const
     {
         return m_frame_pointer;
@@ -103,6 +120,7 @@ namespace hls
     {
         if (frames <= m_frame_count)
         {
+            m_frame_pointer = m_frame_pointer + frames;
             m_frame_count = m_frame_count - frames;
         }
         return *this;
@@ -118,6 +136,19 @@ namespace hls
         return *this;
     }
 
+    FrameData &FrameData::grow_end(size_t frames)
+    {
+        m_frame_count = m_frame_count + frames;
+        return *this;
+    }
+
+    static RecursiveLock s_memory_lock;
+
+    RecursiveLock &get_memory_lock()
+    {
+        return s_memory_lock;
+    }
+
     FrameManager::FrameManager()
         : m_bump_allocator(sizeof(tree::node)), m_used_frames(m_bump_allocator), m_free_frames(m_bump_allocator),
           m_frame_count(0)
@@ -126,7 +157,8 @@ namespace hls
 
     FrameData *FrameManager::get_frames(size_t count, uint64_t flags)
     {
-        if (count >= m_frame_count)
+        RecursiveLockGuard guard(get_memory_lock());
+        if (count > m_frame_count)
         {
             // TODO: Handle freeing memory.
             return nullptr;
@@ -136,30 +168,179 @@ namespace hls
         {
             if (it->get_frame_count() >= count)
             {
-                auto temp_a = *it;
-                auto temp_b = temp_a;
+                // Freshly allocated frames start with a single user.
+                FrameData temp_a(it->get_frame_pointer(), count, flags);
+                auto temp_b = *it;
                 m_free_frames.remove(*it);
-                if (count > temp_a.get_frame_count())
-                    temp_a.shrink_end(temp_a.get_frame_count() - count);
                 temp_b.shrink_begin(count);
                 if (temp_b.get_frame_count() > 0)
                     m_free_frames.insert(hls::move(temp_b));
-                temp_a.set_flags(flags);
                 auto it = m_used_frames.insert(hls::move(temp_a));
-                --m_frame_count;
+                m_frame_count -= count;
                 return &(it->get_data());
             }
         }
         return nullptr;
     }
 
-    void FrameManager::release_frames(void *frame_pointer)
+    FrameData *FrameManager::find_range(tree &frames, const void *frame_pointer)
+    {
+        // The range with the highest start not above frame_pointer is the only one that may hold it.
+        FrameData *candidate = nullptr;
+        auto n = frames.get_root();
+        while (frames.is_valid_node(n))
+        {
+            auto &data = const_cast<FrameData &>(n->get_data());
+            if (to_uintptr_t(data.get_frame_pointer()) <= to_uintptr_t(frame_pointer))
+            {
+                candidate = &data;
+                n = n->get_right();
+            }
+            else
+            {
+                n = n->get_left();
+            }
+        }
+
+        if (candidate != nullptr &&
+            to_uintptr_t(frame_pointer) < to_uintptr_t(candidate->get_frame_pointer() + candidate->get_frame_count()))
+            return candidate;
+        return nullptr;
+    }
+
+    FrameData *FrameManager::find_next_range(tree &frames, const void *frame_pointer)
+    {
+        FrameData *candidate = nullptr;
+        auto n = frames.get_root();
+        while (frames.is_valid_node(n))
+        {
+            auto &data = const_cast<FrameData &>(n->get_data());
+            if (to_uintptr_t(data.get_frame_pointer()) > to_uintptr_t(frame_pointer))
+            {
+                candidate = &data;
+                n = n->get_left();
+            }
+            else
+            {
+                n = n->get_right();
+            }
+        }
+        return candidate;
+    }
+
+    void FrameManager::insert_free_range(FrameKB *frames, size_t count)
+    {
+        // A free range starting where this one ends is absorbed.
+        FrameKB *end = frames + count;
+        auto next = m_free_frames.get_node(to_uintptr_t(end));
+        if (m_free_frames.is_valid_node(next))
+        {
+            count += next->get_data().get_frame_count();
+            m_free_frames.remove(to_uintptr_t(end));
+        }
+
+        // One ending where this one starts grows in place, as its start is the key and doesn't change.
+        FrameData *previous = find_range(m_free_frames, frames - 1);
+        if (previous != nullptr && previous->get_frame_pointer() + previous->get_frame_count() == frames)
+        {
+            previous->grow_end(count);
+            return;
+        }
+
+        m_free_frames.insert({frames, count, 0});
+    }
+
+    FrameData *FrameManager::get_frame_data(void *frame_pointer)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        auto n = m_used_frames.get_node(to_uintptr_t(frame_pointer));
+        if (!m_used_frames.is_valid_node(n))
+            return nullptr;
+        return &(n->get_data());
+    }
+
+    void FrameManager::split_used_range(FrameKB *frame)
+    {
+        FrameData *data = find_range(m_used_frames, frame);
+        if (data == nullptr || data->get_frame_pointer() == frame)
+            return;
+
+        // Both halves keep the use count, which is per frame.
+        FrameData tail = *data;
+        tail.shrink_begin(frame - data->get_frame_pointer());
+        data->shrink_end(tail.get_frame_count());
+        m_used_frames.insert(hls::move(tail));
+    }
+
+    void FrameManager::share_frames(void *frame_pointer, size_t count)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        FrameKB *frame = reinterpret_cast<FrameKB *>(frame_pointer);
+        FrameKB *end = frame + count;
+        split_used_range(frame);
+        split_used_range(end);
+        while (frame < end)
+        {
+            FrameData *data = find_range(m_used_frames, frame);
+            if (data == nullptr)
+            {
+                // Skip frames we don't manage, e.g. device memory, in one step.
+                FrameData *next = find_next_range(m_used_frames, frame);
+                frame = next != nullptr ? next->get_frame_pointer() : end;
+                continue;
+            }
+
+            data->increment_use_count();
+            frame = data->get_frame_pointer() + data->get_frame_count();
+        }
+    }
+
+    void FrameManager::release_frames(void *frame_pointer, size_t count)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        FrameKB *frame = reinterpret_cast<FrameKB *>(frame_pointer);
+        FrameKB *end = frame + count;
+        split_used_range(frame);
+        split_used_range(end);
+        while (frame < end)
+        {
+            FrameData *data = find_range(m_used_frames, frame);
+            if (data == nullptr)
+            {
+                FrameData *next = find_next_range(m_used_frames, frame);
+                frame = next != nullptr ? next->get_frame_pointer() : end;
+                continue;
+            }
+
+            size_t frames = data->get_frame_count();
+            if (data->decrement_use_count() == 0)
+            {
+                m_used_frames.remove(to_uintptr_t(frame));
+                m_frame_count += frames;
+                // Merging keeps large requests satisfiable after memory was handed out and given back piecemeal.
+                insert_free_range(frame, frames);
+            }
+            frame += frames;
+        }
+    }
+
+    size_t FrameManager::get_use_count(const void *frame_pointer)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        FrameData *data = find_range(m_used_frames, frame_pointer);
+        return data != nullptr ? data->get_use_count() : 0;
+    }
+
+    void FrameManager::track_frames(FrameKB *frames, size_t count)
     {
-        (void)(frame_pointer);
+        RecursiveLockGuard guard(get_memory_lock());
+        for (size_t i = 0; i < count; ++i)
+            m_used_frames.insert({frames + i, 1, 0});
     }
 
     void FrameManager::expand_memory(const Pair<void *, size_t> mem_info)
     {
+        RecursiveLockGuard guard(get_memory_lock());
         FrameKB *mem_init = reinterpret_cast<FrameKB *>(align_forward(mem_info.first, alignof(FrameKB)));
         FrameKB *mem_end =
             reinterpret_cast<FrameKB *>(align_back(apply_offset(mem_init, mem_info.second), alignof(FrameKB)));
@@ -167,7 +348,7 @@ namespace hls
         if (frame_count >= 1)
         {
             m_frame_count += frame_count;
-            m_free_frames.insert({mem_init, m_frame_count, 0});
+            insert_free_range(mem_init, frame_count);
         }
 
         kdebug("Expanding FrameManager managed memory with {} frames for a total of {}KiB of memory.", frame_count,
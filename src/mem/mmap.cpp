@@ -26,6 +26,7 @@ SOFTWARE.
 #include "mem/mmap.hpp"
 #include "mem/framemanager.hpp"
 #include "sys/mem.hpp"
+#include "sys/panic.hpp"
 #include "sys/print.hpp"
 #include "ulib/pair.hpp"
 
@@ -39,6 +40,15 @@ namespace hls
         return (idx >> (vpn_idx * 9)) & 0x1FF;
     }
 
+    // Frames the leaf at **index** maps. Entries of a NAPOT block all point at the block's start.
+    Pair<FrameKB *, size_t> get_leaf_frames(TableEntry &entry, size_t index, FrameOrder order)
+    {
+        FrameKB *frame = reinterpret_cast<FrameKB *>(entry.as_pointer());
+        if (entry.is_napot())
+            return {frame + index % NAPOT_ENTRIES, 1};
+        return {frame, get_frame_size(order) / FrameKB::s_size};
+    }
+
     Pair<FrameOrder, PageTable *> VMMap::table_walk(const void *vaddress, PageTable *table, FrameOrder order)
     {
         if (table != nullptr && order != FrameOrder::LOWEST_ORDER)
@@ -57,18 +67,25 @@ namespace hls
         return m_v_scratch_table;
     }
 
-    FrameKB *VMMap::physical_frame_to_scratch_frame(FrameKB *frame)
+    FrameKB *VMMap::physical_frame_to_scratch_frame(FrameKB *frame, size_t slot)
     {
+        // The last entry maps the scratch table itself, slots grow downwards from there.
+        size_t index = get_cpu_id() * s_scratch_slots + slot + 2;
         auto scratch = get_scratch_table();
-        auto &entry = scratch->get_entry(PageTable::entries_on_table - get_cpu_id() - 2);
+        auto &entry = scratch->get_entry(PageTable::entries_on_table - index);
+        FrameKB *vframe = (FrameKB *)(nullptr) - index;
+        // Remapping costs a TLB flush, which is wasted when walking the same table over and over.
+        if (entry.is_valid() && entry.as_pointer() == frame)
+            return vframe;
         entry.point_to_frame(frame);
         entry.set_system_flags(VM_READ_FLAG | VM_WRITE_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG);
-        flush_tlb();
-        return (FrameKB *)(nullptr) - get_cpu_id() - 2;
+        flush_tlb_page(vframe);
+        return vframe;
     }
 
     VMMap::VMMap(PageTable *table, PageTable *scratch_table)
-        : m_p_root_table(table), m_v_scratch_table(scratch_table) {};
+        : m_p_root_table(table), m_v_scratch_table(scratch_table), m_bump_allocator(sizeof(reservation_tree::node)),
+          m_reservations(m_bump_allocator) {};
 
     bool VMMap::is_valid_virtual_address(const void *addr)
     {
@@ -79,7 +96,8 @@ namespace hls
 
     bool VMMap::is_address_mapped(const void *vaddress)
     {
-        FrameOrder c_lvl = FrameOrder::HIGHEST_ORDER;
+        RecursiveLockGuard guard(get_memory_lock());
+        FrameOrder c_lvl = get_root_order();
         PageTable *table = m_p_root_table;
         do
         {
@@ -100,6 +118,7 @@ namespace hls
 
     Result<MemMapInfo> VMMap::map_memory(void *paddress, void *vaddress, FrameOrder order, uint64_t flags)
     {
+        RecursiveLockGuard guard(get_memory_lock());
         MemMapInfo m_map{order, paddress, vaddress, flags};
 
         if (is_address_mapped(vaddress))
@@ -110,56 +129,463 @@ namespace hls
             return error<MemMapInfo>(Error::MISALIGNED_MEMORY_ADDRESS);
 
         PageTable *p_table = m_p_root_table;
-        for (FrameOrder c_lvl = FrameOrder::HIGHEST_ORDER;
+        bool added_tables = false;
+        for (FrameOrder c_lvl = get_root_order();
              (c_lvl != FrameOrder::LOWEST_ORDER) && (c_lvl != m_map.get_frame_order()); c_lvl = next_vpn(c_lvl))
         {
             auto result = table_walk(m_map.get_vaddress(), p_table, c_lvl);
             // If it is true, we don't have a page table for this range of addresses
             if (result.first == c_lvl)
             {
-                auto frame_info = FrameManager::get_global_instance().get_frames(1, 0);
-                if (frame_info == nullptr)
+                PageTable *new_table = allocate_table();
+                if (new_table == nullptr)
                 {
                     // TODO: Handle freeing memory
                     PANIC("Out of memory. Can't allocate frame for page table.");
                 }
                 auto temp = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(p_table));
-                auto &entry = temp->get_entry(get_page_entry_index(m_map.get_vaddress(), m_map.get_frame_order()));
-                entry.point_to_table(reinterpret_cast<PageTable *>(frame_info->get_frame_pointer()));
-                p_table = entry.as_table_pointer();
-                auto vt = reinterpret_cast<PageTable *>(
-                    physical_frame_to_scratch_frame(reinterpret_cast<FrameKB *>(frame_info->get_frame_pointer())));
-                memset(vt, 0, FrameKB::s_size);
+                auto &entry = temp->get_entry(get_page_entry_index(m_map.get_vaddress(), c_lvl));
+                entry.point_to_table(new_table);
+                add_table_entries(p_table, 1);
+                p_table = new_table;
+                added_tables = true;
             }
             else
             {
                 p_table = result.second;
             }
         }
-        p_table = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(p_table));
-        auto &entry = p_table->get_entry(get_page_entry_index(m_map.get_vaddress(), m_map.get_frame_order()));
+        auto v_table = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(p_table));
+        auto &entry = v_table->get_entry(get_page_entry_index(m_map.get_vaddress(), m_map.get_frame_order()));
+        bool was_valid = entry.is_valid();
         entry.point_to_frame(m_map.get_paddress());
         entry.set_system_flags(m_map.get_flags());
-        flush_tlb();
+        if (!was_valid)
+            add_table_entries(p_table, 1);
+        // Flushing by address only covers leaf entries, so new intermediate tables need the whole TLB flushed.
+        if (added_tables)
+            flush_tlb();
+        else
+            flush_tlb_page(vaddress);
         return value(m_map);
     }
 
     Result<MemMapInfo> VMMap::map_first_fit(void *paddress, FrameOrder order, uint64_t flags)
     {
-        (void)(paddress);
-        (void)(order);
-        (void)(flags);
-        return error<MemMapInfo>(Error::UNDEFINED_ERROR);
+        RecursiveLockGuard guard(get_memory_lock());
+        auto reservation = reserve_memory(get_frame_size(order), get_frame_alignment(order), flags);
+        if (reservation.is_error())
+            return error<MemMapInfo>(reservation.get_error());
+
+        auto result = map_memory(paddress, reservation.get_value(), order, flags);
+        if (result.is_error())
+            m_reservations.remove(to_uintptr_t(reservation.get_value()));
+        return result;
+    }
+
+    TableEntry *VMMap::find_leaf_entry(const void *vaddress, FrameOrder *order, PageTable **table_out)
+    {
+        FrameOrder c_lvl = get_root_order();
+        PageTable *table = m_p_root_table;
+        while (true)
+        {
+            PageTable *vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+            auto &entry = vtable->get_entry(get_page_entry_index(vaddress, c_lvl));
+            if (!entry.is_valid())
+                break;
+            if (entry.is_leaf())
+            {
+                *order = c_lvl;
+                if (table_out != nullptr)
+                    *table_out = table;
+                return &entry;
+            }
+            if (c_lvl == FrameOrder::LOWEST_ORDER)
+                break;
+            table = entry.as_table_pointer();
+            c_lvl = next_vpn(c_lvl);
+        }
+
+        return nullptr;
+    }
+
+    Result<MemMapInfo> VMMap::get_mapping_data(const void *vaddress)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        TableEntry *entry = find_leaf_entry(vaddress, &order);
+        if (entry == nullptr)
+            return error<MemMapInfo>(Error::NOT_FOUND);
+
+        uintptr_t offset = to_uintptr_t(vaddress) & (get_frame_size(order) - 1);
+        void *vbase = to_ptr(to_uintptr_t(vaddress) - offset);
+        byte *paddress = as_byte_ptr(entry->as_pointer());
+        // NAPOT leaves are reported page by page, as that is the granularity they can be unmapped at.
+        if (entry->is_napot())
+            paddress += to_uintptr_t(vbase) & (NAPOT_FRAME_SIZE - 1);
+        return value(MemMapInfo(order, paddress, vbase, entry->get_system_flagmask()));
+    }
+
+    void VMMap::split_napot(const void *vaddress)
+    {
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        TableEntry *entry = find_leaf_entry(vaddress, &order);
+        if (entry == nullptr || !entry->is_napot())
+            return;
+
+        size_t index = get_page_entry_index(vaddress, order);
+        PageTable *vtable = reinterpret_cast<PageTable *>(entry - index);
+        vtable->split_napot(index);
+    }
+
+    bool VMMap::split_huge_leaf(const void *vaddress)
+    {
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        while (find_leaf_entry(vaddress, &order) != nullptr && order != FrameOrder::LOWEST_ORDER)
+        {
+            PageTable *table = allocate_table();
+            if (table == nullptr)
+                return false;
+
+            // Allocating the table reused the scratch slot the leaf was read through, so it is looked up again.
+            TableEntry *entry = find_leaf_entry(vaddress, &order);
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table, 1));
+            vtable->split_leaf(*entry, order);
+            add_table_entries(table, ENTRIES_PER_TABLE);
+            entry = find_leaf_entry(vaddress, &order);
+            entry->point_to_table(table);
+            // The old leaf covers vaddress, so this drops it from the TLB.
+            flush_tlb_page(vaddress);
+        }
+        return true;
+    }
+
+    Result<MemMapInfo> VMMap::map_napot(void *paddress, void *vaddress, uint64_t flags)
+    {
+        if (!is_aligned(paddress, NAPOT_FRAME_SIZE) || !is_aligned(vaddress, NAPOT_FRAME_SIZE))
+            return error<MemMapInfo>(Error::MISALIGNED_MEMORY_ADDRESS);
+        for (size_t i = 0; i < NAPOT_ENTRIES; ++i)
+        {
+            if (is_address_mapped(as_byte_ptr(vaddress) + i * PAGE_FRAME_SIZE))
+                return error<MemMapInfo>(Error::ADDRESS_ALREADY_MAPPED);
+        }
+
+        // Mapping the first page makes sure the table exists, the remaining entries are filled in directly.
+        auto result = map_memory(paddress, vaddress, FrameOrder::FIRST_ORDER, flags);
+        if (result.is_error())
+            return result;
+
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        PageTable *table = nullptr;
+        TableEntry *entry = find_leaf_entry(vaddress, &order, &table);
+        size_t index = get_page_entry_index(vaddress, order);
+        PageTable *vtable = reinterpret_cast<PageTable *>(entry - index);
+        for (size_t i = 1; i < NAPOT_ENTRIES; ++i)
+        {
+            auto &page = vtable->get_entry(index + i);
+            page.point_to_frame(as_byte_ptr(paddress) + i * PAGE_FRAME_SIZE);
+            page.set_system_flags(flags);
+        }
+        vtable->make_napot(index);
+        add_table_entries(table, NAPOT_ENTRIES - 1);
+        for (size_t i = 0; i < NAPOT_ENTRIES; ++i)
+            flush_tlb_page(as_byte_ptr(vaddress) + i * PAGE_FRAME_SIZE);
+        return result;
+    }
+
+    Result<void *> VMMap::map_range(void *paddress, void *vaddress, size_t size, uint64_t flags)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (!is_aligned(paddress, PAGE_FRAME_ALIGNMENT) || !is_aligned(vaddress, PAGE_FRAME_ALIGNMENT))
+            return error<void *>(Error::MISALIGNED_MEMORY_ADDRESS);
+
+        bool use_napot = has_isa_extension(IsaExtension::SVNAPOT);
+        byte *p = as_byte_ptr(paddress);
+        byte *v = as_byte_ptr(vaddress);
+        byte *end = v + to_uintptr_t(align_forward(to_ptr(size), PAGE_FRAME_SIZE));
+        while (v < end)
+        {
+            size_t remaining = end - v;
+            FrameOrder order = get_root_order();
+            while (order != FrameOrder::LOWEST_ORDER &&
+                   (get_frame_size(order) > remaining || !is_aligned(p, get_frame_alignment(order)) ||
+                    !is_aligned(v, get_frame_alignment(order))))
+                order = next_vpn(order);
+
+            bool napot = use_napot && order == FrameOrder::FIRST_ORDER && remaining >= NAPOT_FRAME_SIZE &&
+                         is_aligned(p, NAPOT_FRAME_SIZE) && is_aligned(v, NAPOT_FRAME_SIZE);
+            auto result = napot ? map_napot(p, v, flags) : map_memory(p, v, order, flags);
+            if (result.is_error())
+            {
+                for (byte *u = as_byte_ptr(vaddress); u < v; u += PAGE_FRAME_SIZE)
+                    unmap_memory(u);
+                return error<void *>(result.get_error());
+            }
+
+            size_t step = napot ? NAPOT_FRAME_SIZE : get_frame_size(order);
+            p += step;
+            v += step;
+        }
+
+        return value(vaddress);
+    }
+
+    size_t VMMap::coalesce_range(void *begin, void *end)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (!has_isa_extension(IsaExtension::SVNAPOT))
+            return 0;
+
+        size_t blocks = 0;
+        for (byte *v = as_byte_ptr(align_forward(begin, NAPOT_FRAME_SIZE)); v + NAPOT_FRAME_SIZE <= end;
+             v += NAPOT_FRAME_SIZE)
+        {
+            FrameOrder order = FrameOrder::LOWEST_ORDER;
+            TableEntry *entry = find_leaf_entry(v, &order);
+            if (entry == nullptr || order != FrameOrder::FIRST_ORDER)
+                continue;
+
+            size_t index = get_page_entry_index(v, order);
+            PageTable *vtable = reinterpret_cast<PageTable *>(entry - index);
+            if (vtable->can_form_napot(index))
+            {
+                vtable->make_napot(index);
+                ++blocks;
+            }
+        }
+
+        if (blocks != 0)
+            flush_tlb();
+        return blocks;
+    }
+
+    const VMReservation *VMMap::find_reservation(const void *vaddress) const
+    {
+        // Look for the reservation with the highest start address not above vaddress. It is the only one that
+        // may contain it.
+        const VMReservation *candidate = nullptr;
+        auto n = m_reservations.get_root();
+        while (m_reservations.is_valid_node(n))
+        {
+            auto &reservation = n->get_data();
+            if (as_byte_ptr(reservation.get_vaddress()) <= as_byte_ptr(vaddress))
+            {
+                candidate = &reservation;
+                n = n->get_right();
+            }
+            else
+            {
+                n = n->get_left();
+            }
+        }
+
+        if (candidate != nullptr && candidate->contains(vaddress))
+            return candidate;
+        return nullptr;
+    }
+
+    Result<void *> VMMap::find_free_range(size_t size, size_t alignment) const
+    {
+        uintptr_t candidate = to_uintptr_t(align_forward(to_ptr(KERNEL_DYNAMIC_BEGIN), alignment));
+        for (auto &reservation : m_reservations)
+        {
+            uintptr_t begin = to_uintptr_t(reservation.get_vaddress());
+            uintptr_t end = to_uintptr_t(reservation.get_end());
+            if (end <= candidate)
+                continue;
+            if (candidate + size <= begin)
+                break;
+            candidate = to_uintptr_t(align_forward(to_ptr(end), alignment));
+        }
+
+        if (candidate < KERNEL_DYNAMIC_BEGIN || KERNEL_DYNAMIC_END - candidate < size)
+            return error<void *>(Error::OUT_OF_MEMORY);
+        return value(to_ptr(candidate));
+    }
+
+    Result<void *> VMMap::reserve_memory(size_t size, size_t alignment, uint64_t flags)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (size == 0 || !is_power_of_two(alignment) || alignment < PAGE_FRAME_ALIGNMENT)
+            return error<void *>(Error::INVALID_ARGUMENT);
+
+        size = to_uintptr_t(align_forward(to_ptr(size), PAGE_FRAME_SIZE));
+        auto range = find_free_range(size, alignment);
+        if (range.is_error())
+            return range;
+
+        m_reservations.insert(VMReservation(range.get_value(), size, flags));
+        return range;
+    }
+
+    Result<void *> VMMap::reserve_memory_at(void *vaddress, size_t size, uint64_t flags)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (size == 0 || !is_aligned(vaddress, PAGE_FRAME_ALIGNMENT))
+            return error<void *>(Error::INVALID_ARGUMENT);
+
+        size = to_uintptr_t(align_forward(to_ptr(size), PAGE_FRAME_SIZE));
+        byte *begin = as_byte_ptr(vaddress);
+        for (auto &reservation : m_reservations)
+        {
+            if (as_byte_ptr(reservation.get_vaddress()) >= begin + size)
+                break;
+            if (as_byte_ptr(reservation.get_end()) > begin)
+                return error<void *>(Error::ADDRESS_ALREADY_MAPPED);
+        }
+
+        m_reservations.insert(VMReservation(vaddress, size, flags));
+        return value(vaddress);
+    }
+
+    void VMMap::release_memory(void *vaddress)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        auto n = m_reservations.get_node(to_uintptr_t(vaddress));
+        if (!m_reservations.is_valid_node(n))
+            return;
+
+        VMReservation reservation = n->get_data();
+        // Every page of the reservation goes out in a single shootdown.
+        TlbBatch batch(m_p_root_table);
+        m_tlb_batch = &batch;
+        for (byte *page = as_byte_ptr(reservation.get_vaddress()); page < reservation.get_end();)
+        {
+            auto mapping = get_mapping_data(page);
+            if (mapping.is_error())
+            {
+                page += PAGE_FRAME_SIZE;
+                continue;
+            }
+
+            auto &info = mapping.get_value();
+            unmap_memory(page);
+            // Frames of eager reservations belong to whoever asked for the mapping.
+            if (reservation.get_flags() & VM_LAZY_FLAG)
+                batch.release_after_flush(info.get_paddress());
+            page = as_byte_ptr(info.get_vaddress()) + info.get_size();
+        }
+
+        m_tlb_batch = nullptr;
+        batch.flush();
+        m_reservations.remove(reservation);
+    }
+
+    Result<void *> VMMap::map_device(void *paddress, size_t size)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (size == 0)
+            return error<void *>(Error::INVALID_ARGUMENT);
+
+        byte *aligned = as_byte_ptr(align_back(paddress, PAGE_FRAME_ALIGNMENT));
+        size_t offset = as_byte_ptr(paddress) - aligned;
+        size_t mapped_size = to_uintptr_t(align_forward(to_ptr(offset + size), PAGE_FRAME_SIZE));
+        auto reservation = reserve_memory(mapped_size, PAGE_FRAME_ALIGNMENT, VM_READ_FLAG | VM_WRITE_FLAG);
+        if (reservation.is_error())
+            return reservation;
+
+        uint64_t flags = VM_VALID_FLAG | VM_READ_FLAG | VM_WRITE_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        if (map_range(aligned, reservation.get_value(), mapped_size, flags).is_error())
+        {
+            release_memory(reservation.get_value());
+            return error<void *>(Error::OUT_OF_MEMORY);
+        }
+
+        return value(static_cast<void *>(as_byte_ptr(reservation.get_value()) + offset));
+    }
+
+    Result<void *> VMMap::allocate_stack(size_t size)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (size == 0)
+            return error<void *>(Error::INVALID_ARGUMENT);
+
+        size = to_uintptr_t(align_forward(to_ptr(size), PAGE_FRAME_SIZE));
+        auto reservation = reserve_memory(size + STACK_GUARD_SIZE, STACK_GUARD_SIZE, VM_READ_FLAG | VM_WRITE_FLAG);
+        if (reservation.is_error())
+            return reservation;
+
+        auto frame_info = FrameManager::get_global_instance().get_frames(size / PAGE_FRAME_SIZE, 0);
+        if (frame_info == nullptr)
+        {
+            release_memory(reservation.get_value());
+            return error<void *>(Error::OUT_OF_MEMORY);
+        }
+
+        byte *bottom = as_byte_ptr(reservation.get_value()) + STACK_GUARD_SIZE;
+        uint64_t flags = VM_VALID_FLAG | VM_READ_FLAG | VM_WRITE_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        if (map_range(frame_info->get_frame_pointer(), bottom, size, flags).is_error())
+        {
+            FrameManager::get_global_instance().release_frames(frame_info->get_frame_pointer(), size / PAGE_FRAME_SIZE);
+            release_memory(reservation.get_value());
+            return error<void *>(Error::OUT_OF_MEMORY);
+        }
+
+        return value(static_cast<void *>(bottom + size));
+    }
+
+    void VMMap::free_stack(void *stack_top, size_t size)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        size = to_uintptr_t(align_forward(to_ptr(size), PAGE_FRAME_SIZE));
+        byte *bottom = as_byte_ptr(stack_top) - size;
+        auto mapping = get_mapping_data(bottom);
+        release_memory(bottom - STACK_GUARD_SIZE);
+        if (mapping.is_value())
+        {
+            auto &info = mapping.get_value();
+            byte *paddress = as_byte_ptr(info.get_paddress()) + (bottom - as_byte_ptr(info.get_vaddress()));
+            FrameManager::get_global_instance().release_frames(paddress, size / PAGE_FRAME_SIZE);
+        }
+    }
+
+    Result<MemMapInfo> VMMap::populate(const void *vaddress, uint64_t flags)
+    {
+        auto frame_info = FrameManager::get_global_instance().get_frames(1, 0);
+        if (frame_info == nullptr)
+            return error<MemMapInfo>(Error::OUT_OF_MEMORY);
+
+        FrameKB *frame = frame_info->get_frame_pointer();
+        memset(physical_frame_to_scratch_frame(frame), 0, FrameKB::s_size);
+
+        void *page = to_ptr(to_uintptr_t(vaddress) & ~(PAGE_FRAME_SIZE - 1));
+        if (!(flags & VM_TRACK_FLAG))
+            flags = flags | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        auto result = map_memory(frame, page, FrameOrder::FIRST_ORDER, flags);
+        if (result.is_error())
+            FrameManager::get_global_instance().release_frames(frame, 1);
+        return result;
+    }
+
+    bool VMMap::handle_page_fault(const void *vaddress, uint64_t access)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (access == VM_WRITE_FLAG && resolve_copy_on_write(vaddress))
+            return true;
+        if (resolve_access_fault(vaddress, access))
+            return true;
+
+        const VMReservation *reservation = find_reservation(vaddress);
+        if (reservation == nullptr || !(reservation->get_flags() & VM_LAZY_FLAG))
+            return false;
+
+        if ((reservation->get_flags() & access) != access)
+            return false;
+
+        return populate(vaddress, reservation->get_flags()).is_value();
     }
 
     void VMMap::unmap_memory(void *vaddress)
     {
+        RecursiveLockGuard guard(get_memory_lock());
         if (!is_address_mapped(vaddress))
             return;
+        split_napot(vaddress);
         constexpr size_t tables = static_cast<size_t>(FrameOrder::HIGHEST_ORDER) + 1;
         PageTable *table_path[tables];
         size_t i = 0;
-        FrameOrder order = FrameOrder::HIGHEST_ORDER;
+        FrameOrder order = get_root_order();
+        FrameOrder leaf_order = order;
         PageTable *table = m_p_root_table;
         TableEntry *entry = nullptr;
         do
@@ -169,36 +595,443 @@ namespace hls
             size_t idx = get_page_entry_index(vaddress, order);
             entry = &(vtable->get_entry(idx));
             table = entry->as_table_pointer();
+            leaf_order = order;
             order = next_vpn(order);
         } while (!entry->is_leaf());
 
-        bool erased_last = false;
-        do
+        // Unless the caller batches invalidations, this unmapping gets its own shootdown.
+        TlbBatch local_batch(m_p_root_table);
+        TlbBatch &batch = m_tlb_batch != nullptr ? *m_tlb_batch : local_batch;
+
+        // Erase the leaf, then walk back up releasing every table that lost its last entry. The root table is
+        // never released.
+        bool erase = true;
+        while (erase && i != 0)
         {
             table = table_path[--i];
+            FrameOrder level = static_cast<FrameOrder>(static_cast<size_t>(get_root_order()) - i);
             PageTable *vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
-            size_t idx = get_page_entry_index(vaddress, order);
-            entry = &(vtable->get_entry(idx));
-            if (entry->is_leaf())
+            vtable->get_entry(get_page_entry_index(vaddress, level)).erase();
+            erase = remove_table_entry(table) == 0 && i != 0;
+            // Page walk caches of other harts may still hold the table until the shootdown.
+            if (erase)
+                batch.release_after_flush(table);
+        }
+
+        size_t leaf_size = get_frame_size(leaf_order);
+        batch.add(align_back(vaddress, leaf_size), leaf_size);
+    }
+
+    PageTable *VMMap::allocate_table()
+    {
+        auto frame_info = FrameManager::get_global_instance().get_frames(1, 0);
+        if (frame_info == nullptr)
+            return nullptr;
+
+        memset(physical_frame_to_scratch_frame(frame_info->get_frame_pointer()), 0, FrameKB::s_size);
+        frame_info->set_userdata(PageTableData{.valid_entries = 0});
+        return reinterpret_cast<PageTable *>(frame_info->get_frame_pointer());
+    }
+
+    size_t VMMap::count_valid_entries(PageTable *table)
+    {
+        auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+        size_t valid = 0;
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; ++i)
+        {
+            if (vtable->get_entry(i).is_valid())
+                ++valid;
+        }
+        return valid;
+    }
+
+    PageTableData *VMMap::get_table_data(PageTable *table)
+    {
+        FrameData *frame_data = FrameManager::get_global_instance().get_frame_data(table);
+        if (frame_data == nullptr)
+            return nullptr;
+
+        auto &userdata = frame_data->get_userdata();
+        if (userdata.get_value_ptr<PageTableData>() == nullptr)
+        {
+            // Tables built during boot are counted once, on first use.
+            frame_data->set_userdata(PageTableData{.valid_entries = count_valid_entries(table)});
+        }
+        return userdata.get_value_ptr<PageTableData>();
+    }
+
+    void VMMap::add_table_entries(PageTable *table, size_t count)
+    {
+        PageTableData *data = get_table_data(table);
+        if (data != nullptr)
+            data->valid_entries += count;
+    }
+
+    size_t VMMap::remove_table_entry(PageTable *table)
+    {
+        PageTableData *data = get_table_data(table);
+        // Tables the FrameManager doesn't know about are scanned.
+        if (data == nullptr)
+            return count_valid_entries(table);
+        if (data->valid_entries > 0)
+            --data->valid_entries;
+        return data->valid_entries;
+    }
+
+    Result<PageTable *> VMMap::clone_table(PageTable *table, FrameOrder order, size_t entries)
+    {
+        PageTable *copy = allocate_table();
+        if (copy == nullptr)
+            return error<PageTable *>(Error::OUT_OF_MEMORY);
+
+        for (size_t i = 0; i < entries; ++i)
+        {
+            // Recursion reuses the scratch slots, so the tables are fetched again on every iteration.
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table, 0));
+            auto &entry = vtable->get_entry(i);
+            if (!entry.is_valid())
+                continue;
+
+            TableEntry cloned = entry;
+            if (entry.is_leaf())
             {
-                entry->erase();
-                if (vtable->is_empty())
+                // Write faults are resolved page by page, which NAPOT blocks don't allow.
+                if (entry.is_napot() && entry.is_writable())
                 {
-                    FrameManager::get_global_instance().release_frames(table);
-                    erased_last = true;
+                    vtable->split_napot(i);
+                    cloned = entry;
                 }
+                if (entry.is_writable())
+                {
+                    entry.unset_system_flags(VM_WRITE_FLAG);
+                    entry.set_system_flags(VM_COW_FLAG);
+                    cloned = entry;
+                }
+                auto frames = get_leaf_frames(entry, i, order);
+                FrameManager::get_global_instance().share_frames(frames.first, frames.second);
             }
-            else if (erased_last)
+            else
+            {
+                auto result = clone_table(entry.as_table_pointer(), next_vpn(order), ENTRIES_PER_TABLE);
+                if (result.is_error())
+                {
+                    destroy_table(copy, order, entries);
+                    return result;
+                }
+                cloned.point_to_table(result.get_value());
+            }
+
+            auto vcopy = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(copy, 1));
+            vcopy->get_entry(i) = cloned;
+            add_table_entries(copy, 1);
+        }
+
+        return value(copy);
+    }
+
+    void VMMap::destroy_table(PageTable *table, FrameOrder order, size_t entries)
+    {
+        auto &frame_manager = FrameManager::get_global_instance();
+        for (size_t i = 0; i < entries; ++i)
+        {
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+            TableEntry entry = vtable->get_entry(i);
+            if (!entry.is_valid())
+                continue;
+
+            if (entry.is_leaf())
             {
-                entry->erase();
-                if (vtable->is_empty())
-                    FrameManager::get_global_instance().release_frames(table);
-                else
-                    erased_last = false;
+                auto frames = get_leaf_frames(entry, i, order);
+                frame_manager.release_frames(frames.first, frames.second);
             }
-        } while (i != 0);
+            else
+                destroy_table(entry.as_table_pointer(), next_vpn(order), ENTRIES_PER_TABLE);
+        }
+
+        frame_manager.release_frames(table, 1);
+    }
+
+    bool VMMap::resolve_copy_on_write(const void *vaddress)
+    {
+        auto leaf = get_mapping_data(vaddress);
+        if (leaf.is_error() || !(leaf.get_value().get_flags() & VM_COW_FLAG))
+            return false;
+
+        // Copies are done page by page, so huge leaves are split into pages and NAPOT blocks lose their status.
+        split_napot(vaddress);
+        if (!split_huge_leaf(vaddress))
+            return false;
+
+        auto mapping = get_mapping_data(vaddress);
+
+        auto &info = mapping.get_value();
+        auto &frame_manager = FrameManager::get_global_instance();
+        FrameKB *frame = reinterpret_cast<FrameKB *>(info.get_paddress());
+        FrameKB *target = frame;
+
+        // The last sharer keeps the frame. Frames the FrameManager doesn't know about are always copied.
+        if (frame_manager.get_use_count(frame) != 1)
+        {
+            FrameData *copy = frame_manager.get_frames(1, 0);
+            if (copy == nullptr)
+                return false;
+
+            target = copy->get_frame_pointer();
+            FrameKB *src = physical_frame_to_scratch_frame(frame, 0);
+            FrameKB *dst = physical_frame_to_scratch_frame(target, 1);
+            memcpy(dst, src, FrameKB::s_size);
+        }
+
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        TableEntry *entry = find_leaf_entry(vaddress, &order);
+        entry->point_to_frame(target);
+        entry->set_system_flags((info.get_flags() & ~VM_COW_FLAG) | VM_WRITE_FLAG);
+
+        // Other harts on this address space may still read the old frame, which the remaining sharer can now write
+        // in place, so it is only let go once they dropped the translation too.
+        TlbBatch batch(m_p_root_table);
+        batch.add(info.get_vaddress(), PAGE_FRAME_SIZE);
+        if (target != frame)
+            batch.release_after_flush(frame);
+        batch.flush();
+        return true;
+    }
+
+    PageTable *VMMap::get_root_table() const
+    {
+        return m_p_root_table;
+    }
+
+    Result<PageTable *> VMMap::clone_address_space()
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        constexpr size_t lower_half = ENTRIES_PER_TABLE / 2;
+        auto result = clone_table(m_p_root_table, get_root_order(), lower_half);
+        if (result.is_error())
+            return result;
+
+        PageTable *root = result.get_value();
+        for (size_t i = lower_half; i < ENTRIES_PER_TABLE; ++i)
+        {
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(m_p_root_table, 0));
+            auto vroot = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(root, 1));
+            vroot->get_entry(i) = vtable->get_entry(i);
+            if (vroot->get_entry(i).is_valid())
+                add_table_entries(root, 1);
+        }
+
+        // Leaves of the current address space lost their write permission, on every hart running it.
+        TlbBatch batch(m_p_root_table);
+        batch.add_all(false);
+        batch.flush();
+        return value(root);
+    }
+
+    void VMMap::switch_address_space(PageTable *root)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        m_p_root_table = root;
+        _set_root_table(root);
+        tlb_set_active_root(root);
+    }
+
+    void VMMap::destroy_address_space(PageTable *root)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        if (root == m_p_root_table)
+            return;
+
+        // Only the lower half is owned by the address space, the kernel half is shared.
+        destroy_table(root, get_root_order(), ENTRIES_PER_TABLE / 2);
+    }
+
+    bool VMMap::resolve_access_fault(const void *vaddress, uint64_t access)
+    {
+        FrameOrder order = FrameOrder::LOWEST_ORDER;
+        TableEntry *entry = find_leaf_entry(vaddress, &order);
+        if (entry == nullptr)
+            return false;
+
+        // Without hardware updates, touching a page with A clear or writing one with D clear faults even though
+        // the access is allowed.
+        uint64_t flags = entry->get_system_flagmask();
+        if ((flags & access) != access)
+            return false;
+
+        // Once the bits are set the fault was spurious: another hart populated or fixed the entry meanwhile, or
+        // ours still cached the old one. Dropping it from the local TLB is all the retry needs.
+        uint64_t needed = access == VM_WRITE_FLAG ? (VM_ACCESS_FLAG | VM_DIRTY_FLAG) : VM_ACCESS_FLAG;
+        if ((flags & needed) != needed)
+            entry->set_system_flags(needed);
+        flush_tlb_page(vaddress);
+        return true;
+    }
+
+    void VMMap::harvest_table(PageTable *table, FrameOrder order, uintptr_t begin, uintptr_t end,
+                              WorkingSetSample &sample)
+    {
+        size_t size = get_frame_size(order);
+        for (uintptr_t va = begin; va < end;)
+        {
+            uintptr_t next = (va & ~(size - 1)) + size;
+            // The last entry of the address space wraps around.
+            if (next > end || next < va)
+                next = end;
+
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+            auto &entry = vtable->get_entry(get_page_entry_index(to_ptr(va), order));
+            if (entry.is_leaf())
+            {
+                size_t pages = size / PAGE_FRAME_SIZE;
+                uint64_t flags = entry.get_system_flagmask();
+                sample.mapped_pages += pages;
+                if (flags & VM_ACCESS_FLAG)
+                    sample.accessed_pages += pages;
+                if (flags & VM_DIRTY_FLAG)
+                    sample.dirty_pages += pages;
+                entry.unset_system_flags(VM_ACCESS_FLAG | VM_DIRTY_FLAG);
+            }
+            else if (entry.is_valid() && order != FrameOrder::LOWEST_ORDER)
+            {
+                harvest_table(entry.as_table_pointer(), next_vpn(order), va, next, sample);
+            }
+            va = next;
+        }
+    }
+
+    WorkingSetSample VMMap::harvest_access_bits(PageTable *root, void *begin, void *end)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        WorkingSetSample sample;
+        harvest_table(root, get_root_order(), to_uintptr_t(begin), to_uintptr_t(end), sample);
+        // Cached translations would keep the bits from being set again, on any hart.
+        TlbBatch batch(root);
+        batch.add(begin, as_byte_ptr(end) - as_byte_ptr(begin));
+        batch.flush();
+        return sample;
+    }
+
+    void VMMap::inspect_table(PageTable *table, FrameOrder order, void *vbase, PageTableStatistics &stats,
+                              bool print_ranges)
+    {
+        size_t size = get_frame_size(order);
+        bool only_leaves = true;
+        ++stats.tables;
+        stats.table_bytes += PAGE_TABLE_SIZE;
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; ++i)
+        {
+            // Recursion reuses the scratch slot, so the table is fetched again on every iteration.
+            auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+            auto &entry = vtable->get_entry(i);
+            if (!entry.is_valid())
+            {
+                only_leaves = false;
+                continue;
+            }
+
+            void *vaddress = vtable->compose_address_with_entry(vbase, i, order);
+            if (entry.is_leaf())
+            {
+                ++stats.leaves[static_cast<size_t>(order)];
+                stats.mapped_bytes += size;
+                if (entry.is_napot() && i % NAPOT_ENTRIES == 0)
+                    ++stats.napot_blocks;
+                if (order == FrameOrder::LOWEST_ORDER && vtable->can_form_napot(i))
+                {
+                    ++stats.promotable_napot;
+                    if (print_ranges)
+                        kprintln("Promotable to NAPOT: {} - {}.", vaddress, as_byte_ptr(vaddress) + NAPOT_FRAME_SIZE);
+                }
+            }
+            else if (order != FrameOrder::LOWEST_ORDER)
+            {
+                only_leaves = false;
+                inspect_table(entry.as_table_pointer(), next_vpn(order), vaddress, stats, print_ranges);
+            }
+        }
+
+        if (!only_leaves || order == get_root_order())
+            return;
+
+        auto vtable = reinterpret_cast<PageTable *>(physical_frame_to_scratch_frame(table));
+        if (vtable->is_contiguous_run(0, ENTRIES_PER_TABLE, size))
+        {
+            ++stats.promotable[static_cast<size_t>(order) + 1];
+            if (print_ranges)
+                kprintln("Promotable to order {}: {} - {}.", static_cast<size_t>(order) + 1, vbase,
+                         as_byte_ptr(vbase) + size * ENTRIES_PER_TABLE);
+        }
+    }
+
+    PageTableStatistics VMMap::inspect_address_space(PageTable *root, bool print_ranges)
+    {
+        RecursiveLockGuard guard(get_memory_lock());
+        PageTableStatistics stats;
+        inspect_table(root, get_root_order(), nullptr, stats, print_ranges);
+        return stats;
+    }
+
+    void PageTableStatistics::print() const
+    {
+        kprintln("Page tables: {} ({} KiB). Mapped: {} KiB.", tables, table_bytes / 1024, mapped_bytes / 1024);
+        for (size_t i = 0; i <= static_cast<size_t>(get_root_order()); ++i)
+        {
+            kprintln("Order {} ({} KiB): {} leaves, {} promotable tables.", i,
+                     get_frame_size(static_cast<FrameOrder>(i)) / 1024, leaves[i], promotable[i]);
+        }
+        kprintln("NAPOT blocks: {}. Promotable to NAPOT: {}.", napot_blocks, promotable_napot);
+    }
+
+    void run_copy_on_write_self_test()
+    {
+        constexpr size_t pages = 4;
+        byte *vaddress = as_byte_ptr(to_ptr(COW_SELF_TEST_ADDRESS));
+        auto &vmmap = VMMap::get_global_instance();
+        auto &frame_manager = FrameManager::get_global_instance();
+        PageTable *kernel_root = vmmap.get_root_table();
+
+        auto parent = vmmap.clone_address_space();
+        FrameData *frame_info = frame_manager.get_frames(pages, 0);
+        if (parent.is_error() || frame_info == nullptr)
+            PANIC("Out of memory. Can't run the copy-on-write self test.");
+
+        // The pages share a single allocation, so their use counts must be tracked apart from each other.
+        FrameKB *frame = frame_info->get_frame_pointer();
+        vmmap.switch_address_space(parent.get_value());
+        uint64_t flags = VM_VALID_FLAG | VM_READ_FLAG | VM_WRITE_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        if (vmmap.map_range(frame, vaddress, pages * PAGE_FRAME_SIZE, flags).is_error())
+            PANIC("Copy-on-write self test: can't map the parent's pages.");
+        for (size_t i = 0; i < pages; ++i)
+            vaddress[i * PAGE_FRAME_SIZE] = static_cast<byte>(i + 1);
+
+        auto child = vmmap.clone_address_space();
+        if (child.is_error())
+            PANIC("Out of memory. Can't run the copy-on-write self test.");
+        // The first page gets a copy of its own in the child, the others stay shared.
+        vmmap.switch_address_space(child.get_value());
+        vaddress[0] = 0xAA;
+        vmmap.switch_address_space(kernel_root);
+        vmmap.destroy_address_space(parent.get_value());
+
+        bool passed = frame_manager.get_use_count(frame) == 0;
+        for (size_t i = 1; i < pages; ++i)
+            passed = passed && frame_manager.get_use_count(frame + i) == 1;
+
+        vmmap.switch_address_space(child.get_value());
+        passed = passed && vaddress[0] == 0xAA;
+        for (size_t i = 1; i < pages; ++i)
+            passed = passed && vaddress[i * PAGE_FRAME_SIZE] == static_cast<byte>(i + 1);
+        // The child is the last sharer of the remaining pages, so a write keeps the frame.
+        vaddress[PAGE_FRAME_SIZE] = 0xBB;
+        auto mapping = vmmap.get_mapping_data(vaddress + PAGE_FRAME_SIZE);
+        passed = passed && mapping.is_value() && mapping.get_value().get_paddress() == frame + 1;
+        vmmap.switch_address_space(kernel_root);
+        vmmap.destroy_address_space(child.get_value());
 
-        // TODO: Check if this is kernel page table and if so, do a TLB shootdown.
-        flush_tlb();
+        for (size_t i = 0; i < pages; ++i)
+            passed = passed && frame_manager.get_use_count(frame + i) == 0;
+        if (!passed)
+            PANIC("Copy-on-write self test failed.");
+        kprintln("Copy-on-write self test passed.");
     }
 } // namespace hls
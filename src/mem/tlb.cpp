@@ -0,0 +1,202 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "mem/tlb.hpp"
+#include "mem/framemanager.hpp"
+#include "sys/cpu.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    struct TlbHartData
+    {
+        Atomic<uint32_t> lazy = 0;
+        // Set by harts that skipped this one during a shootdown.
+        Atomic<uint32_t> stale = 0;
+        Atomic<const PageTable *> active_root = nullptr;
+        TlbStatistics statistics;
+    };
+
+    PER_HART static PerHart<TlbHartData> s_tlb;
+
+    constexpr size_t FLUSH_EVERYTHING = ~size_t(0);
+
+    static bool is_kernel_address(uintptr_t vaddress)
+    {
+        // Kernel addresses have their sign bit set, whatever the paging mode.
+        return (vaddress >> 63) != 0;
+    }
+
+    void TlbStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: {} TLB flushes, {} ranges, {} full. {} remote harts flushed, {} lazy harts skipped.", cpu_id,
+                 flushes, ranges, full_flushes, remote_harts, lazy_harts_skipped);
+    }
+
+    TlbBatch::TlbBatch(const PageTable *root) : m_root(root)
+    {
+    }
+
+    TlbBatch::~TlbBatch()
+    {
+        flush();
+    }
+
+    void TlbBatch::add(const void *vaddress, size_t size)
+    {
+        uintptr_t begin = to_uintptr_t(vaddress) & ~(PAGE_FRAME_SIZE - 1);
+        uintptr_t end = to_uintptr_t(align_forward(to_ptr(to_uintptr_t(vaddress) + size), PAGE_FRAME_SIZE));
+        m_has_kernel_addresses |= is_kernel_address(begin);
+        m_pages += (end - begin) / PAGE_FRAME_SIZE;
+        if (m_flush_all)
+            return;
+
+        // Unmapping walks addresses in order, so most ranges extend the last one.
+        if (m_range_count != 0 && m_ranges[m_range_count - 1].end == begin)
+            m_ranges[m_range_count - 1].end = end;
+        else if (m_range_count < TLB_BATCH_RANGES)
+            m_ranges[m_range_count++] = {.begin = begin, .end = end};
+        else
+            m_flush_all = true;
+
+        if (m_pages > TLB_FULL_FLUSH_PAGES)
+            m_flush_all = true;
+    }
+
+    void TlbBatch::add_all(bool kernel_addresses)
+    {
+        m_flush_all = true;
+        m_has_kernel_addresses |= kernel_addresses;
+    }
+
+    void TlbBatch::release_after_flush(void *frame_pointer)
+    {
+        if (m_frame_count == TLB_BATCH_FRAMES)
+            flush();
+        m_frames[m_frame_count++] = frame_pointer;
+    }
+
+    CpuMask TlbBatch::get_targets()
+    {
+        CpuMask targets = 0;
+        size_t self = get_cpu_id();
+        TlbStatistics &statistics = s_tlb.get().statistics;
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (cpu_id == self || get_hart_state(cpu_id) != HartState::ONLINE)
+                continue;
+
+            TlbHartData &hart = s_tlb.get(cpu_id);
+            const PageTable *root = hart.active_root.load(MemoryOrder::ACQUIRE);
+            if (!m_has_kernel_addresses && root != nullptr && root != m_root)
+                continue;
+
+            // Marking the hart stale before checking lazy again closes the window where it wakes up in between:
+            // either it sees the mark and flushes, or we see it awake and include it.
+            if (hart.lazy.load(MemoryOrder::ACQUIRE))
+            {
+                hart.stale.store(1, MemoryOrder::RELAXED);
+                atomic_thread_fence(MemoryOrder::SEQ_CST);
+                if (hart.lazy.load(MemoryOrder::RELAXED))
+                {
+                    ++statistics.lazy_harts_skipped;
+                    continue;
+                }
+            }
+
+            targets |= cpu_mask_of(cpu_id);
+        }
+
+        statistics.remote_harts += count_cpus(targets);
+        return targets;
+    }
+
+    void TlbBatch::flush()
+    {
+        if (m_flush_all || m_range_count != 0)
+        {
+            TlbStatistics &statistics = s_tlb.get().statistics;
+            ++statistics.flushes;
+            CpuMask targets = get_targets();
+            if (m_flush_all)
+            {
+                ++statistics.full_flushes;
+                flush_tlb();
+                for_each_hart_window(targets, [](uint64_t hart_mask, uint64_t base) {
+                    _sbi_remote_sfence_vma(hart_mask, base, nullptr, FLUSH_EVERYTHING);
+                });
+            }
+            else
+            {
+                statistics.ranges += m_range_count;
+                for (size_t i = 0; i < m_range_count; ++i)
+                {
+                    const Range &range = m_ranges[i];
+                    for (uintptr_t page = range.begin; page < range.end; page += PAGE_FRAME_SIZE)
+                        flush_tlb_page(to_ptr(page));
+                    for_each_hart_window(targets, [&range](uint64_t hart_mask, uint64_t base) {
+                        _sbi_remote_sfence_vma(hart_mask, base, to_ptr(range.begin), range.end - range.begin);
+                    });
+                }
+            }
+        }
+
+        for (size_t i = 0; i < m_frame_count; ++i)
+            FrameManager::get_global_instance().release_frames(m_frames[i], 1);
+
+        m_range_count = 0;
+        m_pages = 0;
+        m_flush_all = false;
+        m_has_kernel_addresses = false;
+        m_frame_count = 0;
+    }
+
+    void tlb_enter_lazy()
+    {
+        s_tlb.get().lazy.store(1, MemoryOrder::RELEASE);
+    }
+
+    void tlb_exit_lazy()
+    {
+        TlbHartData &data = s_tlb.get();
+        data.lazy.store(0, MemoryOrder::RELAXED);
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        if (data.stale.exchange(0, MemoryOrder::ACQUIRE))
+            flush_tlb();
+    }
+
+    void tlb_set_active_root(const PageTable *root)
+    {
+        s_tlb.get().active_root.store(root, MemoryOrder::RELEASE);
+    }
+
+    TlbStatistics &get_tlb_statistics(size_t cpu_id)
+    {
+        return s_tlb.get(cpu_id).statistics;
+    }
+
+} // namespace hls
@@ -0,0 +1,116 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "mem/workingset.hpp"
+
+namespace hls
+{
+    // Weight of older samples in the estimate, as a power of two. 2 means new samples count for a quarter.
+    constexpr size_t WORKING_SET_DECAY_SHIFT = 2;
+
+    TrackedSpace::TrackedSpace(PageTable *root, void *begin, void *end)
+        : m_root(root), m_begin(as_byte_ptr(begin)), m_end(as_byte_ptr(end)), m_estimate(0)
+    {
+    }
+
+    PageTable *TrackedSpace::get_root() const
+    {
+        return m_root;
+    }
+
+    void *TrackedSpace::get_begin() const
+    {
+        return m_begin;
+    }
+
+    void *TrackedSpace::get_end() const
+    {
+        return m_end;
+    }
+
+    size_t TrackedSpace::get_estimate() const
+    {
+        return m_estimate;
+    }
+
+    const WorkingSetSample &TrackedSpace::get_last_sample() const
+    {
+        return m_last_sample;
+    }
+
+    void TrackedSpace::add_sample(const WorkingSetSample &sample)
+    {
+        m_last_sample = sample;
+        m_estimate = m_estimate - (m_estimate >> WORKING_SET_DECAY_SHIFT) +
+                     (sample.accessed_pages >> WORKING_SET_DECAY_SHIFT);
+    }
+
+    WorkingSetScanner::WorkingSetScanner(uint64_t period)
+        : m_bump_allocator(sizeof(space_tree::node)), m_spaces(m_bump_allocator), m_period(period), m_last_scan(0)
+    {
+    }
+
+    Result<const TrackedSpace *> WorkingSetScanner::track(PageTable *root, void *begin, void *end)
+    {
+        if (root == nullptr || as_byte_ptr(begin) >= as_byte_ptr(end))
+            return error<const TrackedSpace *>(Error::INVALID_ARGUMENT);
+        if (m_spaces.is_valid_node(m_spaces.get_node(to_uintptr_t(root))))
+            return error<const TrackedSpace *>(Error::ADDRESS_ALREADY_MAPPED);
+
+        auto n = m_spaces.insert(TrackedSpace(root, begin, end));
+        if (!m_spaces.is_valid_node(n))
+            return error<const TrackedSpace *>(Error::OUT_OF_MEMORY);
+        const TrackedSpace *space = &(n->get_data());
+        return value(space);
+    }
+
+    void WorkingSetScanner::untrack(PageTable *root)
+    {
+        m_spaces.remove(to_uintptr_t(root));
+    }
+
+    void WorkingSetScanner::scan()
+    {
+        auto &vmmap = VMMap::get_global_instance();
+        for (auto &space : m_spaces)
+            space.add_sample(vmmap.harvest_access_bits(space.get_root(), space.get_begin(), space.get_end()));
+    }
+
+    void WorkingSetScanner::tick(uint64_t now)
+    {
+        if (now - m_last_scan < m_period)
+            return;
+        m_last_scan = now;
+        scan();
+    }
+
+    Result<size_t> WorkingSetScanner::get_estimate(PageTable *root) const
+    {
+        auto n = m_spaces.get_node(to_uintptr_t(root));
+        if (!m_spaces.is_valid_node(n))
+            return error<size_t>(Error::NOT_FOUND);
+        return value(n->get_data().get_estimate());
+    }
+} // namespace hls
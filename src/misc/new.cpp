@@ -24,19 +24,48 @@ SOFTWARE.
 ---------------------------------------------------------------------------------*/
 
 #include "misc/new.hpp"
+#include "sys/cpu.hpp"
+#include "ulib/atomic.hpp"
+
+// The ABI has compiled code test the first byte of the guard, with acquire ordering, before calling
+// __cxa_guard_acquire. On a little endian machine that's the lowest byte of the first word, so the word holds both
+// that flag and one marking an initialisation in progress. Word sized atomics also avoid the byte sized ones,
+// which don't exist.
+constexpr uint32_t GUARD_INITIALIZED = 0x1;
+constexpr uint32_t GUARD_PENDING = 0x100;
+
+static uint32_t *guard_word(__guard *g)
+{
+    return reinterpret_cast<uint32_t *>(g);
+}
 
 extern "C" int __cxa_guard_acquire(__guard *g)
 {
-    return !*(char *)(g);
+    while (true)
+    {
+        uint32_t state = hls::atomic_load(guard_word(g), hls::MemoryOrder::ACQUIRE);
+        if (state & GUARD_INITIALIZED)
+            return 0;
+
+        uint32_t expected = 0;
+        if (state == 0 &&
+            hls::atomic_compare_exchange(guard_word(g), expected, GUARD_PENDING, hls::MemoryOrder::ACQUIRE))
+            return 1;
+
+        // Another hart is running the initialiser.
+        hls::cpu_relax();
+    }
 }
 
 extern "C" void __cxa_guard_release(__guard *g)
 {
-    *(char *)g = 1;
+    // Publishes the object and clears the pending mark in one store.
+    hls::atomic_store(guard_word(g), GUARD_INITIALIZED, hls::MemoryOrder::RELEASE);
 }
 
-extern "C" void __cxa_guard_abort(__guard *)
+extern "C" void __cxa_guard_abort(__guard *g)
 {
+    hls::atomic_store(guard_word(g), uint32_t(0), hls::MemoryOrder::RELEASE);
 }
 
 extern "C" int atexit(void (*)())
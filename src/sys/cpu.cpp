@@ -24,13 +24,50 @@ SOFTWARE.
 ---------------------------------------------------------------------------------*/
 #include "sys/cpu.hpp"
 #include "plat_def.hpp"
+#include "sys/perhart.hpp"
 namespace hls
 {
 
+    PER_HART static PerHart<size_t> s_cpu_id;
+
     size_t get_cpu_id()
     {
-        // TODO: IMPLEMENT
-        return 0;
+        return s_cpu_id.get();
+    }
+
+    void set_cpu_id(size_t cpu_id)
+    {
+        s_cpu_id.get() = cpu_id;
+    }
+
+    void wait_for_interrupt()
+    {
+        _wait_for_interrupt();
+    }
+
+    InterruptState disable_interrupts()
+    {
+        return _disable_interrupts();
+    }
+
+    void restore_interrupts(InterruptState state)
+    {
+        _restore_interrupts(state);
+    }
+
+    void enable_interrupts()
+    {
+        _restore_interrupts(SSTATUS_SIE);
+    }
+
+    uint64_t read_cycle_counter()
+    {
+        return _read_cycle_counter();
+    }
+
+    void cpu_relax()
+    {
+        _cpu_relax();
     }
 
     void flush_tlb()
@@ -38,10 +75,17 @@ namespace hls
         _flush_tlb();
     }
 
+    void flush_tlb_page(const void *vaddress)
+    {
+        _flush_tlb_page(vaddress);
+    }
+
     void die()
     {
+        disable_interrupts();
+        // wfi may return spuriously, or on an interrupt that stays pending while masked.
         while (true)
-            ;
+            wait_for_interrupt();
     }
 
 } // namespace hls
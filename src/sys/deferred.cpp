@@ -0,0 +1,191 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/deferred.hpp"
+#include "plat_def.hpp"
+#include "sys/cpu.hpp"
+#include "sys/perhart.hpp"
+#include "sys/preempt.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/thread.hpp"
+#include "sys/timer.hpp"
+#include "sys/wait.hpp"
+
+namespace hls
+{
+    struct DeferredHartData
+    {
+        // Items waiting to run, oldest first. Only the hart itself touches the list, with interrupts masked.
+        DeferredWork *head = nullptr;
+        DeferredWork *tail = nullptr;
+        size_t interrupt_depth = 0;
+        // Set while a pass runs, on an interrupt exit or in the worker thread. Items queued meanwhile are left to it.
+        bool running = false;
+        // The worker thread waits here for items.
+        WaitQueue worker_queue;
+        DeferredStatistics statistics;
+    };
+
+    PER_HART static PerHart<DeferredHartData> s_deferred;
+
+    void DeferredStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: {} deferred items queued, {} run on interrupt exit, {} by the worker, {} exits over budget, "
+                 "largest batch {}.",
+                 cpu_id, queued, exit_runs, worker_runs, budget_exhausted, largest_batch);
+    }
+
+    bool queue_deferred_work(DeferredWork &work, DeferredFunction function, void *argument)
+    {
+        if (work.pending.exchange(1, MemoryOrder::ACQUIRE) != 0)
+            return false;
+
+        work.function = function;
+        work.argument = argument;
+        work.next = nullptr;
+        InterruptState state = disable_interrupts();
+        // Only looked up now, as a thread may move to another hart until interrupts are masked.
+        DeferredHartData &data = s_deferred.get();
+        if (data.tail != nullptr)
+            data.tail->next = &work;
+        else
+            data.head = &work;
+        data.tail = &work;
+        ++data.statistics.queued;
+        bool wake_worker = data.interrupt_depth == 0 && !data.running;
+        restore_interrupts(state);
+
+        // The worker checks for items with the wait queue locked, so the wakeup can't be missed.
+        if (wake_worker)
+            data.worker_queue.wake_one();
+        return true;
+    }
+
+    // Runs queued items until none is left, DEFERRED_BATCH_SIZE ran, or **budget** microseconds went by. Called
+    // with interrupts masked and preemption disabled. Interrupts are enabled while each item runs.
+    static size_t run_pass(DeferredHartData &data, uint64_t budget)
+    {
+        uint64_t deadline = _read_time() + time_from_microseconds(budget);
+        size_t count = 0;
+        while (data.head != nullptr && count < DEFERRED_BATCH_SIZE)
+        {
+            DeferredWork *work = data.head;
+            data.head = work->next;
+            if (data.head == nullptr)
+                data.tail = nullptr;
+            DeferredFunction function = work->function;
+            void *argument = work->argument;
+            // From here on the item may be queued again, also by itself.
+            work->pending.store(0, MemoryOrder::RELEASE);
+
+            enable_interrupts();
+            function(argument);
+            disable_interrupts();
+            ++count;
+            if (_read_time() >= deadline)
+                break;
+        }
+
+        if (count > data.statistics.largest_batch)
+            data.statistics.largest_batch = count;
+        return count;
+    }
+
+    void interrupt_enter()
+    {
+        ++s_deferred.get().interrupt_depth;
+    }
+
+    void interrupt_exit()
+    {
+        DeferredHartData &data = s_deferred.get();
+        if (--data.interrupt_depth != 0 || data.running || data.head == nullptr)
+            return;
+
+        // The handler is done, so other interrupts may come in while the items run. Their exits leave the items to
+        // this pass. It runs on the stack of the interrupted thread, which must not be switched away from until the
+        // pass is over.
+        preempt_disable();
+        data.running = true;
+        size_t count = run_pass(data, DEFERRED_EXIT_BUDGET_US);
+        data.running = false;
+        data.statistics.exit_runs += count;
+        bool leftover = data.head != nullptr;
+        if (leftover)
+            ++data.statistics.budget_exhausted;
+        // Interrupts are masked, so this doesn't switch. preempt_from_interrupt does if the worker should run.
+        preempt_enable();
+
+        if (leftover)
+            data.worker_queue.wake_one();
+    }
+
+    // Pinned to its hart, so its data stays the same.
+    static void deferred_worker(void *)
+    {
+        DeferredHartData &data = s_deferred.get();
+        while (true)
+        {
+            data.worker_queue.wait_until([&] { return data.head != nullptr; });
+
+            // Items expect the hart to stay theirs until they return, as on an interrupt exit. Preemption comes back
+            // between passes, which keeps the worker from starving the other threads.
+            preempt_disable();
+            InterruptState state = disable_interrupts();
+            data.running = true;
+            data.statistics.worker_runs += run_pass(data, DEFERRED_WORKER_BUDGET_US);
+            data.running = false;
+            restore_interrupts(state);
+            preempt_enable();
+        }
+    }
+
+    void start_deferred_workers()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) != HartState::ONLINE)
+                continue;
+            if (create_pinned_thread(cpu_id, deferred_worker, nullptr, "deferred").is_error())
+                kprintln("Couldn't start the deferred work thread of cpu {}.", cpu_id);
+        }
+    }
+
+    DeferredStatistics &get_deferred_statistics(size_t cpu_id)
+    {
+        return s_deferred.get(cpu_id).statistics;
+    }
+
+    void print_deferred_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_deferred_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
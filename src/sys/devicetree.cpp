@@ -4,6 +4,7 @@
 #include "misc/types.hpp"
 #include "plat_def.hpp"
 #include "sys/mem.hpp"
+#include "sys/panic.hpp"
 
 namespace hls
 {
@@ -22,17 +23,19 @@ namespace hls
 
         VMMap::get_global_instance().unmap_memory(aligned);
 
-        // byte *addr = get_kernel_v_free_address();
-        byte *addr = nullptr;
+        auto &vmmap = VMMap::get_global_instance();
+        constexpr uint64_t flags = VM_READ_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        // Keeping the offset within a 64 KiB block lets map_range use NAPOT leaves for large trees.
+        size_t alignment = needed_pages * PAGE_FRAME_SIZE >= NAPOT_FRAME_SIZE ? NAPOT_FRAME_SIZE : PAGE_FRAME_ALIGNMENT;
+        size_t skew = to_uintptr_t(aligned) & (alignment - 1);
+        auto reservation = vmmap.reserve_memory(needed_pages * PAGE_FRAME_SIZE + skew, alignment, flags);
+        if (reservation.is_error())
+            PANIC("Can't reserve memory for the device tree.");
+
+        byte *addr = as_byte_ptr(reservation.get_value()) + skew;
+        if (vmmap.map_range(aligned, addr, needed_pages * PAGE_FRAME_SIZE, flags).is_error())
+            PANIC("Can't map the device tree.");
         fdt_address = addr + (reinterpret_cast<byte *>(fdt) - aligned);
-        for (size_t i = 0; i < needed_pages; ++i)
-        {
-            VMMap::get_global_instance().map_memory(aligned, addr, FrameOrder::FIRST_ORDER,
-                                                    VM_READ_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG);
-            aligned += PAGE_FRAME_SIZE;
-            addr += PAGE_FRAME_SIZE;
-        }
-        // set_kernel_v_free_address(addr);
     }
 
     void *get_fdt()
@@ -0,0 +1,56 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/futex.hpp"
+#include "sys/mem.hpp"
+#include "sys/wait.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    // 2^64 / golden ratio. Multiplying spreads nearby addresses, which only differ in their low bits, over the
+    // whole word, and the top bits make the index.
+    constexpr uint64_t FUTEX_HASH_MULTIPLIER = 0x9E3779B97F4A7C15;
+
+    static WaitQueue s_futex_buckets[FUTEX_BUCKETS];
+
+    static WaitQueue &get_bucket(const uint32_t *address)
+    {
+        uint64_t hash = (to_uintptr_t(address) >> 2) * FUTEX_HASH_MULTIPLIER;
+        return s_futex_buckets[hash >> (64 - FUTEX_HASH_BITS)];
+    }
+
+    bool futex_wait(const uint32_t *address, uint32_t expected)
+    {
+        return get_bucket(address).wait_if([&] { return atomic_load(address, MemoryOrder::RELAXED) == expected; },
+                                           address);
+    }
+
+    size_t futex_wake(const uint32_t *address, size_t count)
+    {
+        return get_bucket(address).wake(count, address);
+    }
+
+} // namespace hls
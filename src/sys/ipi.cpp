@@ -0,0 +1,200 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/ipi.hpp"
+#include "plat_def.hpp"
+#include "sys/cpu.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    struct IpiHartData
+    {
+        // Lock free stack of pending calls. Any hart pushes, only the owner pops, and it takes everything at once.
+        alignas(64) Atomic<CrossCall *> mailbox = nullptr;
+        // Set by the first sender after the owner last drained the mailbox. Later senders skip the interrupt.
+        Atomic<uint32_t> ipi_pending = 0;
+        alignas(64) IpiStatistics statistics;
+    };
+
+    PER_HART static PerHart<IpiHartData> s_ipi;
+
+    void IpiStatistics::print(size_t cpu_id) const
+    {
+        uint64_t average = calls_handled ? latency_ticks / calls_handled : 0;
+        kprintln("cpu {}: {} IPIs sent, {} calls sent, {} coalesced. {} IPIs received, {} calls handled, largest "
+                 "batch {}, average latency {} ticks.",
+                 cpu_id, ipis_sent, calls_sent, calls_coalesced, ipis_received, calls_handled, largest_batch,
+                 average);
+    }
+
+    void initialize_ipi(const void *fdt)
+    {
+        detect_ipi_controller(fdt);
+        enable_ipi();
+    }
+
+    void enable_ipi()
+    {
+        _enable_software_interrupts();
+    }
+
+    void handle_ipi()
+    {
+        IpiHartData &data = s_ipi.get();
+        // The interrupt and the pending mark are cleared before draining, so calls posted from now on raise a new
+        // one instead of getting lost.
+        _clear_ipi();
+        data.ipi_pending.store(0);
+        CrossCall *calls = data.mailbox.exchange(nullptr, MemoryOrder::ACQUIRE);
+        if (calls == nullptr)
+            return;
+
+        // The mailbox is a stack. Reversing it runs calls in the order they were posted.
+        CrossCall *ordered = nullptr;
+        while (calls != nullptr)
+        {
+            CrossCall *next = calls->next;
+            calls->next = ordered;
+            ordered = calls;
+            calls = next;
+        }
+
+        uint64_t batch = 0;
+        uint64_t now = _read_time();
+        while (ordered != nullptr)
+        {
+            // The caller may reuse the call as soon as done is set, so nothing is read from it afterwards.
+            CrossCall *next = ordered->next;
+            data.statistics.latency_ticks += now - ordered->sent_time;
+            ordered->function(ordered->argument);
+            atomic_store(&ordered->done, uint32_t(1), MemoryOrder::RELEASE);
+            ordered = next;
+            ++batch;
+        }
+
+        ++data.statistics.ipis_received;
+        data.statistics.calls_handled += batch;
+        if (batch > data.statistics.largest_batch)
+            data.statistics.largest_batch = batch;
+    }
+
+    // Returns whether the target needs an interrupt to notice the call.
+    static bool post_call(size_t cpu_id, CrossCall &call, void (*function)(void *argument), void *argument)
+    {
+        call.function = function;
+        call.argument = argument;
+        call.done = 0;
+        call.sent_time = _read_time();
+
+        IpiHartData &target = s_ipi.get(cpu_id);
+        CrossCall *head = target.mailbox.load(MemoryOrder::RELAXED);
+        do
+        {
+            call.next = head;
+        } while (!target.mailbox.compare_exchange_weak(head, &call, MemoryOrder::RELEASE));
+
+        IpiStatistics &statistics = s_ipi.get().statistics;
+        ++statistics.calls_sent;
+        if (target.ipi_pending.exchange(1) != 0)
+        {
+            ++statistics.calls_coalesced;
+            return false;
+        }
+
+        return true;
+    }
+
+    static void send_ipis(CpuMask cpus)
+    {
+        s_ipi.get().statistics.ipis_sent += count_cpus(cpus);
+        for_each_hart_window(cpus, [](uint64_t hart_mask, uint64_t base) { _send_ipi(hart_mask, base); });
+    }
+
+    void cross_call_async(size_t cpu_id, CrossCall &call, void (*function)(void *argument), void *argument)
+    {
+        if (post_call(cpu_id, call, function, argument))
+            send_ipis(cpu_mask_of(cpu_id));
+    }
+
+    void cross_call_mask(CpuMask cpus, void (*function)(void *argument), void *argument)
+    {
+        CrossCall calls[MAX_HARTS];
+        size_t self = get_cpu_id();
+        cpus &= get_online_cpu_mask();
+
+        CpuMask needs_ipi = 0;
+        for (size_t cpu_id = 0; cpu_id < MAX_HARTS; ++cpu_id)
+        {
+            if (cpu_id == self || !(cpus & cpu_mask_of(cpu_id)))
+                continue;
+            if (post_call(cpu_id, calls[cpu_id], function, argument))
+                needs_ipi |= cpu_mask_of(cpu_id);
+        }
+        send_ipis(needs_ipi);
+
+        if (cpus & cpu_mask_of(self))
+            function(argument);
+
+        for (size_t cpu_id = 0; cpu_id < MAX_HARTS; ++cpu_id)
+        {
+            if (cpu_id == self || !(cpus & cpu_mask_of(cpu_id)))
+                continue;
+            while (atomic_load(&calls[cpu_id].done, MemoryOrder::ACQUIRE) == 0)
+            {
+                handle_ipi();
+                cpu_relax();
+            }
+        }
+    }
+
+    void cross_call(size_t cpu_id, void (*function)(void *argument), void *argument)
+    {
+        cross_call_mask(cpu_mask_of(cpu_id), function, argument);
+    }
+
+    void wake_hart(size_t cpu_id)
+    {
+        if (s_ipi.get(cpu_id).ipi_pending.exchange(1) == 0)
+            send_ipis(cpu_mask_of(cpu_id));
+    }
+
+    IpiStatistics &get_ipi_statistics(size_t cpu_id)
+    {
+        return s_ipi.get(cpu_id).statistics;
+    }
+
+    void print_ipi_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_ipi_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
@@ -1 +1,104 @@
+/*---------------------------------------------------------------------------------
+MIT License
 
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/kmalloc.hpp"
+#include "mem/bumpallocator.hpp"
+#include "sys/panic.hpp"
+#include "sys/spinlock.hpp"
+
+namespace hls
+{
+    constexpr size_t KMALLOC_SIZE_CLASSES = 7;
+
+    static_assert(KMALLOC_MIN_BLOCK << (KMALLOC_SIZE_CLASSES - 1) == KMALLOC_MAX_BLOCK);
+
+    // Precedes every block. Its size keeps what follows aligned.
+    struct alignas(KMALLOC_ALIGNMENT) KmallocHeader
+    {
+        size_t size_class;
+    };
+
+    static_assert(sizeof(KmallocHeader) == KMALLOC_ALIGNMENT);
+
+    // The allocator comes first, so that the blocks carved out of its embedded frame are as aligned as the class.
+    struct alignas(KMALLOC_ALIGNMENT) KmallocSizeClass
+    {
+        BumpAllocator allocator;
+        TicketLock lock;
+
+        KmallocSizeClass(size_t block_size) : allocator(block_size)
+        {
+        }
+    };
+
+    static KmallocSizeClass *get_size_classes()
+    {
+        static KmallocSizeClass classes[KMALLOC_SIZE_CLASSES] = {32, 64, 128, 256, 512, 1024, 2048};
+        return classes;
+    }
+
+    static size_t get_size_class(size_t bytes)
+    {
+        size_t size_class = 0;
+        for (size_t block = KMALLOC_MIN_BLOCK; block < bytes + sizeof(KmallocHeader); block <<= 1)
+            ++size_class;
+        return size_class;
+    }
+
+    void initialize_kmalloc()
+    {
+        get_size_classes();
+    }
+
+    void *kmalloc(size_t bytes)
+    {
+        if (bytes > KMALLOC_MAX_SIZE)
+            return nullptr;
+
+        size_t size_class = get_size_class(bytes);
+        KmallocSizeClass &heap = get_size_classes()[size_class];
+        heap.lock.lock();
+        auto header = reinterpret_cast<KmallocHeader *>(heap.allocator.get_mem());
+        heap.lock.unlock();
+        header->size_class = size_class;
+        return header + 1;
+    }
+
+    void kfree(void *ptr)
+    {
+        if (ptr == nullptr)
+            return;
+
+        auto header = reinterpret_cast<KmallocHeader *>(ptr) - 1;
+        if (header->size_class >= KMALLOC_SIZE_CLASSES)
+            PANIC("kfree of a pointer that didn't come from kmalloc.");
+
+        KmallocSizeClass &heap = get_size_classes()[header->size_class];
+        heap.lock.lock();
+        heap.allocator.release_mem(header);
+        heap.lock.unlock();
+    }
+
+} // namespace hls
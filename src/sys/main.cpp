@@ -26,6 +26,8 @@ SOFTWARE.
 #include "leanmeanparser/optionparser.hpp"
 #include "mem/framemanager.hpp"
 #include "mem/mmap.hpp"
+#include "mem/tlb.hpp"
+#include "mem/workingset.hpp"
 #include "misc/githash.hpp"
 #include "misc/splash.hpp"
 #include "misc/symbols.hpp"
@@ -33,11 +35,20 @@ SOFTWARE.
 #include "sys/bootdata.hpp"
 #include "sys/bootoptions.hpp"
 #include "sys/cpu.hpp"
+#include "sys/deferred.hpp"
 #include "sys/devicetree.hpp"
+#include "sys/fpu.hpp"
+#include "sys/idle.hpp"
+#include "sys/ipi.hpp"
 #include "sys/kmalloc.hpp"
 #include "sys/mem.hpp"
+#include "sys/perhart.hpp"
 #include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/spinlock.hpp"
 #include "sys/string.hpp"
+#include "sys/thread.hpp"
+#include "sys/timer.hpp"
 
 namespace hls
 {
@@ -51,6 +62,22 @@ namespace hls
         kprintln("Copyright (C) {}. Built from {}.", __DATE__ + 7, GIT_HASH);
     }
 
+    static Timer s_working_set_timer;
+    static DeferredWork s_working_set_work;
+
+    // Deferred by the timer interrupt of the boot hart, and run on that hart with preemption disabled. That makes the
+    // scanner single threaded as long as it is only otherwise used by the boot hart with interrupts masked.
+    static void scan_working_sets(void *)
+    {
+        WorkingSetScanner::get_global_instance().tick(time_to_microseconds(_read_time()) / 1000);
+    }
+
+    // A scan walks every registered address space, which is too long for the timer interrupt itself.
+    static void defer_working_set_scan(void *)
+    {
+        queue_deferred_work(s_working_set_work, scan_working_sets, nullptr);
+    }
+
     void unmap_low_kernel(byte *begin, byte *end)
     {
         for (auto it = begin; it < end; it += PAGE_FRAME_SIZE)
@@ -61,28 +88,65 @@ namespace hls
 
     __attribute__((noreturn)) void kernel_main(bootinfo *b_info)
     {
+        // Firmware leaves tp undefined. It must point at our per hart area before anything uses per hart state.
+        initialize_boot_per_hart_area();
+        set_cpu_id(0);
         display_initial_info();
+        initialize_paging_mode(b_info->satp_mode);
 
         // Initialize FrameManager with pages that remain from the bootstage.
         const Pair<void *, size_t> boot_pages{b_info->p_kernel_table + b_info->used_bootpages,
                                               (BOOTPAGES - b_info->used_bootpages) * FrameKB::s_size};
         FrameManager::initialize_global_instance();
         FrameManager::get_global_instance().expand_memory(boot_pages);
+        // Boot pages already in use hold the kernel page tables.
+        FrameManager::get_global_instance().track_frames(reinterpret_cast<FrameKB *>(b_info->p_kernel_table),
+                                                         b_info->used_bootpages);
 
         // Initialize kernel memory mapper and unmap low kernel, given that we don't rely on it anymore.
         VMMap::initialize_global_instance(b_info->p_kernel_table, b_info->v_scratch);
+        tlb_set_active_root(b_info->p_kernel_table);
         unmap_low_kernel(b_info->p_lowkernel_start, b_info->p_lowkernel_end);
-        kprintln("Here!");
-
-        while (true)
-            ;
+        initialize_trap_handling();
 
         mapfdt(get_device_tree_from_options(b_info->argc, b_info->argv));
         initialize_frame_manager(get_fdt(), b_info);
-
-        // initialize_kmalloc();
-        while (true)
-            ;
+        initialize_kmalloc();
+        detect_isa_extensions(get_fdt());
+        initialize_fpu();
+        detect_timebase_frequency(get_fdt());
+        // The kernel image was mapped page by page at boot, before we knew which extensions are available.
+        VMMap::get_global_instance().coalesce_range(&_text_begin, &_stack_end);
+        if (enable_hardware_ad_updates())
+        {
+            kdebug("A/D bits are updated by the hardware.");
+        }
+#ifdef DEBUG
+        run_copy_on_write_self_test();
+#endif
+        WorkingSetScanner::initialize_global_instance(WORKING_SET_SCAN_PERIOD);
+        initialize_ipi(get_fdt());
+        initialize_timers();
+        detect_idle_states(get_fdt());
+        initialize_scheduler();
+        start_scheduler_tick();
+        arm_timer(s_working_set_timer, _read_time() + time_from_microseconds(WORKING_SET_SCAN_PERIOD * 1000),
+                  defer_working_set_scan, nullptr, time_from_microseconds(WORKING_SET_SCAN_PERIOD * 1000));
+        enable_interrupts();
+        // Other harts only idle and run per hart work from here on. Subsystems documented as ST stay the boot hart's.
+        kprintln("{} harts online.", start_secondary_harts(get_fdt(), b_info));
+        start_deferred_workers();
+#ifdef DEBUG
+        VMMap::get_global_instance().inspect_address_space(VMMap::get_global_instance().get_root_table()).print();
+#endif
+
+        run_atomics_benchmark(ATOMICS_BENCHMARK_ITERATIONS);
+        run_context_switch_benchmark(CONTEXT_SWITCH_BENCHMARK_ROUND_TRIPS);
+        run_fork_join_benchmark(FORK_JOIN_BENCHMARK_ITEMS, FORK_JOIN_BENCHMARK_ROUNDS);
+        print_fpu_statistics();
+        print_idle_statistics();
+        print_deferred_statistics();
+        idle_loop();
     }
 
 }; // namespace hls
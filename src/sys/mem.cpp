@@ -71,7 +71,7 @@ namespace hls
         byte *p = reinterpret_cast<byte *>(dst);
         for (size_t i = 0; i < size; ++i)
         {
-            *p = c;
+            p[i] = c;
         }
     }
 
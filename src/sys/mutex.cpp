@@ -0,0 +1,118 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/mutex.hpp"
+#include "sys/futex.hpp"
+
+namespace hls
+{
+    constexpr uint32_t MUTEX_UNLOCKED = 0;
+    constexpr uint32_t MUTEX_LOCKED = 1;
+    constexpr uint32_t MUTEX_CONTENDED = 2;
+
+    void Mutex::lock()
+    {
+        uint32_t expected = MUTEX_UNLOCKED;
+        if (m_state.compare_exchange(expected, MUTEX_LOCKED, MemoryOrder::ACQUIRE))
+            return;
+        lock_contended();
+    }
+
+    void Mutex::lock_contended()
+    {
+        // Whoever gets the lock this way can't tell whether others still wait, so it assumes they do and wakes one
+        // on unlock.
+        while (m_state.exchange(MUTEX_CONTENDED, MemoryOrder::ACQUIRE) != MUTEX_UNLOCKED)
+            futex_wait(m_state.get_address(), MUTEX_CONTENDED);
+    }
+
+    bool Mutex::try_lock()
+    {
+        uint32_t expected = MUTEX_UNLOCKED;
+        return m_state.compare_exchange(expected, MUTEX_LOCKED, MemoryOrder::ACQUIRE);
+    }
+
+    void Mutex::unlock()
+    {
+        if (m_state.exchange(MUTEX_UNLOCKED, MemoryOrder::RELEASE) == MUTEX_CONTENDED)
+            futex_wake(m_state.get_address(), 1);
+    }
+
+    bool Mutex::is_locked() const
+    {
+        return m_state.load(MemoryOrder::RELAXED) != MUTEX_UNLOCKED;
+    }
+
+    void Semaphore::down()
+    {
+        while (!try_down())
+        {
+            // Pairs with up: either it sees us waiting, or futex_wait sees its count.
+            m_waiters.fetch_add(1);
+            futex_wait(m_count.get_address(), 0);
+            m_waiters.fetch_sub(1);
+        }
+    }
+
+    bool Semaphore::try_down()
+    {
+        uint32_t count = m_count.load(MemoryOrder::RELAXED);
+        while (count != 0)
+        {
+            if (m_count.compare_exchange_weak(count, count - 1, MemoryOrder::ACQUIRE))
+                return true;
+        }
+        return false;
+    }
+
+    void Semaphore::up()
+    {
+        m_count.fetch_add(1);
+        if (m_waiters.load() != 0)
+            futex_wake(m_count.get_address(), 1);
+    }
+
+    void ConditionVariable::wait(Mutex &mutex)
+    {
+        uint32_t sequence = m_sequence.load(MemoryOrder::RELAXED);
+        mutex.unlock();
+        futex_wait(m_sequence.get_address(), sequence);
+        // Threads woken by broadcast race for the mutex, and those that lose must be woken up again by its unlock.
+        mutex.lock_contended();
+    }
+
+    void ConditionVariable::signal()
+    {
+        m_sequence.fetch_add(1, MemoryOrder::RELEASE);
+        futex_wake(m_sequence.get_address(), 1);
+    }
+
+    void ConditionVariable::broadcast()
+    {
+        m_sequence.fetch_add(1, MemoryOrder::RELEASE);
+        futex_wake(m_sequence.get_address(), ~size_t(0));
+    }
+
+} // namespace hls
@@ -1,4 +1,5 @@
 #include "sys/panic.hpp"
+#include "sys/cpu.hpp"
 #include "sys/print.hpp"
 
 using namespace hls;
@@ -25,6 +26,7 @@ void print_stack_trace(void *address, size_t level)
 
 extern "C" void print_registers(registers *h)
 {
+    RecursiveLockGuard guard(get_console_lock());
     for (size_t i = 0; i < 32; ++i)
     {
         kprint("x{}: {} ", i, reinterpret_cast<void *>(h->reg.array[i]));
@@ -53,6 +55,7 @@ extern "C" void stack_trace()
         return reinterpret_cast<void *>(*(v - 2));
     };
 
+    RecursiveLockGuard guard(get_console_lock());
     asm("add %0, x0, s0;" : "=r"(fp) : "r"(fp));
 
     // The first one we skip, given that it will point to the call to
@@ -74,8 +77,7 @@ extern "C" void stack_trace()
 extern "C" void die()
 {
     kprintln("Please, manually reboot the machine.");
-    while (true)
-        ;
+    hls::die();
 }
 
 extern "C" void panic_message_print(const char *msg)
@@ -0,0 +1,110 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/perhart.hpp"
+#include "mem/framemanager.hpp"
+#include "mem/mmap.hpp"
+#include "sys/mem.hpp"
+#include "sys/smp.hpp"
+
+namespace hls
+{
+    static byte *s_per_hart_areas[MAX_HARTS];
+
+    static size_t get_per_hart_size()
+    {
+        return static_cast<size_t>(&_per_hart_end - &_per_hart_begin);
+    }
+
+    void initialize_boot_per_hart_area()
+    {
+        memcpy(&_boot_per_hart_begin, &_per_hart_begin, get_per_hart_size());
+        s_per_hart_areas[0] = &_boot_per_hart_begin;
+        enter_per_hart_area(0);
+    }
+
+    static size_t get_per_hart_area_size()
+    {
+        // An empty section still gets a page, so every hart has a distinct, valid tp.
+        return to_uintptr_t(align_forward(to_ptr(get_per_hart_size() + 1), PAGE_FRAME_SIZE));
+    }
+
+    Result<byte *> create_per_hart_area(size_t cpu_id)
+    {
+        if (cpu_id == 0 || cpu_id >= MAX_HARTS)
+            return error<byte *>(Error::INVALID_ARGUMENT);
+
+        size_t size = get_per_hart_area_size();
+        auto &vmmap = VMMap::get_global_instance();
+        auto reservation = vmmap.reserve_memory(size, PAGE_FRAME_SIZE, VM_READ_FLAG | VM_WRITE_FLAG);
+        if (reservation.is_error())
+            return error<byte *>(reservation.get_error());
+
+        auto frame_info = FrameManager::get_global_instance().get_frames(size / PAGE_FRAME_SIZE, 0);
+        if (frame_info == nullptr)
+        {
+            vmmap.release_memory(reservation.get_value());
+            return error<byte *>(Error::OUT_OF_MEMORY);
+        }
+
+        uint64_t flags = VM_VALID_FLAG | VM_READ_FLAG | VM_WRITE_FLAG | VM_ACCESS_FLAG | VM_DIRTY_FLAG;
+        if (vmmap.map_range(frame_info->get_frame_pointer(), reservation.get_value(), size, flags).is_error())
+        {
+            FrameManager::get_global_instance().release_frames(frame_info->get_frame_pointer(), size / PAGE_FRAME_SIZE);
+            vmmap.release_memory(reservation.get_value());
+            return error<byte *>(Error::OUT_OF_MEMORY);
+        }
+
+        byte *area = as_byte_ptr(reservation.get_value());
+        memcpy(area, &_per_hart_begin, get_per_hart_size());
+        s_per_hart_areas[cpu_id] = area;
+        return value(area);
+    }
+
+    void destroy_per_hart_area(size_t cpu_id)
+    {
+        if (cpu_id == 0 || cpu_id >= MAX_HARTS || s_per_hart_areas[cpu_id] == nullptr)
+            return;
+
+        auto &vmmap = VMMap::get_global_instance();
+        auto mapping = vmmap.get_mapping_data(s_per_hart_areas[cpu_id]);
+        vmmap.release_memory(s_per_hart_areas[cpu_id]);
+        if (mapping.is_value())
+            FrameManager::get_global_instance().release_frames(mapping.get_value().get_paddress(),
+                                                               get_per_hart_area_size() / PAGE_FRAME_SIZE);
+        s_per_hart_areas[cpu_id] = nullptr;
+    }
+
+    void enter_per_hart_area(size_t cpu_id)
+    {
+        _set_thread_pointer(to_uintptr_t(s_per_hart_areas[cpu_id]));
+    }
+
+    byte *get_per_hart_area(size_t cpu_id)
+    {
+        return s_per_hart_areas[cpu_id];
+    }
+
+} // namespace hls
@@ -30,6 +30,13 @@ SOFTWARE.
 namespace hls
 {
 
+    static RecursiveLock s_console_lock;
+
+    RecursiveLock &get_console_lock()
+    {
+        return s_console_lock;
+    }
+
     void putchar(char c)
     {
         kinit_putchar(c);
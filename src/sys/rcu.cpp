@@ -0,0 +1,181 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/rcu.hpp"
+#include "mem/framemanager.hpp"
+#include "sys/cpu.hpp"
+#include "sys/perhart.hpp"
+#include "sys/smp.hpp"
+
+namespace hls
+{
+    // Frames each hart may have waiting for a grace period. A full queue makes the next release synchronous.
+    constexpr size_t RCU_DEFERRED_FRAMES = 64;
+
+    struct DeferredFrame
+    {
+        void *frame_pointer;
+        uint64_t grace_period;
+    };
+
+    struct RcuHartData
+    {
+        // Latest grace period started before this hart's last quiescent state.
+        Atomic<uint64_t> quiescent_grace_period = 0;
+        Atomic<bool> idle = false;
+        RcuHead *callbacks_head = nullptr;
+        RcuHead *callbacks_tail = nullptr;
+        DeferredFrame deferred_frames[RCU_DEFERRED_FRAMES] = {};
+        size_t deferred_first = 0;
+        size_t deferred_count = 0;
+    };
+
+    PER_HART static PerHart<RcuHartData> s_rcu;
+    // Grace periods are numbered. This is the last one started, and one is started per deferred reclamation.
+    static Atomic<uint64_t> s_grace_period = 0;
+    // Highest grace period known to be over. Only a cache of what is_grace_period_over computes.
+    static Atomic<uint64_t> s_completed_grace_period = 0;
+
+    static uint64_t start_grace_period()
+    {
+        return s_grace_period.fetch_add(1, MemoryOrder::ACQ_REL) + 1;
+    }
+
+    static bool is_grace_period_over(uint64_t grace_period)
+    {
+        if (s_completed_grace_period.load(MemoryOrder::ACQUIRE) >= grace_period)
+            return true;
+
+        // Pairs with the fence in rcu_exit_idle: either we see the hart awake, or it sees the new pointers.
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) != HartState::ONLINE)
+                continue;
+            RcuHartData &data = s_rcu.get(cpu_id);
+            if (data.idle.load(MemoryOrder::ACQUIRE))
+                continue;
+            if (data.quiescent_grace_period.load(MemoryOrder::ACQUIRE) < grace_period)
+                return false;
+        }
+
+        uint64_t completed = s_completed_grace_period.load(MemoryOrder::RELAXED);
+        while (completed < grace_period &&
+               !s_completed_grace_period.compare_exchange_weak(completed, grace_period, MemoryOrder::RELEASE))
+            ;
+        return true;
+    }
+
+    static void report_quiescent_state(RcuHartData &data)
+    {
+        // Every read side access made so far must be done before the report becomes visible.
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        data.quiescent_grace_period.store(s_grace_period.load(MemoryOrder::ACQUIRE), MemoryOrder::RELEASE);
+    }
+
+    static void run_callbacks(RcuHartData &data)
+    {
+        // Grace periods of a hart's callbacks grow along the list, so the first one not over stops the walk.
+        while (data.callbacks_head != nullptr && is_grace_period_over(data.callbacks_head->grace_period))
+        {
+            RcuHead *head = data.callbacks_head;
+            data.callbacks_head = head->next;
+            if (data.callbacks_head == nullptr)
+                data.callbacks_tail = nullptr;
+            head->callback(head);
+        }
+
+        while (data.deferred_count > 0 &&
+               is_grace_period_over(data.deferred_frames[data.deferred_first].grace_period))
+        {
+            DeferredFrame &frame = data.deferred_frames[data.deferred_first];
+            FrameManager::get_global_instance().release_frames(frame.frame_pointer, 1);
+            data.deferred_first = (data.deferred_first + 1) % RCU_DEFERRED_FRAMES;
+            --data.deferred_count;
+        }
+    }
+
+    void rcu_quiescent_state()
+    {
+        RcuHartData &data = s_rcu.get();
+        report_quiescent_state(data);
+        run_callbacks(data);
+    }
+
+    void rcu_enter_idle()
+    {
+        rcu_quiescent_state();
+        s_rcu.get().idle.store(true, MemoryOrder::RELEASE);
+    }
+
+    void rcu_exit_idle()
+    {
+        RcuHartData &data = s_rcu.get();
+        data.idle.store(false, MemoryOrder::RELAXED);
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        report_quiescent_state(data);
+    }
+
+    void synchronize_rcu()
+    {
+        uint64_t grace_period = start_grace_period();
+        // The caller is outside any read side section, so it doesn't hold up the grace period it waits for.
+        report_quiescent_state(s_rcu.get());
+        while (!is_grace_period_over(grace_period))
+            cpu_relax();
+        run_callbacks(s_rcu.get());
+    }
+
+    void call_rcu(RcuHead *head, void (*callback)(RcuHead *head))
+    {
+        RcuHartData &data = s_rcu.get();
+        head->next = nullptr;
+        head->callback = callback;
+        head->grace_period = start_grace_period();
+        if (data.callbacks_tail != nullptr)
+            data.callbacks_tail->next = head;
+        else
+            data.callbacks_head = head;
+        data.callbacks_tail = head;
+    }
+
+    void rcu_release_frames(void *frame_pointer)
+    {
+        RcuHartData &data = s_rcu.get();
+        if (data.deferred_count == RCU_DEFERRED_FRAMES)
+        {
+            // The frames were unpublished before the grace period synchronize_rcu waits for, and that wait drains
+            // the queue as well.
+            synchronize_rcu();
+            FrameManager::get_global_instance().release_frames(frame_pointer, 1);
+            return;
+        }
+
+        size_t slot = (data.deferred_first + data.deferred_count) % RCU_DEFERRED_FRAMES;
+        data.deferred_frames[slot] = {.frame_pointer = frame_pointer, .grace_period = start_grace_period()};
+        ++data.deferred_count;
+    }
+
+} // namespace hls
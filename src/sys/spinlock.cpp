@@ -0,0 +1,285 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/spinlock.hpp"
+#include "sys/preempt.hpp"
+#include "sys/print.hpp"
+
+namespace hls
+{
+    void LockStatistics::record(bool was_contended, uint64_t cycles)
+    {
+        ++acquisitions;
+        if (was_contended)
+        {
+            ++contended;
+            wait_cycles += cycles;
+        }
+    }
+
+    void LockStatistics::reset()
+    {
+        acquisitions = 0;
+        contended = 0;
+        wait_cycles = 0;
+    }
+
+    void LockStatistics::print(const char *name) const
+    {
+        kprintln("Lock {}: {} acquisitions, {} contended, {} cycles spent waiting.", name, acquisitions, contended,
+                 wait_cycles);
+    }
+
+    void TicketLock::lock()
+    {
+        // Being switched away while holding the lock would leave every other hart spinning on it for a whole slice.
+        preempt_disable();
+        uint32_t ticket = m_next.fetch_add(1, MemoryOrder::RELAXED);
+        if (m_owner.load(MemoryOrder::ACQUIRE) == ticket)
+        {
+            if (m_statistics != nullptr)
+                m_statistics->record(false, 0);
+            return;
+        }
+
+        // Reading the counter costs a few cycles, so it is only done when someone is watching.
+        uint64_t start = m_statistics != nullptr ? read_cycle_counter() : 0;
+        while (m_owner.load(MemoryOrder::ACQUIRE) != ticket)
+            cpu_relax();
+        if (m_statistics != nullptr)
+            m_statistics->record(true, read_cycle_counter() - start);
+    }
+
+    bool TicketLock::try_lock()
+    {
+        // The lock is free when no ticket was handed out past the owner's.
+        uint32_t owner = m_owner.load(MemoryOrder::RELAXED);
+        uint32_t expected = owner;
+        preempt_disable();
+        if (!m_next.compare_exchange(expected, owner + 1, MemoryOrder::ACQUIRE))
+        {
+            preempt_enable();
+            return false;
+        }
+
+        if (m_statistics != nullptr)
+            m_statistics->record(false, 0);
+        return true;
+    }
+
+    void TicketLock::unlock()
+    {
+        // Only the holder writes m_owner, so a plain increment published with release ordering suffices.
+        m_owner.store(m_owner.load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELEASE);
+        preempt_enable();
+    }
+
+    bool TicketLock::is_locked() const
+    {
+        return m_owner.load(MemoryOrder::RELAXED) != m_next.load(MemoryOrder::RELAXED);
+    }
+
+    InterruptState TicketLock::lock_irqsave()
+    {
+        InterruptState state = disable_interrupts();
+        lock();
+        return state;
+    }
+
+    void TicketLock::unlock_irqrestore(InterruptState state)
+    {
+        unlock();
+        restore_interrupts(state);
+    }
+
+    InterruptState RecursiveLock::lock()
+    {
+        InterruptState state = disable_interrupts();
+        // Only this hart stores its own id, so seeing it means we hold the lock already.
+        size_t self = get_cpu_id();
+        if (m_owner.load(MemoryOrder::RELAXED) == self)
+        {
+            ++m_depth;
+            return state;
+        }
+
+        m_lock.lock();
+        m_owner.store(self, MemoryOrder::RELAXED);
+        m_depth = 1;
+        return state;
+    }
+
+    void RecursiveLock::unlock(InterruptState state)
+    {
+        if (--m_depth == 0)
+        {
+            m_owner.store(NO_OWNER, MemoryOrder::RELAXED);
+            m_lock.unlock();
+        }
+        restore_interrupts(state);
+    }
+
+    void TicketLock::set_statistics(LockStatistics *statistics)
+    {
+        m_statistics = statistics;
+    }
+
+    void McsLock::lock(McsNode &node)
+    {
+        preempt_disable();
+        node.next.store(nullptr, MemoryOrder::RELAXED);
+        node.locked.store(1, MemoryOrder::RELAXED);
+        McsNode *previous = m_tail.exchange(&node, MemoryOrder::ACQ_REL);
+        if (previous == nullptr)
+        {
+            if (m_statistics != nullptr)
+                m_statistics->record(false, 0);
+            return;
+        }
+
+        uint64_t start = m_statistics != nullptr ? read_cycle_counter() : 0;
+        previous->next.store(&node, MemoryOrder::RELEASE);
+        while (node.locked.load(MemoryOrder::ACQUIRE) != 0)
+            cpu_relax();
+        if (m_statistics != nullptr)
+            m_statistics->record(true, read_cycle_counter() - start);
+    }
+
+    bool McsLock::try_lock(McsNode &node)
+    {
+        node.next.store(nullptr, MemoryOrder::RELAXED);
+        node.locked.store(0, MemoryOrder::RELAXED);
+        McsNode *expected = nullptr;
+        preempt_disable();
+        if (!m_tail.compare_exchange(expected, &node, MemoryOrder::ACQUIRE))
+        {
+            preempt_enable();
+            return false;
+        }
+
+        if (m_statistics != nullptr)
+            m_statistics->record(false, 0);
+        return true;
+    }
+
+    void McsLock::unlock(McsNode &node)
+    {
+        McsNode *next = node.next.load(MemoryOrder::ACQUIRE);
+        if (next == nullptr)
+        {
+            // Nobody queued behind us, unless a hart swapped the tail but hasn't linked itself yet.
+            McsNode *expected = &node;
+            if (m_tail.compare_exchange(expected, nullptr, MemoryOrder::RELEASE))
+            {
+                preempt_enable();
+                return;
+            }
+            while ((next = node.next.load(MemoryOrder::ACQUIRE)) == nullptr)
+                cpu_relax();
+        }
+
+        next->locked.store(0, MemoryOrder::RELEASE);
+        preempt_enable();
+    }
+
+    bool McsLock::is_locked() const
+    {
+        return m_tail.load(MemoryOrder::RELAXED) != nullptr;
+    }
+
+    InterruptState McsLock::lock_irqsave(McsNode &node)
+    {
+        InterruptState state = disable_interrupts();
+        lock(node);
+        return state;
+    }
+
+    void McsLock::unlock_irqrestore(McsNode &node, InterruptState state)
+    {
+        unlock(node);
+        restore_interrupts(state);
+    }
+
+    void McsLock::set_statistics(LockStatistics *statistics)
+    {
+        m_statistics = statistics;
+    }
+
+    // Average cycles of **operation** over **iterations** calls. Interrupts are masked, so that no handler is counted.
+    template <typename Operation>
+    static uint64_t measure_cycles(size_t iterations, Operation operation)
+    {
+        InterruptState state = disable_interrupts();
+        uint64_t start = read_cycle_counter();
+        for (size_t i = 0; i < iterations; ++i)
+            operation();
+        uint64_t cycles = read_cycle_counter() - start;
+        restore_interrupts(state);
+        return cycles / iterations;
+    }
+
+    void run_atomics_benchmark(size_t iterations)
+    {
+        if (iterations == 0)
+            return;
+
+        alignas(64) uint64_t word = 0;
+        // volatile keeps the compiler from folding the loop into a single addition.
+        volatile uint64_t plain = 0;
+        TicketLock ticket_lock;
+        McsLock mcs_lock;
+
+        uint64_t plain_cycles = measure_cycles(iterations, [&] { plain = plain + 1; });
+        uint64_t relaxed_cycles =
+            measure_cycles(iterations, [&] { atomic_fetch_add(&word, uint64_t(1), MemoryOrder::RELAXED); });
+        uint64_t seq_cst_cycles =
+            measure_cycles(iterations, [&] { atomic_fetch_add(&word, uint64_t(1), MemoryOrder::SEQ_CST); });
+        uint64_t cas_cycles = measure_cycles(iterations, [&] {
+            uint64_t expected = atomic_load(&word, MemoryOrder::RELAXED);
+            while (!atomic_compare_exchange_weak(&word, expected, expected + 1))
+                ;
+        });
+        uint64_t load_cycles = measure_cycles(iterations, [&] { (void)atomic_load(&word, MemoryOrder::ACQUIRE); });
+        uint64_t store_cycles =
+            measure_cycles(iterations, [&] { atomic_store(&word, uint64_t(0), MemoryOrder::RELEASE); });
+        uint64_t bit_cycles = measure_cycles(iterations, [&] { (void)atomic_test_and_set_bit(&word, 3); });
+        uint64_t ticket_cycles = measure_cycles(iterations, [&] {
+            ticket_lock.lock();
+            ticket_lock.unlock();
+        });
+        uint64_t mcs_cycles = measure_cycles(iterations, [&] {
+            McsNode node;
+            mcs_lock.lock(node);
+            mcs_lock.unlock(node);
+        });
+
+        kprintln("Atomics, cycles per operation: plain increment {}, fetch_add relaxed {}, fetch_add seq_cst {}, "
+                 "compare-exchange increment {} ({}), load acquire {}, store release {}, test_and_set_bit {}.",
+                 plain_cycles, relaxed_cycles, seq_cst_cycles, cas_cycles, detail::use_zacas ? "amocas" : "lr/sc",
+                 load_cycles, store_cycles, bit_cycles);
+        kprintln("Uncontended lock and unlock: ticket {} cycles, MCS {} cycles.", ticket_cycles, mcs_cycles);
+    }
+
+} // namespace hls
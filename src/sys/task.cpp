@@ -0,0 +1,243 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/task.hpp"
+#include "plat_def.hpp"
+#include "sys/cpu.hpp"
+#include "sys/ipi.hpp"
+#include "sys/kmalloc.hpp"
+#include "sys/mem.hpp"
+#include "sys/panic.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/spinlock.hpp"
+
+namespace hls
+{
+    constexpr uintptr_t EVENT_CLEAR = 0;
+    constexpr uintptr_t EVENT_SET = 1;
+
+    struct TaskHartData
+    {
+        // Tasks ready to be resumed, oldest first. Taken with interrupts masked, as timers and completions queue
+        // tasks from interrupt handlers.
+        TicketLock lock;
+        TaskPromiseBase *head = nullptr;
+        TaskPromiseBase *tail = nullptr;
+        TaskStatistics statistics;
+    };
+
+    PER_HART static PerHart<TaskHartData> s_tasks;
+
+    void TaskStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: {} tasks spawned, {} completed, {} resumes, {} remote wakeups, largest batch {}.", cpu_id,
+                 spawned, completed, resumes, remote_wakeups, largest_batch);
+    }
+
+    void *TaskPromiseBase::operator new(size_t size)
+    {
+        void *frame = kmalloc(size);
+        if (frame == nullptr)
+            PANIC("Coroutine frame larger than KMALLOC_MAX_SIZE.");
+        return frame;
+    }
+
+    void TaskPromiseBase::operator delete(void *ptr)
+    {
+        kfree(ptr);
+    }
+
+    void TaskPromiseBase::unhandled_exception()
+    {
+        PANIC("Exception escaped a task.");
+    }
+
+    std::coroutine_handle<> TaskPromiseBase::finish() noexcept
+    {
+        if (continuation)
+            return continuation;
+
+        // Nobody holds a Task for a spawned coroutine anymore, so the frame is ours to free. It is suspended at its
+        // final point, which makes that safe from here.
+        ++s_tasks.get().statistics.completed;
+        handle.destroy();
+        return std::noop_coroutine();
+    }
+
+    void schedule_task(TaskPromiseBase &promise)
+    {
+        size_t cpu_id = promise.cpu_id;
+        size_t self = get_cpu_id();
+        TaskHartData &data = s_tasks.get(cpu_id);
+        promise.next = nullptr;
+
+        InterruptState state = data.lock.lock_irqsave();
+        if (data.tail != nullptr)
+            data.tail->next = &promise;
+        else
+            data.head = &promise;
+        data.tail = &promise;
+        data.lock.unlock_irqrestore(state);
+
+        // The hart checks its queue with interrupts masked before it sleeps, so the IPI can't be missed.
+        if (cpu_id != self)
+        {
+            ++s_tasks.get(self).statistics.remote_wakeups;
+            wake_hart(cpu_id);
+        }
+    }
+
+    void spawn_task(Task<void> task, size_t cpu_id)
+    {
+        auto handle = task.release();
+        TaskPromiseBase &promise = handle.promise();
+        promise.continuation = nullptr;
+        promise.cpu_id = cpu_id;
+        ++s_tasks.get().statistics.spawned;
+        schedule_task(promise);
+    }
+
+    void spawn_task(Task<void> task)
+    {
+        spawn_task(hls::move(task), get_cpu_id());
+    }
+
+    bool TaskSleep::await_ready() const noexcept
+    {
+        return _read_time() >= m_expires;
+    }
+
+    static void task_timer_callback(void *argument)
+    {
+        schedule_task(*reinterpret_cast<TaskPromiseBase *>(argument));
+    }
+
+    void TaskSleep::arm(TaskPromiseBase &promise)
+    {
+        // Tasks only run on their own hart, so the timer fires where the task gets resumed.
+        arm_timer(m_timer, m_expires, task_timer_callback, &promise);
+    }
+
+    TaskSleep task_sleep_until(uint64_t time)
+    {
+        return TaskSleep(time);
+    }
+
+    TaskSleep task_sleep_for(uint64_t microseconds)
+    {
+        return TaskSleep(_read_time() + time_from_microseconds(microseconds));
+    }
+
+    bool AsyncEvent::add_waiter(TaskPromiseBase &promise)
+    {
+        uintptr_t expected = EVENT_CLEAR;
+        if (m_state.compare_exchange(expected, to_uintptr_t(&promise), MemoryOrder::ACQ_REL))
+            return true;
+        if (expected != EVENT_SET)
+            PANIC("Two tasks are waiting on the same AsyncEvent.");
+        // Set in the meantime. The task goes on without suspending.
+        return false;
+    }
+
+    void AsyncEvent::set()
+    {
+        uintptr_t previous = m_state.exchange(EVENT_SET, MemoryOrder::ACQ_REL);
+        if (previous != EVENT_CLEAR && previous != EVENT_SET)
+            schedule_task(*reinterpret_cast<TaskPromiseBase *>(previous));
+    }
+
+    void AsyncEvent::reset()
+    {
+        m_state.store(EVENT_CLEAR, MemoryOrder::RELAXED);
+    }
+
+    bool AsyncEvent::is_set() const
+    {
+        return m_state.load(MemoryOrder::ACQUIRE) == EVENT_SET;
+    }
+
+    bool has_ready_tasks()
+    {
+        return atomic_load(&s_tasks.get().head, MemoryOrder::RELAXED) != nullptr;
+    }
+
+    void run_tasks()
+    {
+        TaskHartData &data = s_tasks.get();
+        if (!has_ready_tasks())
+            return;
+
+        // The whole queue is taken at once, which bounds the pass to the tasks that were ready when it began.
+        InterruptState state = data.lock.lock_irqsave();
+        TaskPromiseBase *batch = data.head;
+        data.head = nullptr;
+        data.tail = nullptr;
+        data.lock.unlock_irqrestore(state);
+
+        size_t count = 0;
+        while (batch != nullptr && count < TASK_BATCH_SIZE)
+        {
+            TaskPromiseBase *promise = batch;
+            batch = promise->next;
+            ++count;
+            // The task may finish and free its promise, or be queued again before resume returns.
+            promise->handle.resume();
+        }
+
+        if (count > data.statistics.largest_batch)
+            data.statistics.largest_batch = count;
+        data.statistics.resumes += count;
+        if (batch == nullptr)
+            return;
+
+        // Over budget. What is left goes back in front of what was queued meanwhile.
+        TaskPromiseBase *last = batch;
+        while (last->next != nullptr)
+            last = last->next;
+        state = data.lock.lock_irqsave();
+        last->next = data.head;
+        if (data.head == nullptr)
+            data.tail = last;
+        data.head = batch;
+        data.lock.unlock_irqrestore(state);
+    }
+
+    TaskStatistics &get_task_statistics(size_t cpu_id)
+    {
+        return s_tasks.get(cpu_id).statistics;
+    }
+
+    void print_task_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_task_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
@@ -0,0 +1,1116 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/thread.hpp"
+#include "mem/bumpallocator.hpp"
+#include "mem/mmap.hpp"
+#include "mem/nodeallocator.hpp"
+#include "sys/cpu.hpp"
+#include "sys/fpu.hpp"
+#include "sys/ipi.hpp"
+#include "sys/panic.hpp"
+#include "sys/perhart.hpp"
+#include "sys/preempt.hpp"
+#include "sys/print.hpp"
+#include "sys/rcu.hpp"
+#include "sys/smp.hpp"
+#include "sys/spinlock.hpp"
+#include "sys/timer.hpp"
+#include "ulib/work_deque.hpp"
+
+namespace hls
+{
+    // How much longer the queue of a hart must be than ours before balancing pulls a thread from it, by distance.
+    // Moving a thread away from the caches it warmed up only pays off past some imbalance, less so the farther.
+    constexpr size_t BALANCE_THRESHOLDS[HART_DISTANCE_COUNT] = {2, 4, 8};
+    // Runnable threads a thief looks at, from the far end of the queue, to find one that isn't pinned.
+    constexpr size_t STEAL_SCAN_LIMIT = 8;
+    constexpr uint64_t NICE_0_WEIGHT = 1024;
+
+    // Weight of each nice level, from NICE_MIN to NICE_MAX. Consecutive levels are 1.25 apart, the same table as
+    // Linux, so that nice values mean what people expect.
+    static const uint32_t s_nice_weights[NICE_MAX - NICE_MIN + 1] = {
+        88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620, 6100, 4904,
+        3906,  3121,  2501,  1991,  1586,  1277,  1024,  820,   655,   526,   423,   335,  272,  215,
+        172,   137,   110,   87,    70,    56,    45,    36,    29,    23,    18,    15};
+
+    struct RunQueueOrder
+    {
+        uint64_t vruntime;
+        size_t id;
+
+        bool operator<(const RunQueueOrder &other) const
+        {
+            return vruntime != other.vruntime ? vruntime < other.vruntime : id < other.id;
+        }
+    };
+
+    template <typename T>
+    class RunQueueKey
+    {
+        SET_USING_CLASS(T, type);
+        SET_USING_CLASS(RunQueueOrder, hash_result);
+
+      public:
+        hash_result operator()(type_const_reference entry) const
+        {
+            return {.vruntime = entry.vruntime, .id = entry.id};
+        }
+    };
+
+    // Builds tree nodes in the storage of the thread being queued.
+    template <typename T>
+    class RunNodeAllocator
+    {
+      public:
+        template <typename... Args>
+        T *create(const RunQueueEntry &entry, Args... args)
+        {
+            return new (entry.thread->run_node) T(entry, args...);
+        }
+
+        void destroy(const T *node)
+        {
+            const_cast<T *>(node)->~T();
+        }
+    };
+
+    struct RunQueue
+    {
+        // Taken by the owner and by harts stealing from it.
+        TicketLock lock;
+        RedBlackTree<RunQueueEntry, RunQueueKey, LessComparator, RunNodeAllocator> tree;
+        // Never goes back. New and migrating threads are placed relative to it.
+        uint64_t min_vruntime = 0;
+        // Sum of the weights of the queued threads. The running thread isn't queued.
+        uint64_t load = 0;
+    };
+
+    struct SchedulerHartData
+    {
+        // New threads waiting to be placed in the run queue. The owner pops at the bottom, and idle harts may take
+        // them from the top before the owner gets to them.
+        WorkStealingDeque<Thread *, THREAD_QUEUE_CAPACITY> inbox;
+        // Forked work items, which the owner takes newest first and other harts steal oldest first.
+        WorkStealingDeque<WorkItem *, WORK_QUEUE_CAPACITY> work;
+        Thread boot_thread;
+        // nullptr while the boot thread runs, as the per hart template can't point into the area of a given hart.
+        Thread *current = nullptr;
+        // Thread that ran before current, until current is done switching in.
+        Thread *previous = nullptr;
+        Thread *dead = nullptr;
+        Atomic<bool> idle = false;
+        // Set by harts that queued a woken thread here, for the next interrupt to check whether it preempts ours.
+        // A word, as byte sized atomics can only be loaded and stored.
+        Atomic<uint32_t> wakeup_pending = 0;
+        // Set by the first hart that woke this idle one up for forked work, so that others don't send IPIs as well.
+        Atomic<uint32_t> work_wakeup = 0;
+        bool need_resched = false;
+        size_t preempt_count = 0;
+        uint64_t ticks = 0;
+        Timer tick_timer;
+        // The tick is stopped while the hart idles or runs a single thread. The ticks avoided since tick_stopped_at
+        // are counted as idle or busy according to tick_stopped_idle.
+        bool tick_stopped = false;
+        bool tick_stopped_idle = false;
+        uint64_t tick_stopped_at = 0;
+        SchedulerStatistics statistics;
+    };
+
+    enum class SwitchReason
+    {
+        // The thread asked to let others run.
+        YIELD,
+        // The scheduler decided the thread had its share. It may keep running if it is still the most deserving.
+        PREEMPT,
+        // The thread can't go on, or is the boot thread looking for work.
+        STOP,
+        // The thread waits for an event. It carries on if it got woken up before getting here.
+        BLOCK
+    };
+
+    PER_HART static PerHart<SchedulerHartData> s_scheduler;
+    static Atomic<size_t> s_next_thread_id = 1;
+
+    // Scheduler periods in time CSR ticks, worked out from the *_US constants once the timebase is known.
+    static uint64_t s_tick_period = 0;
+    static uint64_t s_latency = 0;
+    static uint64_t s_min_granularity = 0;
+    static uint64_t s_wakeup_granularity = 0;
+
+    void SchedulerStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: {} switches, {} preemptions, {} steals, {} failed steals, {} migrations, {} balance pulls, "
+                 "{} idle wakeups. Ticks avoided: {} idle, {} busy. {} blocks, {} wakeups, {} remote. {} work items "
+                 "forked, {} stolen.",
+                 cpu_id, context_switches, preemptions, steals, failed_steals, migrations, balance_pulls,
+                 idle_wakeups, idle_ticks_avoided, busy_ticks_avoided, blocks, wakeups, remote_wakeups, work_forked,
+                 work_steals);
+    }
+
+    // Threads are created and reaped on every hart.
+    static TicketLock s_thread_allocator_lock;
+
+    static NodeAllocator<Thread> &get_thread_allocator()
+    {
+        static BumpAllocator bump_allocator(sizeof(Thread));
+        static NodeAllocator<Thread> allocator(bump_allocator);
+        return allocator;
+    }
+
+    static RunQueue &get_run_queue(size_t cpu_id)
+    {
+        // Trees point into themselves, so they can't be copied out of the per hart template like the rest.
+        static RunQueue s_run_queues[MAX_HARTS];
+        return s_run_queues[cpu_id];
+    }
+
+    static Thread *running_thread(SchedulerHartData &data)
+    {
+        return data.current != nullptr ? data.current : &data.boot_thread;
+    }
+
+    static uint32_t nice_to_weight(int nice)
+    {
+        if (nice < NICE_MIN)
+            nice = NICE_MIN;
+        if (nice > NICE_MAX)
+            nice = NICE_MAX;
+        return s_nice_weights[nice - NICE_MIN];
+    }
+
+    // Heavier threads age slower, which is what gives them a larger share.
+    static void account_runtime(Thread *thread, uint64_t now)
+    {
+        thread->vruntime += (now - thread->exec_start) * NICE_0_WEIGHT / thread->weight;
+        thread->exec_start = now;
+    }
+
+    // The run queue lock must be held by every function taking a RunQueue from here on.
+    static void insert_runnable(RunQueue &queue, Thread *thread)
+    {
+        thread->state = ThreadState::READY;
+        queue.tree.insert({.vruntime = thread->vruntime, .id = thread->id, .thread = thread});
+        queue.load += thread->weight;
+    }
+
+    static void remove_runnable(RunQueue &queue, Thread *thread)
+    {
+        queue.tree.remove(RunQueueEntry{.vruntime = thread->vruntime, .id = thread->id, .thread = thread});
+        queue.load -= thread->weight;
+    }
+
+    static Thread *get_leftmost(RunQueue &queue)
+    {
+        return queue.tree.size() != 0 ? queue.tree.begin()->thread : nullptr;
+    }
+
+    static void update_min_vruntime(RunQueue &queue, const Thread *running)
+    {
+        uint64_t vruntime = ~uint64_t(0);
+        if (running != nullptr)
+            vruntime = running->vruntime;
+        Thread *leftmost = get_leftmost(queue);
+        if (leftmost != nullptr && leftmost->vruntime < vruntime)
+            vruntime = leftmost->vruntime;
+        if (vruntime != ~uint64_t(0) && vruntime > queue.min_vruntime)
+            queue.min_vruntime = vruntime;
+    }
+
+    // New threads start level with the queue, so they neither wait behind everybody nor get to hog the hart.
+    static void drain_inbox(SchedulerHartData &data, RunQueue &queue)
+    {
+        Thread *thread = nullptr;
+        while (!data.inbox.empty() && data.inbox.pop(thread))
+        {
+            thread->vruntime = queue.min_vruntime;
+            insert_runnable(queue, thread);
+        }
+    }
+
+    static size_t get_queue_length(size_t cpu_id)
+    {
+        return get_run_queue(cpu_id).tree.size() + s_scheduler.get(cpu_id).inbox.size();
+    }
+
+    // Visits the other online harts, nearest first. Stops as soon as **function** returns true.
+    template <typename Function>
+    static void for_each_other_hart(size_t self, Function function)
+    {
+        size_t count = get_hart_count();
+        for (size_t distance = 0; distance < HART_DISTANCE_COUNT; ++distance)
+        {
+            for (size_t i = 1; i < count; ++i)
+            {
+                // Starting right after ourselves spreads thieves over the victims.
+                size_t cpu_id = (self + i) % count;
+                if (static_cast<size_t>(get_hart_distance(self, cpu_id)) != distance ||
+                    get_hart_state(cpu_id) != HartState::ONLINE)
+                    continue;
+                if (function(cpu_id, distance))
+                    return;
+            }
+        }
+    }
+
+    // Takes a thread another hart has waiting, new ones first as nothing of theirs is in a cache yet. Otherwise the
+    // one with the highest vruntime, which that hart would have run last. The vruntime returned is relative to the
+    // queue it came from.
+    static Thread *take_from(SchedulerHartData &data, size_t cpu_id)
+    {
+        SchedulerHartData &victim = s_scheduler.get(cpu_id);
+        Thread *thread = nullptr;
+        if (!victim.inbox.empty())
+        {
+            if (victim.inbox.steal(thread))
+            {
+                thread->vruntime = 0;
+                return thread;
+            }
+            ++data.statistics.failed_steals;
+        }
+
+        RunQueue &queue = get_run_queue(cpu_id);
+        queue.lock.lock();
+        size_t scanned = 0;
+        for (auto it = queue.tree.rbegin(); it != queue.tree.rend() && scanned < STEAL_SCAN_LIMIT; ++it, ++scanned)
+        {
+            if (it->thread->pinned)
+                continue;
+            thread = it->thread;
+            remove_runnable(queue, thread);
+            thread->vruntime = thread->vruntime > queue.min_vruntime ? thread->vruntime - queue.min_vruntime : 0;
+            break;
+        }
+        queue.lock.unlock();
+        return thread;
+    }
+
+    static Thread *steal_thread(SchedulerHartData &data, size_t self)
+    {
+        Thread *stolen = nullptr;
+        for_each_other_hart(self, [&](size_t cpu_id, size_t) {
+            stolen = take_from(data, cpu_id);
+            return stolen != nullptr;
+        });
+
+        if (stolen != nullptr)
+        {
+            ++data.statistics.steals;
+            stolen->vruntime += get_run_queue(self).min_vruntime;
+        }
+        return stolen;
+    }
+
+    static void pull_from_busiest(SchedulerHartData &data, size_t self)
+    {
+        size_t local = get_queue_length(self);
+        size_t busiest = self;
+        size_t largest_excess = 0;
+        for_each_other_hart(self, [&](size_t cpu_id, size_t distance) {
+            size_t length = get_queue_length(cpu_id);
+            if (length >= local + BALANCE_THRESHOLDS[distance] &&
+                length - local - BALANCE_THRESHOLDS[distance] + 1 > largest_excess)
+            {
+                largest_excess = length - local - BALANCE_THRESHOLDS[distance] + 1;
+                busiest = cpu_id;
+            }
+            return false;
+        });
+
+        if (busiest == self)
+            return;
+
+        Thread *thread = take_from(data, busiest);
+        if (thread == nullptr)
+            return;
+
+        ++data.statistics.balance_pulls;
+        RunQueue &queue = get_run_queue(self);
+        queue.lock.lock();
+        thread->vruntime += queue.min_vruntime;
+        insert_runnable(queue, thread);
+        queue.lock.unlock();
+    }
+
+    // Threads waiting behind the next one to run are better off on idle harts, nearest first.
+    static void wake_idle_harts(SchedulerHartData &data, size_t self)
+    {
+        size_t surplus = get_queue_length(self);
+        if (surplus < 2)
+            return;
+
+        --surplus;
+        // Pairs with scheduler_enter_idle: either we see the flag of an idle hart, or it sees our threads.
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        for_each_other_hart(self, [&](size_t cpu_id, size_t) {
+            if (!s_scheduler.get(cpu_id).idle.load(MemoryOrder::RELAXED))
+                return false;
+            wake_hart(cpu_id);
+            ++data.statistics.idle_wakeups;
+            return --surplus == 0;
+        });
+    }
+
+    // Runs on the thread that was switched to, which may be on another hart than the one it last left.
+    static void finish_switch()
+    {
+        s_scheduler.get().previous->on_cpu.store(false, MemoryOrder::RELEASE);
+    }
+
+    static void tick_callback(void *)
+    {
+        scheduler_tick();
+    }
+
+    static void account_avoided_ticks(SchedulerHartData &data, uint64_t now)
+    {
+        uint64_t avoided = (now - data.tick_stopped_at) / s_tick_period;
+        if (data.tick_stopped_idle)
+            data.statistics.idle_ticks_avoided += avoided;
+        else
+            data.statistics.busy_ticks_avoided += avoided;
+        data.tick_stopped_at += avoided * s_tick_period;
+    }
+
+    // Stops the tick if it runs, and counts the ticks avoided from now on as idle or busy ones.
+    static void stop_tick(SchedulerHartData &data, bool idle)
+    {
+        uint64_t now = _read_time();
+        if (data.tick_stopped)
+            account_avoided_ticks(data, now);
+        else
+        {
+            cancel_timer(data.tick_timer);
+            data.tick_stopped = true;
+            data.tick_stopped_at = now;
+        }
+        data.tick_stopped_idle = idle;
+    }
+
+    // Called whenever a thread gets queued behind the running one, which then needs the tick to be preempted.
+    static void restart_tick(SchedulerHartData &data)
+    {
+        if (!data.tick_stopped)
+            return;
+
+        uint64_t now = _read_time();
+        account_avoided_ticks(data, now);
+        data.tick_stopped = false;
+        arm_timer(data.tick_timer, now + s_tick_period, tick_callback, nullptr, s_tick_period);
+    }
+
+    // Interrupts must be masked, so that no handler runs between saving one thread and resuming the other.
+    static void schedule(SchedulerHartData &data, SwitchReason reason)
+    {
+        size_t self = get_cpu_id();
+        RunQueue &queue = get_run_queue(self);
+        Thread *from = running_thread(data);
+        bool is_boot_thread = from == &data.boot_thread;
+        uint64_t now = _read_time();
+        if (!is_boot_thread)
+            account_runtime(from, now);
+
+        queue.lock.lock();
+        // Wakers take the same lock, which settles whether a blocking thread still has to go.
+        if (reason == SwitchReason::BLOCK)
+        {
+            if (from->state == ThreadState::RUNNING)
+            {
+                queue.lock.unlock();
+                return;
+            }
+            from->state = ThreadState::BLOCKED;
+            ++data.statistics.blocks;
+        }
+
+        bool runnable = from->state == ThreadState::RUNNING;
+        bool requeue = runnable && !is_boot_thread;
+        data.need_resched = false;
+        drain_inbox(data, queue);
+        // A preempted thread competes with the queue and may win. A yielding one lets anybody else go first.
+        if (requeue && reason == SwitchReason::PREEMPT)
+            insert_runnable(queue, from);
+        Thread *to = get_leftmost(queue);
+        if (to != nullptr)
+            remove_runnable(queue, to);
+        if (requeue && reason != SwitchReason::PREEMPT && to != nullptr)
+            insert_runnable(queue, from);
+        update_min_vruntime(queue, to != nullptr ? to : (requeue ? from : nullptr));
+        bool others_waiting = queue.tree.size() != 0;
+        queue.lock.unlock();
+        if (others_waiting || !data.inbox.empty())
+            restart_tick(data);
+
+        if (to == from || (to == nullptr && requeue))
+        {
+            // Still the most deserving, or nobody else wants the hart.
+            from->state = ThreadState::RUNNING;
+            from->slice_start = now;
+            return;
+        }
+
+        if (to == nullptr && (to = steal_thread(data, self)) == nullptr)
+        {
+            // The boot thread carries on when there is nothing to do. Threads that stopped hand over to it.
+            if (runnable)
+                return;
+            to = &data.boot_thread;
+        }
+
+        if (is_boot_thread && runnable)
+            from->state = ThreadState::READY;
+        if (reason == SwitchReason::PREEMPT)
+            ++data.statistics.preemptions;
+
+        // A thread stolen right after another hart queued it may still be saving its registers over there.
+        while (to->on_cpu.load(MemoryOrder::ACQUIRE))
+            cpu_relax();
+        to->on_cpu.store(true, MemoryOrder::RELAXED);
+        to->state = ThreadState::RUNNING;
+        to->exec_start = now;
+        to->slice_start = now;
+        if (to->last_cpu != self)
+            ++data.statistics.migrations;
+        to->last_cpu = self;
+
+        data.previous = from;
+        data.current = to == &data.boot_thread ? nullptr : to;
+        ++data.statistics.context_switches;
+        if (from->state == ThreadState::DEAD)
+            fpu_discard(from->extensions);
+        else
+            fpu_switch_out(from->extensions);
+        _switch_context(&from->context, &to->context);
+        finish_switch();
+    }
+
+    static void thread_main(void *argument)
+    {
+        finish_switch();
+        // schedule() switched to us with interrupts masked.
+        enable_interrupts();
+        Thread *thread = reinterpret_cast<Thread *>(argument);
+        thread->function(thread->argument);
+        thread_exit();
+    }
+
+    void initialize_scheduler()
+    {
+        s_tick_period = get_timebase_frequency() / SCHEDULER_TICK_HZ;
+        s_latency = time_from_microseconds(SCHEDULER_LATENCY_US);
+        s_min_granularity = time_from_microseconds(SCHEDULER_MIN_GRANULARITY_US);
+        s_wakeup_granularity = time_from_microseconds(SCHEDULER_WAKEUP_GRANULARITY_US);
+    }
+
+    void start_scheduler_tick()
+    {
+        arm_timer(s_scheduler.get().tick_timer, _read_time() + s_tick_period, tick_callback, nullptr, s_tick_period);
+    }
+
+    void scheduler_tick()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        uint64_t now = _read_time();
+
+        size_t self = get_cpu_id();
+        if (++data.ticks % SCHEDULER_BALANCE_TICKS == 0)
+        {
+            pull_from_busiest(data, self);
+            wake_idle_harts(data, self);
+        }
+
+        Thread *current = running_thread(data);
+        bool is_boot_thread = current == &data.boot_thread;
+        if (!is_boot_thread)
+            account_runtime(current, now);
+        RunQueue &queue = get_run_queue(self);
+        queue.lock.lock();
+        bool others_waiting = queue.tree.size() != 0;
+        uint64_t load = queue.load + current->weight;
+        if (!is_boot_thread)
+            update_min_vruntime(queue, current);
+        queue.lock.unlock();
+        others_waiting = others_waiting || !data.inbox.empty();
+
+        // A single runnable thread has nobody to be preempted for, and the boot thread isn't preempted anyway. The
+        // tick comes back once a thread is queued behind it.
+        if (!others_waiting)
+        {
+            stop_tick(data, false);
+            return;
+        }
+        if (is_boot_thread)
+            return;
+
+        // The latency target is split among the runnable threads by weight.
+        uint64_t slice = s_latency * current->weight / load;
+        if (slice < s_min_granularity)
+            slice = s_min_granularity;
+        if (others_waiting && now - current->slice_start >= slice)
+            data.need_resched = true;
+    }
+
+    static void preempt(SchedulerHartData &data)
+    {
+        if (data.need_resched && data.preempt_count == 0 && data.current != nullptr)
+            schedule(data, SwitchReason::PREEMPT);
+    }
+
+    // A thread got queued behind the running one, which may have to give way to it, and needs the tick to be
+    // preempted otherwise.
+    static void check_preempt_wakeup(SchedulerHartData &data, size_t self)
+    {
+        RunQueue &queue = get_run_queue(self);
+        Thread *current = running_thread(data);
+        queue.lock.lock();
+        Thread *leftmost = get_leftmost(queue);
+        if (leftmost != nullptr && current != &data.boot_thread &&
+            current->vruntime > leftmost->vruntime + s_wakeup_granularity)
+            data.need_resched = true;
+        queue.lock.unlock();
+        wake_idle_harts(data, self);
+        restart_tick(data);
+    }
+
+    void preempt_from_interrupt()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        if (data.wakeup_pending.load(MemoryOrder::RELAXED) != 0 &&
+            data.wakeup_pending.exchange(0, MemoryOrder::ACQUIRE) != 0)
+            check_preempt_wakeup(data, get_cpu_id());
+        preempt(data);
+    }
+
+    void preempt_disable()
+    {
+        // The count belongs to the hart. Until it is raised, a tick may move us to another hart between finding the
+        // count and storing it back, so that happens with interrupts masked.
+        InterruptState state = disable_interrupts();
+        ++s_scheduler.get().preempt_count;
+        restore_interrupts(state);
+        asm volatile("" : : : "memory");
+    }
+
+    // For switches asked for outside of an interrupt handler, or while preemption was disabled. The hart is only
+    // looked up with interrupts masked, as we may be moved to another one until then.
+    static void preempt_if_needed()
+    {
+        InterruptState state = disable_interrupts();
+        // With interrupts masked the caller may be in the middle of something the switch must not interrupt.
+        if (state != 0)
+            preempt(s_scheduler.get());
+        restore_interrupts(state);
+    }
+
+    void preempt_enable()
+    {
+        asm volatile("" : : : "memory");
+        InterruptState state = disable_interrupts();
+        SchedulerHartData &data = s_scheduler.get();
+        --data.preempt_count;
+        if (state != 0)
+            preempt(data);
+        restore_interrupts(state);
+    }
+
+    bool is_preemptible()
+    {
+        return s_scheduler.get().preempt_count == 0;
+    }
+
+    static Result<Thread *> allocate_thread(ThreadFunction function, void *argument, const char *name, int nice,
+                                            bool pinned, size_t cpu_id)
+    {
+        auto stack = VMMap::get_global_instance().allocate_stack(KERNEL_STACK_SIZE);
+        if (stack.is_error())
+            return error<Thread *>(stack.get_error());
+
+        s_thread_allocator_lock.lock();
+        Thread *thread = get_thread_allocator().create();
+        s_thread_allocator_lock.unlock();
+        thread->pinned = pinned;
+        thread->last_cpu = cpu_id;
+        thread->nice = nice;
+        thread->weight = nice_to_weight(nice);
+        thread->stack_top = stack.get_value();
+        thread->function = function;
+        thread->argument = argument;
+        thread->name = name;
+        thread->id = s_next_thread_id.fetch_add(1, MemoryOrder::RELAXED);
+        _initialize_context(&thread->context, thread->stack_top, thread_main, thread);
+        return value(thread);
+    }
+
+    // Gives back what allocate_thread took.
+    static void free_thread(Thread *thread)
+    {
+        VMMap::get_global_instance().free_stack(thread->stack_top, KERNEL_STACK_SIZE);
+        fpu_release(thread->extensions);
+        s_thread_allocator_lock.lock();
+        get_thread_allocator().destroy(thread);
+        s_thread_allocator_lock.unlock();
+    }
+
+    Result<Thread *> create_thread(ThreadFunction function, void *argument, const char *name, int nice, bool pinned)
+    {
+        auto result = allocate_thread(function, argument, name, nice, pinned, get_cpu_id());
+        if (result.is_error())
+            return error<Thread *>(result.get_error());
+        Thread *thread = result.get_value();
+
+        // Allocating may have let us be preempted and moved, so the hart is only picked with interrupts masked.
+        InterruptState state = disable_interrupts();
+        size_t self = get_cpu_id();
+        SchedulerHartData &data = s_scheduler.get();
+        if (!pinned && data.inbox.size() >= THREAD_QUEUE_CAPACITY)
+        {
+            restore_interrupts(state);
+            free_thread(thread);
+            return error<Thread *>(Error::VALUE_LIMIT_REACHED);
+        }
+
+        thread->last_cpu = self;
+        RunQueue &queue = get_run_queue(self);
+        // Pinned threads skip the inbox, where other harts could take them.
+        if (pinned)
+        {
+            queue.lock.lock();
+            thread->vruntime = queue.min_vruntime;
+            insert_runnable(queue, thread);
+            queue.lock.unlock();
+        }
+        else if (!data.inbox.push(thread))
+            PANIC("Thread inbox overflow.");
+
+        // The new thread starts at min_vruntime. A running thread far ahead of that gives way right now.
+        Thread *current = running_thread(data);
+        if (current != &data.boot_thread && current->vruntime > queue.min_vruntime + s_wakeup_granularity)
+            data.need_resched = true;
+        wake_idle_harts(data, self);
+        restart_tick(data);
+        restore_interrupts(state);
+
+        preempt_if_needed();
+        return value(thread);
+    }
+
+    Result<Thread *> create_pinned_thread(size_t cpu_id, ThreadFunction function, void *argument, const char *name,
+                                          int nice)
+    {
+        auto result = allocate_thread(function, argument, name, nice, true, cpu_id);
+        if (result.is_error())
+            return error<Thread *>(result.get_error());
+        Thread *thread = result.get_value();
+
+        InterruptState state = disable_interrupts();
+        RunQueue &queue = get_run_queue(cpu_id);
+        queue.lock.lock();
+        thread->vruntime = queue.min_vruntime;
+        insert_runnable(queue, thread);
+        queue.lock.unlock();
+        // We may have moved while allocating, so whether the target is this hart is only known now.
+        size_t self = get_cpu_id();
+        if (cpu_id == self)
+            check_preempt_wakeup(s_scheduler.get(), self);
+        else
+        {
+            // Same as a remote wakeup: the hart decides whether to preempt on its way out of the IPI.
+            s_scheduler.get(cpu_id).wakeup_pending.store(1, MemoryOrder::RELEASE);
+            wake_hart(cpu_id);
+        }
+        restore_interrupts(state);
+
+        preempt_if_needed();
+        return value(thread);
+    }
+
+    Thread *get_current_thread()
+    {
+        return running_thread(s_scheduler.get());
+    }
+
+    void thread_set_nice(int nice)
+    {
+        Thread *thread = get_current_thread();
+        // The running thread isn't queued, so no run queue load needs fixing.
+        thread->nice = nice < NICE_MIN ? NICE_MIN : (nice > NICE_MAX ? NICE_MAX : nice);
+        thread->weight = nice_to_weight(nice);
+    }
+
+    void thread_yield()
+    {
+        // Read side sections can't span a switch, which makes it a quiescent state.
+        rcu_quiescent_state();
+        InterruptState state = disable_interrupts();
+        schedule(s_scheduler.get(), SwitchReason::YIELD);
+        restore_interrupts(state);
+    }
+
+    bool thread_can_block()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        return running_thread(data) != &data.boot_thread;
+    }
+
+    void thread_prepare_block()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        Thread *thread = running_thread(data);
+        if (thread == &data.boot_thread)
+            PANIC("The boot thread of a hart can't block.");
+        thread->state = ThreadState::BLOCKING;
+    }
+
+    void thread_block()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        if (data.preempt_count != 0)
+            PANIC("Blocking with preemption disabled.");
+
+        rcu_quiescent_state();
+        InterruptState state = disable_interrupts();
+        schedule(data, SwitchReason::BLOCK);
+        restore_interrupts(state);
+    }
+
+    bool wake_thread(Thread *thread)
+    {
+        InterruptState state = disable_interrupts();
+        size_t self = get_cpu_id();
+        SchedulerHartData &data = s_scheduler.get();
+        // A waiting thread stays on the hart it last ran on until woken, and decides to block under its queue lock.
+        size_t cpu_id = thread->last_cpu;
+        RunQueue &queue = get_run_queue(cpu_id);
+        queue.lock.lock();
+        ThreadState previous = thread->state;
+        if (previous == ThreadState::BLOCKING)
+            thread->state = ThreadState::RUNNING;
+        else if (previous == ThreadState::BLOCKED)
+        {
+            uint64_t floor = queue.min_vruntime > s_latency / 2 ? queue.min_vruntime - s_latency / 2 : 0;
+            if (thread->vruntime < floor)
+                thread->vruntime = floor;
+            insert_runnable(queue, thread);
+        }
+        queue.lock.unlock();
+
+        bool woken = previous == ThreadState::BLOCKING || previous == ThreadState::BLOCKED;
+        if (previous == ThreadState::BLOCKED)
+        {
+            ++data.statistics.wakeups;
+            if (cpu_id == self)
+                check_preempt_wakeup(data, self);
+            else
+            {
+                // That hart checks for preemption on its way out of the IPI, or finds the thread as it leaves idle.
+                ++data.statistics.remote_wakeups;
+                s_scheduler.get(cpu_id).wakeup_pending.store(1, MemoryOrder::RELEASE);
+                wake_hart(cpu_id);
+            }
+        }
+        restore_interrupts(state);
+
+        preempt_if_needed();
+        return woken;
+    }
+
+    void thread_exit()
+    {
+        rcu_quiescent_state();
+        disable_interrupts();
+        SchedulerHartData &data = s_scheduler.get();
+        Thread *thread = running_thread(data);
+        if (thread == &data.boot_thread)
+            PANIC("The boot thread of a hart can't exit.");
+
+        // We are still on the stack being given up, so freeing it is left to the boot thread.
+        thread->state = ThreadState::DEAD;
+        thread->next = data.dead;
+        data.dead = thread;
+        schedule(data, SwitchReason::STOP);
+        PANIC("A dead thread was resumed.");
+    }
+
+    // Forked items are popped and pushed by the owner of the deque, so these run with preemption disabled, which keeps
+    // the thread on its hart. Interrupt handlers don't touch the deques.
+    static bool pop_work_item(WorkItem *&item)
+    {
+        preempt_disable();
+        SchedulerHartData &data = s_scheduler.get();
+        bool found = !data.work.empty() && data.work.pop(item);
+        preempt_enable();
+        return found;
+    }
+
+    static bool steal_work_item(WorkItem *&item)
+    {
+        preempt_disable();
+        SchedulerHartData &data = s_scheduler.get();
+        bool found = false;
+        for_each_other_hart(get_cpu_id(), [&](size_t cpu_id, size_t) {
+            auto &victim = s_scheduler.get(cpu_id).work;
+            found = !victim.empty() && victim.steal(item);
+            return found;
+        });
+        if (found)
+            ++data.statistics.work_steals;
+        preempt_enable();
+        return found;
+    }
+
+    static void run_work_item(WorkItem *item)
+    {
+        WorkGroup *group = item->group;
+        item->function(item->argument);
+        // The joiner may free the item and the group as soon as it sees the count drop.
+        group->pending.fetch_sub(1, MemoryOrder::RELEASE);
+    }
+
+    // Other harts may have work while ours is busy, which is what idle harts are for.
+    static bool has_stealable_work(size_t self)
+    {
+        bool found = false;
+        for_each_other_hart(self, [&](size_t cpu_id, size_t) {
+            found = !s_scheduler.get(cpu_id).work.empty();
+            return found;
+        });
+        return found;
+    }
+
+    // Wakes up the nearest idle hart nobody woke up for work yet.
+    static void wake_idle_hart_for_work(size_t self)
+    {
+        // Pairs with scheduler_enter_idle: either we see the flag of an idle hart, or it sees our work.
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        for_each_other_hart(self, [](size_t cpu_id, size_t) {
+            SchedulerHartData &target = s_scheduler.get(cpu_id);
+            if (!target.idle.load(MemoryOrder::RELAXED) || target.work_wakeup.exchange(1, MemoryOrder::RELAXED) != 0)
+                return false;
+            wake_hart(cpu_id);
+            return true;
+        });
+    }
+
+    void fork_work(WorkGroup &group, WorkItem &item, WorkFunction function, void *argument)
+    {
+        item.function = function;
+        item.argument = argument;
+        item.group = &group;
+        group.pending.fetch_add(1, MemoryOrder::RELAXED);
+
+        preempt_disable();
+        SchedulerHartData &data = s_scheduler.get();
+        bool queued = data.work.push(&item);
+        if (queued)
+        {
+            ++data.statistics.work_forked;
+            wake_idle_hart_for_work(get_cpu_id());
+        }
+        preempt_enable();
+
+        if (!queued)
+            run_work_item(&item);
+    }
+
+    void join_work(WorkGroup &group)
+    {
+        while (group.pending.load(MemoryOrder::ACQUIRE) != 0)
+        {
+            // Our own items first, as they are the most likely to still be in our cache. Items of other groups
+            // forked on this hart are fair game too: they have to run at some point anyway.
+            WorkItem *item = nullptr;
+            if (pop_work_item(item) || steal_work_item(item))
+                run_work_item(item);
+            else
+                cpu_relax();
+        }
+    }
+
+    void run_stolen_work()
+    {
+        WorkItem *item = nullptr;
+        while (steal_work_item(item))
+            run_work_item(item);
+    }
+
+    bool scheduler_enter_idle()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        data.idle.store(true, MemoryOrder::RELAXED);
+        atomic_thread_fence(MemoryOrder::SEQ_CST);
+        RunQueue &queue = get_run_queue(get_cpu_id());
+        queue.lock.lock();
+        bool has_work = queue.tree.size() != 0;
+        queue.lock.unlock();
+        if (has_work || !data.inbox.empty() || has_stealable_work(get_cpu_id()))
+        {
+            data.idle.store(false, MemoryOrder::RELAXED);
+            return false;
+        }
+
+        // Timers other than the tick still wake the hart up.
+        stop_tick(data, true);
+        return true;
+    }
+
+    void scheduler_exit_idle()
+    {
+        SchedulerHartData &data = s_scheduler.get();
+        data.idle.store(false, MemoryOrder::RELAXED);
+        data.work_wakeup.store(0, MemoryOrder::RELAXED);
+        // Whatever woke us up may just be a single thread to run, which doesn't need the tick either.
+        if (data.tick_stopped)
+            stop_tick(data, false);
+    }
+
+    void reap_threads()
+    {
+        InterruptState state = disable_interrupts();
+        SchedulerHartData &data = s_scheduler.get();
+        Thread *dead = data.dead;
+        data.dead = nullptr;
+        restore_interrupts(state);
+
+        while (dead != nullptr)
+        {
+            Thread *next = dead->next;
+            free_thread(dead);
+            dead = next;
+        }
+    }
+
+    uint64_t get_context_switch_count()
+    {
+        return s_scheduler.get().statistics.context_switches;
+    }
+
+    SchedulerStatistics &get_scheduler_statistics(size_t cpu_id)
+    {
+        return s_scheduler.get(cpu_id).statistics;
+    }
+
+    void print_scheduler_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_scheduler_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+    static void ping_pong(void *argument)
+    {
+        size_t round_trips = *reinterpret_cast<size_t *>(argument);
+        for (size_t i = 0; i < round_trips; ++i)
+            thread_yield();
+    }
+
+    void run_context_switch_benchmark(size_t round_trips)
+    {
+        // Pinned, so that idle harts don't take one of them away and leave the other yielding to nobody.
+        auto ping = create_thread(ping_pong, &round_trips, "ping", NICE_DEFAULT, true);
+        auto pong = create_thread(ping_pong, &round_trips, "pong", NICE_DEFAULT, true);
+        if (ping.is_error() || pong.is_error())
+        {
+            kprintln("Context switch benchmark skipped, threads couldn't be created.");
+            return;
+        }
+
+        uint64_t switches = get_context_switch_count();
+        uint64_t start = _read_time();
+        // The boot thread isn't queued, so this only returns once both threads exited.
+        thread_yield();
+        uint64_t ticks = _read_time() - start;
+        switches = get_context_switch_count() - switches;
+        reap_threads();
+
+        uint64_t frequency = get_timebase_frequency();
+        if (frequency == 0 || ticks == 0)
+        {
+            kprintln("{} context switches in {} ticks.", switches, ticks);
+            return;
+        }
+        kprintln("{} context switches in {} us, {} switches per second.", switches, ticks * 1000000 / frequency,
+                 switches * frequency / ticks);
+    }
+
+    struct ForkJoinBenchmarkItem
+    {
+        WorkItem work;
+        size_t rounds = 0;
+        uint64_t result = 0;
+        size_t cpu_id = 0;
+    };
+
+    static void fork_join_busy_work(void *argument)
+    {
+        auto item = reinterpret_cast<ForkJoinBenchmarkItem *>(argument);
+        // A xorshift sequence, whose result is kept so that the loop can't be optimised away.
+        uint64_t x = item->rounds + 1;
+        for (size_t i = 0; i < item->rounds; ++i)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+        item->result = x;
+        item->cpu_id = get_cpu_id();
+    }
+
+    void run_fork_join_benchmark(size_t items, size_t rounds)
+    {
+        static ForkJoinBenchmarkItem s_items[FORK_JOIN_BENCHMARK_ITEMS];
+        if (items > FORK_JOIN_BENCHMARK_ITEMS)
+            items = FORK_JOIN_BENCHMARK_ITEMS;
+
+        WorkGroup group;
+        uint64_t start = _read_time();
+        for (size_t i = 0; i < items; ++i)
+        {
+            s_items[i].rounds = rounds;
+            fork_work(group, s_items[i].work, fork_join_busy_work, &s_items[i]);
+        }
+        join_work(group);
+        uint64_t ticks = _read_time() - start;
+
+        size_t self = get_cpu_id();
+        size_t elsewhere = 0;
+        for (size_t i = 0; i < items; ++i)
+        {
+            if (s_items[i].cpu_id != self)
+                ++elsewhere;
+        }
+
+        uint64_t frequency = get_timebase_frequency();
+        if (frequency == 0)
+        {
+            kprintln("{} fork/join items in {} ticks, {} ran on other harts.", items, ticks, elsewhere);
+            return;
+        }
+        kprintln("{} fork/join items in {} us, {} ran on other harts.", items, ticks * 1000000 / frequency, elsewhere);
+    }
+
+} // namespace hls
@@ -0,0 +1,366 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/timer.hpp"
+#include "plat_def.hpp"
+#include "sys/cpu.hpp"
+#include "sys/perhart.hpp"
+#include "sys/print.hpp"
+#include "sys/smp.hpp"
+#include "sys/spinlock.hpp"
+#include "ulib/atomic.hpp"
+
+namespace hls
+{
+    constexpr uint64_t SLOT_MASK = TIMER_WHEEL_SLOTS - 1;
+    constexpr uint64_t NO_EXPIRATION = ~uint64_t(0);
+    constexpr uint64_t DE_BRUIJN_SEQUENCE = 0x03F79D71B4CB0A89;
+
+    static_assert(TIMER_WHEEL_SLOTS == 64, "Slot occupancy is tracked in a 64 bit mask per level.");
+
+    /**
+     * @brief Classic hierarchical timing wheel. Level 0 has a slot per TIMER_RESOLUTION_US, and each slot of a higher
+     * level spans a whole turn of the level below. Timers are filed by how far away they are, and move down a level
+     * each time the level below wraps around, until they expire from level 0.
+     */
+    struct TimerWheel
+    {
+        // The interrupt handler takes it too, so others take it with interrupts masked.
+        TicketLock lock;
+        Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS] = {};
+        // Bit i of a level is set when its slot i holds timers.
+        uint64_t occupied[TIMER_WHEEL_LEVELS] = {};
+        // Next slot to expire. Every earlier one has been run.
+        uint64_t current = 0;
+        // Slot the hardware timer is set to fire at.
+        uint64_t programmed = NO_EXPIRATION;
+        TimerStatistics statistics;
+    };
+
+    PER_HART static PerHart<TimerWheel> s_wheels;
+    // Time CSR ticks per slot.
+    static uint64_t s_slot_length = 1;
+
+    static const uint8_t s_de_bruijn_positions[64] = {
+        0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,  62, 55, 59, 36, 53, 51,
+        43, 22, 45, 39, 33, 30, 24, 18, 12, 5,  63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21,
+        44, 32, 23, 11, 46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+
+    void TimerStatistics::print(size_t cpu_id) const
+    {
+        kprintln("cpu {}: {} timer interrupts, {} expirations, {} coalesced, {} cascaded.", cpu_id, interrupts,
+                 expirations, coalesced, cascaded);
+    }
+
+    // __builtin_ctzll becomes a libgcc call on harts without Zbb, and we don't link libgcc. **value** must not be 0.
+    static size_t lowest_set_bit(uint64_t value)
+    {
+        return s_de_bruijn_positions[((value & -value) * DE_BRUIJN_SEQUENCE) >> 58];
+    }
+
+    // Rounded up, so that timers never fire early.
+    static uint64_t time_to_slot(uint64_t time)
+    {
+        return time / s_slot_length + (time % s_slot_length != 0);
+    }
+
+    static void push_timer(Timer **list, Timer *timer)
+    {
+        timer->list = list;
+        timer->previous = nullptr;
+        timer->next = *list;
+        if (*list != nullptr)
+            (*list)->previous = timer;
+        *list = timer;
+    }
+
+    static void unlink_timer(Timer *timer)
+    {
+        if (timer->previous != nullptr)
+            timer->previous->next = timer->next;
+        else
+            *timer->list = timer->next;
+        if (timer->next != nullptr)
+            timer->next->previous = timer->previous;
+        timer->next = nullptr;
+        timer->previous = nullptr;
+        timer->list = nullptr;
+    }
+
+    static void enqueue(TimerWheel &wheel, Timer *timer)
+    {
+        uint64_t slot = timer->expires_slot < wheel.current ? wheel.current : timer->expires_slot;
+        uint64_t delta = slot - wheel.current;
+        size_t level = 0;
+        while (level + 1 < TIMER_WHEEL_LEVELS && delta >> (TIMER_WHEEL_LEVEL_BITS * (level + 1)) != 0)
+            ++level;
+
+        // Beyond the reach of the wheel. Filed again from the last slot when it comes around.
+        constexpr uint64_t reach = uint64_t(1) << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS);
+        if (delta >= reach)
+            slot = wheel.current + reach - 1;
+
+        size_t index = (slot >> (TIMER_WHEEL_LEVEL_BITS * level)) & SLOT_MASK;
+        push_timer(&wheel.slots[level][index], timer);
+        wheel.occupied[level] |= uint64_t(1) << index;
+    }
+
+    static void dequeue(TimerWheel &wheel, Timer *timer)
+    {
+        Timer **list = timer->list;
+        unlink_timer(timer);
+        if (*list != nullptr)
+            return;
+
+        // Lists of expired timers being run aren't part of the wheel.
+        uintptr_t first = reinterpret_cast<uintptr_t>(&wheel.slots[0][0]);
+        uintptr_t address = reinterpret_cast<uintptr_t>(list);
+        if (address < first || address >= first + sizeof(wheel.slots))
+            return;
+        size_t index = (address - first) / sizeof(Timer *);
+        wheel.occupied[index / TIMER_WHEEL_SLOTS] &= ~(uint64_t(1) << (index % TIMER_WHEEL_SLOTS));
+    }
+
+    // Called when level 0 wraps around. Refiles the timers of the slots of the upper levels whose turn it now is.
+    static void cascade(TimerWheel &wheel)
+    {
+        for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+        {
+            size_t index = (wheel.current >> (TIMER_WHEEL_LEVEL_BITS * level)) & SLOT_MASK;
+            Timer *list = wheel.slots[level][index];
+            wheel.slots[level][index] = nullptr;
+            wheel.occupied[level] &= ~(uint64_t(1) << index);
+            while (list != nullptr)
+            {
+                Timer *timer = list;
+                list = timer->next;
+                enqueue(wheel, timer);
+                ++wheel.statistics.cascaded;
+            }
+
+            // The level above only moves when this one wrapped around too.
+            if (index != 0)
+                break;
+        }
+    }
+
+    // The next slot holding timers, or the next cascade if level 0 is empty until then. Never later than the first
+    // expiration.
+    static uint64_t next_expiration(const TimerWheel &wheel)
+    {
+        uint64_t next = NO_EXPIRATION;
+        size_t index = wheel.current & SLOT_MASK;
+        uint64_t occupied = wheel.occupied[0];
+        if (occupied != 0)
+        {
+            uint64_t rotated = index != 0 ? (occupied >> index) | (occupied << (TIMER_WHEEL_SLOTS - index)) : occupied;
+            next = wheel.current + lowest_set_bit(rotated);
+        }
+
+        for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+        {
+            if (wheel.occupied[level] == 0)
+                continue;
+            uint64_t boundary = index != 0 ? (wheel.current | SLOT_MASK) + 1 : wheel.current;
+            if (boundary < next)
+                next = boundary;
+            break;
+        }
+
+        return next;
+    }
+
+    static void program_timer(TimerWheel &wheel, uint64_t slot)
+    {
+        wheel.programmed = slot;
+        _set_timer(slot != NO_EXPIRATION ? slot * s_slot_length : NO_EXPIRATION);
+    }
+
+    void initialize_timers()
+    {
+        s_slot_length = time_from_microseconds(TIMER_RESOLUTION_US);
+        if (s_slot_length == 0)
+            s_slot_length = 1;
+        enable_timers();
+    }
+
+    void enable_timers()
+    {
+        TimerWheel &wheel = s_wheels.get();
+        wheel.current = _read_time() / s_slot_length;
+        program_timer(wheel, NO_EXPIRATION);
+        _enable_timer_interrupts();
+    }
+
+    void arm_timer(Timer &timer, uint64_t expires, TimerCallback callback, void *argument, uint64_t period)
+    {
+        cancel_timer(timer);
+
+        InterruptState state = disable_interrupts();
+        TimerWheel &wheel = s_wheels.get();
+        wheel.lock.lock();
+        timer.callback = callback;
+        timer.argument = argument;
+        timer.expires = expires;
+        timer.expires_slot = time_to_slot(expires);
+        timer.period = period;
+        atomic_store(&timer.cpu_id, get_cpu_id(), MemoryOrder::RELAXED);
+        enqueue(wheel, &timer);
+        // Only ever brought forward here. A timer firing too early finds nothing to do and sets the right time.
+        uint64_t next = next_expiration(wheel);
+        if (next < wheel.programmed)
+            program_timer(wheel, next);
+        wheel.lock.unlock();
+        restore_interrupts(state);
+    }
+
+    bool cancel_timer(Timer &timer)
+    {
+        InterruptState state = disable_interrupts();
+        while (true)
+        {
+            size_t cpu_id = atomic_load(&timer.cpu_id, MemoryOrder::RELAXED);
+            TimerWheel &wheel = s_wheels.get(cpu_id);
+            wheel.lock.lock();
+            // The timer may have been armed on another hart in the meantime.
+            if (timer.cpu_id != cpu_id)
+            {
+                wheel.lock.unlock();
+                continue;
+            }
+
+            bool armed = timer.list != nullptr;
+            if (armed)
+                dequeue(wheel, &timer);
+            // Pushed back too, which spares a hart going idle an interrupt for a timer it no longer has. Other harts'
+            // comparators can't be written from here, they find out when the interrupt comes.
+            uint64_t next = next_expiration(wheel);
+            if (armed && cpu_id == get_cpu_id() && next != wheel.programmed)
+                program_timer(wheel, next);
+            wheel.lock.unlock();
+            restore_interrupts(state);
+            return armed;
+        }
+    }
+
+    bool is_timer_armed(const Timer &timer)
+    {
+        return timer.list != nullptr;
+    }
+
+    void handle_timer_interrupt()
+    {
+        TimerWheel &wheel = s_wheels.get();
+        uint64_t now = _read_time();
+        uint64_t last = now / s_slot_length;
+        size_t fired = 0;
+
+        wheel.lock.lock();
+        ++wheel.statistics.interrupts;
+        while (wheel.current <= last)
+        {
+            if ((wheel.current & SLOT_MASK) == 0)
+                cascade(wheel);
+
+            // Taken off the wheel before anything runs, so that timers armed by the callbacks for the current slot
+            // land in the next one rather than being run right away.
+            size_t index = wheel.current & SLOT_MASK;
+            Timer *expired = wheel.slots[0][index];
+            wheel.slots[0][index] = nullptr;
+            wheel.occupied[0] &= ~(uint64_t(1) << index);
+            for (Timer *timer = expired; timer != nullptr; timer = timer->next)
+                timer->list = &expired;
+            ++wheel.current;
+
+            while (expired != nullptr)
+            {
+                Timer *timer = expired;
+                unlink_timer(timer);
+                if (timer->period != 0)
+                {
+                    // Periods missed while interrupts were masked are dropped rather than run back to back.
+                    timer->expires += timer->period;
+                    if (timer->expires <= now)
+                        timer->expires += ((now - timer->expires) / timer->period + 1) * timer->period;
+                    timer->expires_slot = time_to_slot(timer->expires);
+                    enqueue(wheel, timer);
+                }
+
+                TimerCallback callback = timer->callback;
+                void *argument = timer->argument;
+                ++wheel.statistics.expirations;
+                if (fired++ != 0)
+                    ++wheel.statistics.coalesced;
+                wheel.lock.unlock();
+                callback(argument);
+                wheel.lock.lock();
+            }
+
+            // Nothing else expires before level 0 wraps around, so the empty slots in between are skipped.
+            if (wheel.occupied[0] == 0 && (wheel.current & SLOT_MASK) != 0)
+            {
+                uint64_t boundary = (wheel.current | SLOT_MASK) + 1;
+                wheel.current = boundary <= last ? boundary : last + 1;
+            }
+        }
+
+        // Always written, as that is also what clears the pending interrupt.
+        program_timer(wheel, next_expiration(wheel));
+        wheel.lock.unlock();
+    }
+
+    uint64_t time_from_microseconds(uint64_t microseconds)
+    {
+        uint64_t frequency = get_timebase_frequency();
+        return microseconds / 1000000 * frequency + microseconds % 1000000 * frequency / 1000000;
+    }
+
+    uint64_t get_next_timer_expiration()
+    {
+        uint64_t slot = s_wheels.get().programmed;
+        return slot != NO_EXPIRATION ? slot * s_slot_length : NO_EXPIRATION;
+    }
+
+    uint64_t time_to_microseconds(uint64_t time)
+    {
+        uint64_t frequency = get_timebase_frequency();
+        return time / frequency * 1000000 + time % frequency * 1000000 / frequency;
+    }
+
+    TimerStatistics &get_timer_statistics(size_t cpu_id)
+    {
+        return s_wheels.get(cpu_id).statistics;
+    }
+
+    void print_timer_statistics()
+    {
+        for (size_t cpu_id = 0; cpu_id < get_hart_count(); ++cpu_id)
+        {
+            if (get_hart_state(cpu_id) == HartState::ONLINE)
+                get_timer_statistics(cpu_id).print(cpu_id);
+        }
+    }
+
+} // namespace hls
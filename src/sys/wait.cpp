@@ -0,0 +1,157 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "sys/wait.hpp"
+#include "sys/thread.hpp"
+
+namespace hls
+{
+    // complete_all sets the count to this, which consuming leaves as is.
+    constexpr uint32_t COMPLETION_ALL = ~uint32_t(0);
+
+    void WaitQueue::enqueue(WaitQueueEntry &entry)
+    {
+        entry.next = nullptr;
+        entry.previous = m_tail;
+        if (m_tail != nullptr)
+            m_tail->next = &entry;
+        else
+            m_head = &entry;
+        m_tail = &entry;
+    }
+
+    void WaitQueue::remove(WaitQueueEntry &entry)
+    {
+        if (entry.previous != nullptr)
+            entry.previous->next = entry.next;
+        else
+            m_head = entry.next;
+        if (entry.next != nullptr)
+            entry.next->previous = entry.previous;
+        else
+            m_tail = entry.previous;
+    }
+
+    void WaitQueue::block(WaitQueueEntry &entry, InterruptState state)
+    {
+        entry.thread = get_current_thread();
+        bool can_block = thread_can_block();
+        // Before the entry can be seen, so that a wakeup coming right after the unlock cancels the block instead of
+        // being lost. Interrupts stay masked until thread_block, as thread_prepare_block requires.
+        if (can_block)
+            thread_prepare_block();
+        enqueue(entry);
+        m_lock.unlock();
+
+        if (can_block)
+            thread_block();
+        else
+        {
+            // The boot thread has nobody to hand the hart to when everything else waits, so it runs the others while
+            // it polls.
+            while (entry.woken.load(MemoryOrder::ACQUIRE) == 0)
+            {
+                restore_interrupts(state);
+                thread_yield();
+                cpu_relax();
+                disable_interrupts();
+            }
+        }
+        restore_interrupts(state);
+    }
+
+    size_t WaitQueue::wake(size_t count, const void *key)
+    {
+        size_t woken = 0;
+        InterruptState state = m_lock.lock_irqsave();
+        WaitQueueEntry *entry = m_head;
+        while (entry != nullptr && woken < count)
+        {
+            WaitQueueEntry *next = entry->next;
+            if (key == nullptr || entry->key == nullptr || entry->key == key)
+            {
+                remove(*entry);
+                // The waiter may return, and its entry go away, as soon as woken is set.
+                Thread *thread = entry->thread;
+                entry->woken.store(1, MemoryOrder::RELEASE);
+                wake_thread(thread);
+                ++woken;
+            }
+            entry = next;
+        }
+        m_lock.unlock_irqrestore(state);
+        return woken;
+    }
+
+    bool WaitQueue::has_waiters() const
+    {
+        return atomic_load(&m_head, MemoryOrder::RELAXED) != nullptr;
+    }
+
+    bool Completion::try_consume()
+    {
+        uint32_t done = m_done.load(MemoryOrder::ACQUIRE);
+        while (done != 0)
+        {
+            if (done == COMPLETION_ALL || m_done.compare_exchange(done, done - 1, MemoryOrder::ACQUIRE))
+                return true;
+        }
+        return false;
+    }
+
+    void Completion::wait()
+    {
+        m_waiters.wait_until([this] { return try_consume(); });
+    }
+
+    bool Completion::try_wait()
+    {
+        return try_consume();
+    }
+
+    void Completion::complete()
+    {
+        uint32_t done = m_done.load(MemoryOrder::RELAXED);
+        do
+        {
+            // Counts saturate short of COMPLETION_ALL.
+            if (done == COMPLETION_ALL || done == COMPLETION_ALL - 1)
+                break;
+        } while (!m_done.compare_exchange_weak(done, done + 1, MemoryOrder::RELEASE));
+        m_waiters.wake_one();
+    }
+
+    void Completion::complete_all()
+    {
+        m_done.store(COMPLETION_ALL, MemoryOrder::RELEASE);
+        m_waiters.wake_all();
+    }
+
+    void Completion::reinitialize()
+    {
+        m_done.store(0, MemoryOrder::RELAXED);
+    }
+
+} // namespace hls
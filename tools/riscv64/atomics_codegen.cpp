@@ -0,0 +1,113 @@
+/*---------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2024 Helio Nunes Santos
+
+        Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+        copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+        copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+---------------------------------------------------------------------------------*/
+
+#include "ulib/atomic.hpp"
+
+using namespace hls;
+
+// Each probe wraps a single operation of ulib/atomic.hpp. check_atomics.awk disassembles them and compares the
+// instructions against the mapping documented at the top of the header.
+extern "C"
+{
+    uint64_t probe_load_relaxed(const uint64_t *address)
+    {
+        return atomic_load(address, MemoryOrder::RELAXED);
+    }
+
+    uint64_t probe_load_acquire(const uint64_t *address)
+    {
+        return atomic_load(address, MemoryOrder::ACQUIRE);
+    }
+
+    uint64_t probe_load_seq_cst(const uint64_t *address)
+    {
+        return atomic_load(address, MemoryOrder::SEQ_CST);
+    }
+
+    void probe_store_relaxed(uint64_t *address, uint64_t value)
+    {
+        atomic_store(address, value, MemoryOrder::RELAXED);
+    }
+
+    void probe_store_release(uint64_t *address, uint64_t value)
+    {
+        atomic_store(address, value, MemoryOrder::RELEASE);
+    }
+
+    void probe_store_seq_cst(uint64_t *address, uint64_t value)
+    {
+        atomic_store(address, value, MemoryOrder::SEQ_CST);
+    }
+
+    uint64_t probe_fetch_add_relaxed(uint64_t *address, uint64_t value)
+    {
+        return atomic_fetch_add(address, value, MemoryOrder::RELAXED);
+    }
+
+    uint64_t probe_fetch_add_acquire(uint64_t *address, uint64_t value)
+    {
+        return atomic_fetch_add(address, value, MemoryOrder::ACQUIRE);
+    }
+
+    uint64_t probe_fetch_add_release(uint64_t *address, uint64_t value)
+    {
+        return atomic_fetch_add(address, value, MemoryOrder::RELEASE);
+    }
+
+    uint64_t probe_fetch_add_seq_cst(uint64_t *address, uint64_t value)
+    {
+        return atomic_fetch_add(address, value, MemoryOrder::SEQ_CST);
+    }
+
+    uint32_t probe_fetch_add_32(uint32_t *address, uint32_t value)
+    {
+        return atomic_fetch_add(address, value);
+    }
+
+    uint64_t probe_exchange(uint64_t *address, uint64_t value)
+    {
+        return atomic_exchange(address, value);
+    }
+
+    bool probe_compare_exchange(uint64_t *address, uint64_t expected, uint64_t desired)
+    {
+        return atomic_compare_exchange(address, expected, desired);
+    }
+
+    bool probe_compare_exchange_32(uint32_t *address, uint32_t expected, uint32_t desired)
+    {
+        return atomic_compare_exchange(address, expected, desired);
+    }
+
+    bool probe_test_and_set_bit(uint64_t *bitmap, size_t bit)
+    {
+        return atomic_test_and_set_bit(bitmap, bit);
+    }
+
+    bool probe_test_and_clear_bit(uint64_t *bitmap, size_t bit)
+    {
+        return atomic_test_and_clear_bit(bitmap, bit);
+    }
+}
@@ -0,0 +1,111 @@
+# Checks `objdump -d` output of atomics_codegen.cpp against the instruction mapping documented in
+# inc/ulib/atomic.hpp. Only fences, 32 and 64 bit loads and stores, AMOs and lr/sc are compared. Accesses relative to
+# sp or s0 belong to the frame and are ignored. Older compilers emit fence iorw,iorw where newer ones use the lighter
+# fences of the RVWMO mapping, so both are accepted.
+
+function hex_to_number(text,    i, n)
+{
+    n = 0
+    for (i = 1; i <= length(text); ++i)
+        n = n * 16 + index("0123456789abcdef", substr(tolower(text), i, 1)) - 1
+    return n
+}
+
+# Assemblers without Zacas print amocas as a raw word, which is decoded here.
+function decode_raw(word,    n, funct7, funct3)
+{
+    n = hex_to_number(word)
+    funct7 = int(n / 33554432)
+    funct3 = int(n / 4096) % 8
+    if (n % 128 == 47 && funct7 == 23 && funct3 == 3)
+        return "amocas.d.aqrl"
+    if (n % 128 == 47 && funct7 == 23 && funct3 == 2)
+        return "amocas.w.aqrl"
+    return ""
+}
+
+function finish_probe()
+{
+    if (probe != "")
+        seen[probe] = substr(sequence, 2)
+    probe = ""
+    sequence = ""
+}
+
+BEGIN {
+    FULL = "fence (rw,rw|iorw,iorw)"
+    ACQUIRE = "fence (r,rw|rw,rw|iorw,iorw)"
+    RELEASE = "fence (rw,w|rw,rw|iorw,iorw)"
+
+    expect["probe_load_relaxed"] = "^ld$"
+    expect["probe_load_acquire"] = "^ld " ACQUIRE "$"
+    expect["probe_load_seq_cst"] = "^" FULL " ld " ACQUIRE "$"
+    expect["probe_store_relaxed"] = "^sd$"
+    expect["probe_store_release"] = "^" RELEASE " sd$"
+    expect["probe_store_seq_cst"] = "^" RELEASE " sd( " FULL ")?$"
+    expect["probe_fetch_add_relaxed"] = "^amoadd\\.d$"
+    expect["probe_fetch_add_acquire"] = "^amoadd\\.d\\.aq$"
+    expect["probe_fetch_add_release"] = "^amoadd\\.d\\.rl$"
+    expect["probe_fetch_add_seq_cst"] = "^amoadd\\.d\\.aqrl$"
+    expect["probe_fetch_add_32"] = "^amoadd\\.w\\.aqrl$"
+    expect["probe_exchange"] = "^amoswap\\.d\\.aqrl$"
+    expect["probe_compare_exchange"] = "amocas\\.d\\.aqrl"
+    expect["probe_compare_exchange_32"] = "amocas\\.w\\.aqrl"
+    expect["probe_test_and_set_bit"] = "^amoor\\.d\\.aqrl$"
+    expect["probe_test_and_clear_bit"] = "^amoand\\.d\\.aqrl$"
+    # Without Zacas, compare-exchange falls back to an lr/sc loop.
+    fallback["probe_compare_exchange"] = "lr\\.d\\.aq(rl)? sc\\.d\\.(aq)?rl"
+    fallback["probe_compare_exchange_32"] = "lr\\.w\\.aq(rl)? sc\\.w\\.(aq)?rl"
+}
+
+/^[0-9a-f]+ <[A-Za-z0-9_.]+>:$/ {
+    finish_probe()
+    name = $2
+    gsub(/[<>:]/, "", name)
+    if (name in expect)
+        probe = name
+    next
+}
+
+probe != "" && NF > 0 {
+    fields = split($0, column, "\t")
+    if (fields < 3)
+        next
+    mnemonic = column[3]
+    operands = fields > 3 ? column[4] : ""
+    gsub(/ /, "", mnemonic)
+    gsub(/ /, "", operands)
+    if (mnemonic == ".4byte" || mnemonic == ".insn" || mnemonic == ".word")
+    {
+        raw = column[2]
+        gsub(/ /, "", raw)
+        mnemonic = decode_raw(raw)
+    }
+    if (mnemonic == "fence")
+        sequence = sequence " fence " operands
+    else if (mnemonic ~ /^(ld|sd|lw|sw)$/ && operands !~ /\((sp|s0)\)/)
+        sequence = sequence " " mnemonic
+    else if (mnemonic ~ /^(amo|lr\.|sc\.)/)
+        sequence = sequence " " mnemonic
+}
+
+END {
+    finish_probe()
+    failed = 0
+    for (name in expect)
+    {
+        if (!(name in seen))
+        {
+            print "Missing probe " name
+            failed = 1
+        }
+        else if (seen[name] !~ expect[name] || (name in fallback && seen[name] !~ fallback[name]))
+        {
+            print name ": unexpected instructions \"" seen[name] "\""
+            failed = 1
+        }
+    }
+    if (!failed)
+        print "Atomics generate the documented instructions."
+    exit failed
+}